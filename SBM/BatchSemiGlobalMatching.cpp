@@ -0,0 +1,184 @@
+#include "BatchSemiGlobalMatching.h"
+#include <algorithm>
+#include <climits>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "ThreadPool.h"
+
+#ifndef SAFE_DELETE
+#define SAFE_DELETE(P) {if(P) delete[](P);(P)=nullptr;}
+#endif
+
+BatchSemiGlobalMatching::BatchSemiGlobalMatching() : width_(0), height_(0), num_workers_(0), num_results_(0), pool_(nullptr),
+matchers_(nullptr), results_(nullptr), confidences_(nullptr), is_initialized_(false)
+{
+}
+
+BatchSemiGlobalMatching::~BatchSemiGlobalMatching()
+{
+	Release();
+}
+
+void BatchSemiGlobalMatching::ResolveOption(const BatchOption& batch_option, int32_t& num_workers, int32_t& num_results)
+{
+	num_workers = batch_option.num_workers;
+	if (num_workers <= 0) {
+		num_workers = std::max(1, static_cast<int32_t>(std::thread::hardware_concurrency()));
+	}
+	num_results = (batch_option.num_results > 0) ? std::max(batch_option.num_results, num_workers) : 2 * num_workers;
+}
+
+SemiGlobalMatching::SGMOption BatchSemiGlobalMatching::MatcherOption(const SemiGlobalMatching::SGMOption& option)
+{
+	SemiGlobalMatching::SGMOption matcher_option = option;
+	matcher_option.is_temporal = false;
+	return matcher_option;
+}
+
+size_t BatchSemiGlobalMatching::RequiredMemory(const int32_t& width, const int32_t& height, const SemiGlobalMatching::SGMOption& option,
+	const BatchOption& batch_option)
+{
+	const size_t matcher = SemiGlobalMatching::RequiredMemory(width, height, MatcherOption(option));
+	if (matcher == 0) {
+		return 0;
+	}
+	int32_t num_workers, num_results;
+	ResolveOption(batch_option, num_workers, num_results);
+	const size_t maps = (option.confidence != sgm_kernels::ConfidenceMeasure::None) ? 2 : 1;
+	return num_workers * matcher + num_results * maps * static_cast<size_t>(width) * height * sizeof(float);
+}
+
+bool BatchSemiGlobalMatching::Initialize(const int32_t& width, const int32_t& height, const SemiGlobalMatching::SGMOption& option,
+	const BatchOption& batch_option)
+{
+	Release();
+
+	width_ = width;
+	height_ = height;
+	option_ = option;
+	if (width <= 0 || height <= 0) {
+		return false;
+	}
+	ResolveOption(batch_option, num_workers_, num_results_);
+
+	matchers_ = new SemiGlobalMatching[num_workers_];
+	for (int32_t k = 0; k < num_workers_; k++) {
+		if (!matchers_[k].Initialize(width, height, MatcherOption(option))) {
+			Release();
+			return false;
+		}
+	}
+	const size_t img_size = static_cast<size_t>(width) * height;
+	results_ = new float[num_results_ * img_size]();
+	if (option.confidence != sgm_kernels::ConfidenceMeasure::None) {
+		confidences_ = new float[num_results_ * img_size]();
+	}
+	pool_ = new ThreadPool(num_workers_);
+
+	is_initialized_ = true;
+	return is_initialized_;
+}
+
+bool BatchSemiGlobalMatching::Match(const SemiGlobalMatching::FrameSource& source, const ResultSink& sink)
+{
+	if (!is_initialized_) {
+		return false;
+	}
+
+	const size_t img_size = static_cast<size_t>(width_) * height_;
+	const int64_t num_results = num_results_;
+
+	// Pairs [next_delivery, next_index) are being matched or wait for delivery in their result buffer. A worker
+	// takes a new pair only when its buffer is free, and whoever finds the next pair ready delivers it. After a
+	// failure no pair is taken, the ones before it are still delivered.
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::vector<bool> is_ready(num_results_, false);
+	int64_t next_index = 0;
+	int64_t next_delivery = 0;
+	int64_t end_index = INT64_MAX;
+	bool is_drained = false;
+	bool is_delivering = false;
+	bool is_ok = true;
+
+	pool_->ParallelFor(num_workers_, [&](int32_t worker) {
+		SemiGlobalMatching& matcher = matchers_[worker];
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			cond.wait(lock, [&]() { return is_drained || !is_ok || next_index < next_delivery + num_results; });
+			if (is_drained || !is_ok) {
+				return;
+			}
+			SemiGlobalMatching::StereoFrame frame;
+			if (!source(frame)) {
+				is_drained = true;
+				cond.notify_all();
+				return;
+			}
+			if (frame.img_left == nullptr || frame.img_right == nullptr) {
+				end_index = std::min(end_index, next_index);
+				is_ok = false;
+				cond.notify_all();
+				return;
+			}
+			const int64_t index = next_index++;
+			const size_t slot = static_cast<size_t>(index % num_results);
+			lock.unlock();
+
+			float* disp = results_ + slot * img_size;
+			const bool is_matched = (confidences_ != nullptr) ?
+				matcher.Match(frame.img_left, frame.img_right, disp, confidences_ + slot * img_size) :
+				matcher.Match(frame.img_left, frame.img_right, disp);
+
+			lock.lock();
+			if (!is_matched) {
+				end_index = std::min(end_index, index);
+				is_ok = false;
+				cond.notify_all();
+				return;
+			}
+			is_ready[slot] = true;
+			if (is_delivering) {
+				continue;
+			}
+			is_delivering = true;
+			while (next_delivery < end_index && is_ready[next_delivery % num_results]) {
+				const size_t ready = static_cast<size_t>(next_delivery % num_results);
+				lock.unlock();
+				sink(next_delivery, results_ + ready * img_size, (confidences_ != nullptr) ? confidences_ + ready * img_size : nullptr);
+				lock.lock();
+				is_ready[ready] = false;
+				next_delivery++;
+				cond.notify_all();
+			}
+			is_delivering = false;
+		}
+	});
+
+	return is_ok;
+}
+
+bool BatchSemiGlobalMatching::Match(const std::vector<SemiGlobalMatching::StereoFrame>& pairs, const ResultSink& sink)
+{
+	size_t next = 0;
+	return Match([&pairs, &next](SemiGlobalMatching::StereoFrame& frame) {
+		if (next == pairs.size()) {
+			return false;
+		}
+		frame = pairs[next++];
+		return true;
+	}, sink);
+}
+
+void BatchSemiGlobalMatching::Release()
+{
+	delete pool_;
+	pool_ = nullptr;
+	SAFE_DELETE(matchers_);
+	SAFE_DELETE(results_);
+	SAFE_DELETE(confidences_);
+	num_workers_ = 0;
+	num_results_ = 0;
+	is_initialized_ = false;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "SemiGlobalMatching.h"
+
+class ThreadPool;
+
+// Matches many same-size pairs at once: every worker owns one SemiGlobalMatching with its buffers and takes
+// the next pair when it is done with the previous one. Finished disparity maps wait in a bounded set of
+// result buffers until every earlier pair was handed on, so the results arrive in order and the memory
+// stays fixed however many pairs there are.
+class BatchSemiGlobalMatching
+{
+public:
+	BatchSemiGlobalMatching();
+	~BatchSemiGlobalMatching();
+
+	BatchSemiGlobalMatching(const BatchSemiGlobalMatching&) = delete;
+	BatchSemiGlobalMatching& operator=(const BatchSemiGlobalMatching&) = delete;
+
+	struct BatchOption {
+		int32_t	num_workers;		// pairs matched at the same time, 0 = one per hardware thread. Each matcher runs option.num_threads threads
+		int32_t	num_results;		// finished maps held for in-order delivery, at least num_workers, 0 = 2 * num_workers
+
+		BatchOption() : num_workers(0), num_results(0)
+		{
+		}
+	};
+
+	// Receives the disparity map of pair 'index' and its confidence map (nullptr when option.confidence is None),
+	// in index order and valid until the sink returns.
+	typedef std::function<void(const int64_t& index, const float* disp_left, const float* confidence)> ResultSink;
+
+	bool Initialize(const int32_t& width, const int32_t& height, const SemiGlobalMatching::SGMOption& option,
+		const BatchOption& batch_option);
+
+	// Matches pairs until the source runs dry. Source and sink are called by one worker at a time, and the images
+	// of a pair must stay valid until its result reached the sink. Stops at the first pair that fails.
+	bool Match(const SemiGlobalMatching::FrameSource& source, const ResultSink& sink);
+
+	bool Match(const std::vector<SemiGlobalMatching::StereoFrame>& pairs, const ResultSink& sink);
+
+	// Bytes Initialize() allocates for this size and option.
+	static size_t RequiredMemory(const int32_t& width, const int32_t& height, const SemiGlobalMatching::SGMOption& option,
+		const BatchOption& batch_option);
+
+	int32_t NumWorkers() const { return num_workers_; }
+
+private:
+	// Worker count and result buffers after the defaults.
+	static void ResolveOption(const BatchOption& batch_option, int32_t& num_workers, int32_t& num_results);
+
+	// A worker's pairs are not consecutive frames, so its matcher runs without temporal mode.
+	static SemiGlobalMatching::SGMOption MatcherOption(const SemiGlobalMatching::SGMOption& option);
+
+	void Release();
+
+	int32_t width_;
+	int32_t height_;
+	SemiGlobalMatching::SGMOption option_;
+
+	int32_t num_workers_;
+	int32_t num_results_;
+	ThreadPool* pool_;
+	SemiGlobalMatching* matchers_;
+
+	// num_results_ disparity (and confidence) maps, a pair's map sits at index % num_results_.
+	float* results_;
+	float* confidences_;
+
+	bool is_initialized_;
+};
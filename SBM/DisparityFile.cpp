@@ -0,0 +1,234 @@
+#include "DisparityFile.h"
+#include <cstring>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static_assert(sizeof(DisparityFileHeader) == 64, "DisparityFileHeader is 64 bytes on disk");
+
+static const char kDisparityFileMagic[4] = { 'S', 'G', 'M', 'D' };
+
+// Plane offsets keep the cache line alignment of the mapping.
+static uint64_t AlignPlane(const uint64_t& offset)
+{
+	return (offset + 63) / 64 * 64;
+}
+
+DisparityFile::DisparityFile() : data_(nullptr), size_(0), is_writable_(false),
+#ifdef _WIN32
+file_(INVALID_HANDLE_VALUE), mapping_(nullptr)
+#else
+fd_(-1)
+#endif
+{
+}
+
+DisparityFile::~DisparityFile()
+{
+	Close();
+}
+
+bool DisparityFile::Create(const std::string& path, const int32_t& width, const int32_t& height, const int32_t& min_disparity,
+	const int32_t& max_disparity, const bool& has_confidence, const int32_t& cost_row, const int32_t& cost_rows)
+{
+	Close();
+
+	const int32_t disp_range = max_disparity - min_disparity;
+	if (width <= 0 || height <= 0 || disp_range <= 0 || cost_rows < 0 || (cost_rows > 0 && (cost_row < 0 || cost_row + cost_rows > height))) {
+		return false;
+	}
+
+	DisparityFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kDisparityFileMagic, sizeof(header.magic));
+	header.version = kDisparityFileVersion;
+	header.width = width;
+	header.height = height;
+	header.min_disparity = min_disparity;
+	header.max_disparity = max_disparity;
+	header.cost_row = (cost_rows > 0) ? cost_row : 0;
+	header.cost_rows = cost_rows;
+
+	const uint64_t plane_bytes = static_cast<uint64_t>(width) * height * sizeof(float);
+	uint64_t offset = AlignPlane(sizeof(header));
+	header.disparity_offset = offset;
+	offset = AlignPlane(offset + plane_bytes);
+	if (has_confidence) {
+		header.confidence_offset = offset;
+		offset = AlignPlane(offset + plane_bytes);
+	}
+	if (cost_rows > 0) {
+		header.cost_offset = offset;
+		offset += static_cast<uint64_t>(cost_rows) * width * disp_range * sizeof(uint16_t);
+	}
+	header.file_size = offset;
+	if (header.file_size > SIZE_MAX) {
+		return false;
+	}
+
+	if (!Map(path, static_cast<size_t>(header.file_size), true)) {
+		return false;
+	}
+	memcpy(data_, &header, sizeof(header));
+	return true;
+}
+
+bool DisparityFile::Open(const std::string& path)
+{
+	Close();
+	if (!Map(path, 0, false)) {
+		return false;
+	}
+
+	// Every plane has to lie inside the mapping.
+	const DisparityFileHeader& header = Header();
+	const uint64_t size = size_;
+	bool is_ok = size >= sizeof(DisparityFileHeader) && memcmp(header.magic, kDisparityFileMagic, sizeof(header.magic)) == 0 &&
+		header.version == kDisparityFileVersion && header.file_size == size &&
+		header.width > 0 && header.height > 0 && header.max_disparity > header.min_disparity && header.cost_rows >= 0;
+	if (is_ok) {
+		const uint64_t plane_bytes = static_cast<uint64_t>(header.width) * header.height * sizeof(float);
+		const uint64_t cost_bytes = static_cast<uint64_t>(header.cost_rows) * header.width *
+			(static_cast<int64_t>(header.max_disparity) - header.min_disparity) * sizeof(uint16_t);
+		auto fits = [&](const uint64_t& offset, const uint64_t& bytes) {
+			return offset == 0 || (offset % 64 == 0 && offset >= sizeof(DisparityFileHeader) && bytes <= size && offset <= size - bytes);
+		};
+		is_ok = header.disparity_offset != 0 && fits(header.disparity_offset, plane_bytes) &&
+			fits(header.confidence_offset, plane_bytes) && fits(header.cost_offset, cost_bytes) &&
+			(header.cost_rows == 0 || (header.cost_offset != 0 && header.cost_row >= 0 && header.cost_row <= header.height - header.cost_rows));
+	}
+	if (!is_ok) {
+		Close();
+	}
+	return is_ok;
+}
+
+#ifdef _WIN32
+
+bool DisparityFile::Map(const std::string& path, const size_t& size, const bool& is_writable)
+{
+	file_ = CreateFileA(path.c_str(), is_writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ, FILE_SHARE_READ, nullptr,
+		is_writable ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file_ == INVALID_HANDLE_VALUE) {
+		return false;
+	}
+	LARGE_INTEGER file_size;
+	if (is_writable) {
+		file_size.QuadPart = static_cast<LONGLONG>(size);
+	}
+	else if (!GetFileSizeEx(file_, &file_size)) {
+		Close();
+		return false;
+	}
+	if (file_size.QuadPart == 0) {
+		Close();
+		return false;
+	}
+	mapping_ = CreateFileMappingA(file_, nullptr, is_writable ? PAGE_READWRITE : PAGE_READONLY,
+		static_cast<DWORD>(file_size.QuadPart >> 32), static_cast<DWORD>(file_size.QuadPart & 0xFFFFFFFF), nullptr);
+	if (mapping_ == nullptr) {
+		Close();
+		return false;
+	}
+	data_ = static_cast<uint8_t*>(MapViewOfFile(mapping_, is_writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+	if (data_ == nullptr) {
+		Close();
+		return false;
+	}
+	size_ = static_cast<size_t>(file_size.QuadPart);
+	is_writable_ = is_writable;
+	return true;
+}
+
+bool DisparityFile::Flush()
+{
+	if (data_ == nullptr || !is_writable_) {
+		return false;
+	}
+	return FlushViewOfFile(data_, 0) != 0 && FlushFileBuffers(file_) != 0;
+}
+
+void DisparityFile::Close()
+{
+	if (data_ != nullptr) {
+		UnmapViewOfFile(data_);
+	}
+	if (mapping_ != nullptr) {
+		CloseHandle(mapping_);
+	}
+	if (file_ != INVALID_HANDLE_VALUE) {
+		CloseHandle(file_);
+	}
+	data_ = nullptr;
+	mapping_ = nullptr;
+	file_ = INVALID_HANDLE_VALUE;
+	size_ = 0;
+	is_writable_ = false;
+}
+
+#else
+
+bool DisparityFile::Map(const std::string& path, const size_t& size, const bool& is_writable)
+{
+	fd_ = is_writable ? open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644) : open(path.c_str(), O_RDONLY);
+	if (fd_ < 0) {
+		return false;
+	}
+	size_t map_size = size;
+	if (is_writable) {
+		if (ftruncate(fd_, static_cast<off_t>(size)) != 0) {
+			Close();
+			return false;
+		}
+	}
+	else {
+		struct stat info;
+		if (fstat(fd_, &info) != 0) {
+			Close();
+			return false;
+		}
+		map_size = static_cast<size_t>(info.st_size);
+	}
+	if (map_size == 0) {
+		Close();
+		return false;
+	}
+	void* data = mmap(nullptr, map_size, is_writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd_, 0);
+	if (data == MAP_FAILED) {
+		Close();
+		return false;
+	}
+	data_ = static_cast<uint8_t*>(data);
+	size_ = map_size;
+	is_writable_ = is_writable;
+	return true;
+}
+
+bool DisparityFile::Flush()
+{
+	if (data_ == nullptr || !is_writable_) {
+		return false;
+	}
+	return msync(data_, size_, MS_SYNC) == 0;
+}
+
+void DisparityFile::Close()
+{
+	if (data_ != nullptr) {
+		munmap(data_, size_);
+	}
+	if (fd_ >= 0) {
+		close(fd_);
+	}
+	data_ = nullptr;
+	fd_ = -1;
+	size_ = 0;
+	is_writable_ = false;
+}
+
+#endif
@@ -0,0 +1,84 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Binary result of a match for offline pipelines: float disparities, an optional confidence plane and an
+// optional band of aggregated costs, behind a 64-byte header. The file is written and read through a memory
+// mapping, so a reader gets the planes without copying or decoding them.
+//
+// Native byte order (little-endian on every supported target). The planes start at the 64-byte aligned
+// offsets of the header, an offset of 0 marks a plane that is absent.
+struct DisparityFileHeader {
+	char		magic[4];			// "SGMD"
+	uint32_t	version;			// kDisparityFileVersion
+	int32_t		width;
+	int32_t		height;
+	int32_t		min_disparity;
+	int32_t		max_disparity;
+	int32_t		cost_row;			// first image row of the cost slice
+	int32_t		cost_rows;			// rows of the cost slice, 0 = none
+	uint64_t	disparity_offset;	// width * height floats, INVALID_FLOAT where no disparity was found
+	uint64_t	confidence_offset;	// width * height floats in [0, 1]
+	uint64_t	cost_offset;		// cost_rows * width * (max_disparity - min_disparity) uint16_t, see SemiGlobalMatching::CostSlice()
+	uint64_t	file_size;
+};
+
+const uint32_t kDisparityFileVersion = 1;
+
+class DisparityFile
+{
+public:
+	DisparityFile();
+	~DisparityFile();
+
+	DisparityFile(const DisparityFile&) = delete;
+	DisparityFile& operator=(const DisparityFile&) = delete;
+
+	// Creates (or truncates) the file at its final size and maps it writable. The planes read zero until
+	// they are filled through the Mutable*() pointers, e.g. by passing MutableDisparity() to Match().
+	bool Create(const std::string& path, const int32_t& width, const int32_t& height, const int32_t& min_disparity,
+		const int32_t& max_disparity, const bool& has_confidence, const int32_t& cost_row, const int32_t& cost_rows);
+
+	// Maps an existing file read-only, fails for a header that does not match the file.
+	bool Open(const std::string& path);
+
+	// Writes the pages of a created file back to disk.
+	bool Flush();
+
+	void Close();
+
+	bool IsOpen() const { return data_ != nullptr; }
+
+	// Only while the file is open.
+	const DisparityFileHeader& Header() const { return *reinterpret_cast<const DisparityFileHeader*>(data_); }
+
+	// nullptr for an absent plane or a closed file.
+	const float* Disparity() const { return reinterpret_cast<const float*>(Plane(&DisparityFileHeader::disparity_offset)); }
+	const float* Confidence() const { return reinterpret_cast<const float*>(Plane(&DisparityFileHeader::confidence_offset)); }
+	const uint16_t* CostSlice() const { return reinterpret_cast<const uint16_t*>(Plane(&DisparityFileHeader::cost_offset)); }
+
+	// nullptr unless the file was created.
+	float* MutableDisparity() { return is_writable_ ? const_cast<float*>(Disparity()) : nullptr; }
+	float* MutableConfidence() { return is_writable_ ? const_cast<float*>(Confidence()) : nullptr; }
+	uint16_t* MutableCostSlice() { return is_writable_ ? const_cast<uint16_t*>(CostSlice()) : nullptr; }
+
+private:
+	const uint8_t* Plane(uint64_t DisparityFileHeader::* offset) const
+	{
+		return (data_ != nullptr && Header().*offset != 0) ? data_ + Header().*offset : nullptr;
+	}
+
+	// Maps 'size' bytes of the file, creating it at that size when writable, or all of it when size is 0.
+	bool Map(const std::string& path, const size_t& size, const bool& is_writable);
+
+	uint8_t* data_;
+	size_t size_;
+	bool is_writable_;
+#ifdef _WIN32
+	void* file_;
+	void* mapping_;
+#else
+	int fd_;
+#endif
+};
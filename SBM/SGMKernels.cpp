@@ -0,0 +1,2191 @@
+#include "SGMKernels.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SGM_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SGM_SSE2
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define SGM_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define SGM_TARGET_AVX2 __attribute__((target("avx2")))
+#define SGM_TARGET_POPCNT __attribute__((target("popcnt")))
+#else
+#define SGM_TARGET_SSE41
+#define SGM_TARGET_AVX2
+#define SGM_TARGET_POPCNT
+#endif
+
+#if defined(__clang__)
+#define SGM_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__)
+#define SGM_UNROLL _Pragma("GCC unroll 16")
+#else
+#define SGM_UNROLL
+#endif
+
+namespace sgm_kernels
+{
+	Isa DetectIsa()
+	{
+		static const Isa isa = []() {
+#if defined(SGM_X86) && defined(_MSC_VER)
+			int info[4];
+			__cpuid(info, 0);
+			const int max_leaf = info[0];
+			__cpuid(info, 1);
+			const bool sse41 = (info[2] & (1 << 19)) != 0;
+			const bool os_avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && ((_xgetbv(0) & 6) == 6);
+			bool avx2 = false;
+			if (os_avx && max_leaf >= 7) {
+				__cpuidex(info, 7, 0);
+				avx2 = (info[1] & (1 << 5)) != 0;
+			}
+			return avx2 ? Isa::AVX2 : (sse41 ? Isa::SSE41 : Isa::Scalar);
+#elif defined(SGM_X86)
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2")) {
+				return Isa::AVX2;
+			}
+			return __builtin_cpu_supports("sse4.1") ? Isa::SSE41 : Isa::Scalar;
+#else
+			return Isa::Scalar;
+#endif
+		}();
+		return isa;
+	}
+
+	bool HasPopcnt()
+	{
+		static const bool popcnt = []() {
+#if defined(SGM_X86) && defined(_MSC_VER)
+			int info[4];
+			__cpuid(info, 1);
+			return (info[2] & (1 << 23)) != 0;
+#elif defined(SGM_X86)
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("popcnt") != 0;
+#else
+			return false;
+#endif
+		}();
+		return popcnt;
+	}
+
+	void PackCosts(const uint8_t* cost, const int32_t& disp_range, uint8_t* packed)
+	{
+		for (int32_t d = 0; d < disp_range; d += 4) {
+			uint32_t group = 0;
+			for (int32_t k = 0; k < 4 && d + k < disp_range; k++) {
+				group |= static_cast<uint32_t>(std::min<uint8_t>(cost[d + k], kPackedCostMax + 1)) << (6 * k);
+			}
+			packed[0] = static_cast<uint8_t>(group);
+			packed[1] = static_cast<uint8_t>(group >> 8);
+			packed[2] = static_cast<uint8_t>(group >> 16);
+			packed += 3;
+		}
+	}
+
+	void UnpackCosts(const uint8_t* packed, const int32_t& disp_range, uint8_t* cost)
+	{
+		for (int32_t d = 0; d < disp_range; d += 4) {
+			const uint32_t group = packed[0] | (packed[1] << 8) | (packed[2] << 16);
+			for (int32_t k = 0; k < 4 && d + k < disp_range; k++) {
+				const uint8_t value = (group >> (6 * k)) & 63;
+				cost[d + k] = (value > kPackedCostMax) ? UINT8_MAX : value;
+			}
+			packed += 3;
+		}
+	}
+
+	template <typename PathCost>
+	PathCost AggregateStep(const uint8_t* cost_init, const PathCost* cost_last_path, PathCost* cost_aggr,
+		const int32_t& disp_range, const int32_t& p1, const int32_t& p2, const PathCost& mincost_last_path)
+	{
+		PathCost min_cost = std::numeric_limits<PathCost>::max();
+		for (int32_t d = 0; d < disp_range; d++) {
+			const PathCost cost = cost_init[d];
+			const int32_t l1 = cost_last_path[d + 1];
+			const int32_t l2 = cost_last_path[d] + p1;
+			const int32_t l3 = cost_last_path[d + 2] + p1;
+			const int32_t l4 = mincost_last_path + p2;
+
+			const PathCost cost_s = cost + static_cast<PathCost>(std::min(std::min(l1, l2), std::min(l3, l4)) - mincost_last_path);
+
+			cost_aggr[d] = cost_s;
+			min_cost = std::min(min_cost, cost_s);
+		}
+		return min_cost;
+	}
+
+	template uint8_t AggregateStep<uint8_t>(const uint8_t*, const uint8_t*, uint8_t*, const int32_t&, const int32_t&, const int32_t&, const uint8_t&);
+	template uint16_t AggregateStep<uint16_t>(const uint8_t*, const uint16_t*, uint16_t*, const int32_t&, const int32_t&, const int32_t&, const uint16_t&);
+
+	uint8_t CompactStep(const uint8_t* cost_init, const uint8_t* cost_last, const int32_t& shift, const int32_t& last_size,
+		uint8_t* cost_aggr, const int32_t& size, const int32_t& p1, const int32_t& p2, const uint8_t& mincost_last_path)
+	{
+		auto last = [&](const int32_t& k) {
+			return (k >= 0 && k < last_size) ? static_cast<int32_t>(cost_last[k]) : static_cast<int32_t>(UINT8_MAX);
+		};
+		uint8_t min_cost = UINT8_MAX;
+		for (int32_t d = 0; d < size; d++) {
+			const int32_t l1 = last(d + shift);
+			const int32_t l2 = last(d + shift - 1) + p1;
+			const int32_t l3 = last(d + shift + 1) + p1;
+			const int32_t l4 = mincost_last_path + p2;
+
+			const uint8_t cost_s = cost_init[d] + static_cast<uint8_t>(std::min(std::min(l1, l2), std::min(l3, l4)) - mincost_last_path);
+
+			cost_aggr[d] = cost_s;
+			min_cost = std::min(min_cost, cost_s);
+		}
+		return min_cost;
+	}
+
+	template <typename PathCost>
+	PathCost AggregateStepMgm(const uint8_t* cost_init, const PathCost* cost_last_a, const PathCost* cost_last_b,
+		PathCost* cost_aggr, const int32_t& disp_range, const int32_t& p1, const int32_t& p2_a, const int32_t& p2_b,
+		const PathCost& mincost_last_a, const PathCost& mincost_last_b)
+	{
+		const int32_t max_cost = std::numeric_limits<PathCost>::max();
+		PathCost min_cost = max_cost;
+		for (int32_t d = 0; d < disp_range; d++) {
+			const int32_t m_a = std::min(std::min<int32_t>(cost_last_a[d + 1], cost_last_a[d] + p1),
+				std::min(cost_last_a[d + 2] + p1, mincost_last_a + p2_a)) - mincost_last_a;
+			const int32_t m_b = std::min(std::min<int32_t>(cost_last_b[d + 1], cost_last_b[d] + p1),
+				std::min(cost_last_b[d + 2] + p1, mincost_last_b + p2_b)) - mincost_last_b;
+
+			const PathCost cost_s = static_cast<PathCost>(std::min(cost_init[d] + (m_a + m_b) / 2, max_cost));
+
+			cost_aggr[d] = cost_s;
+			min_cost = std::min(min_cost, cost_s);
+		}
+		return min_cost;
+	}
+
+	template uint8_t AggregateStepMgm<uint8_t>(const uint8_t*, const uint8_t*, const uint8_t*, uint8_t*, const int32_t&,
+		const int32_t&, const int32_t&, const int32_t&, const uint8_t&, const uint8_t&);
+	template uint16_t AggregateStepMgm<uint16_t>(const uint8_t*, const uint16_t*, const uint16_t*, uint16_t*, const int32_t&,
+		const int32_t&, const int32_t&, const int32_t&, const uint16_t&, const uint16_t&);
+
+#ifdef SGM_X86
+	// l1 = Lr(p-r,d) never exceeds the maximum of the path cost type, so saturating the other three candidates
+	// there leaves the minimum unchanged; the final add wraps exactly like the scalar assignment.
+
+	// Lane operations of the SIMD path kernels for each path cost type, with the matching costs widened on load.
+	template <typename PathCost> struct Sse41Ops;
+
+	template <> struct Sse41Ops<uint8_t> {
+		static const int32_t kLanes = 16;
+		SGM_TARGET_SSE41 static inline __m128i Set1(const int32_t& v) { return _mm_set1_epi8(static_cast<char>(v)); }
+		SGM_TARGET_SSE41 static inline __m128i LoadCost(const uint8_t* cost) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(cost)); }
+		SGM_TARGET_SSE41 static inline __m128i AddSat(const __m128i& a, const __m128i& b) { return _mm_adds_epu8(a, b); }
+		SGM_TARGET_SSE41 static inline __m128i Add(const __m128i& a, const __m128i& b) { return _mm_add_epi8(a, b); }
+		SGM_TARGET_SSE41 static inline __m128i Sub(const __m128i& a, const __m128i& b) { return _mm_sub_epi8(a, b); }
+		SGM_TARGET_SSE41 static inline __m128i Min(const __m128i& a, const __m128i& b) { return _mm_min_epu8(a, b); }
+		SGM_TARGET_SSE41 static inline __m128i AvgFloor(const __m128i& a, const __m128i& b)
+		{
+			return _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+		}
+		SGM_TARGET_SSE41 static inline uint8_t HorizontalMin(const __m128i& v)
+		{
+			const __m128i pairs = _mm_min_epu8(v, _mm_srli_epi16(v, 8));
+			const __m128i words = _mm_and_si128(pairs, _mm_set1_epi16(0x00FF));
+			return static_cast<uint8_t>(_mm_cvtsi128_si32(_mm_minpos_epu16(words)));
+		}
+		SGM_TARGET_SSE41 static inline void Accumulate(uint16_t* cost_sum, const __m128i& v)
+		{
+			__m128i* sum = reinterpret_cast<__m128i*>(cost_sum);
+			const __m128i zero = _mm_setzero_si128();
+			_mm_storeu_si128(sum, _mm_add_epi16(_mm_loadu_si128(sum), _mm_unpacklo_epi8(v, zero)));
+			_mm_storeu_si128(sum + 1, _mm_add_epi16(_mm_loadu_si128(sum + 1), _mm_unpackhi_epi8(v, zero)));
+		}
+	};
+
+	template <> struct Sse41Ops<uint16_t> {
+		static const int32_t kLanes = 8;
+		SGM_TARGET_SSE41 static inline __m128i Set1(const int32_t& v) { return _mm_set1_epi16(static_cast<short>(v)); }
+		SGM_TARGET_SSE41 static inline __m128i LoadCost(const uint8_t* cost) { return _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(cost))); }
+		SGM_TARGET_SSE41 static inline __m128i AddSat(const __m128i& a, const __m128i& b) { return _mm_adds_epu16(a, b); }
+		SGM_TARGET_SSE41 static inline __m128i Add(const __m128i& a, const __m128i& b) { return _mm_add_epi16(a, b); }
+		SGM_TARGET_SSE41 static inline __m128i Sub(const __m128i& a, const __m128i& b) { return _mm_sub_epi16(a, b); }
+		SGM_TARGET_SSE41 static inline __m128i Min(const __m128i& a, const __m128i& b) { return _mm_min_epu16(a, b); }
+		SGM_TARGET_SSE41 static inline __m128i AvgFloor(const __m128i& a, const __m128i& b)
+		{
+			return _mm_sub_epi16(_mm_avg_epu16(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi16(1)));
+		}
+		SGM_TARGET_SSE41 static inline uint16_t HorizontalMin(const __m128i& v)
+		{
+			return static_cast<uint16_t>(_mm_cvtsi128_si32(_mm_minpos_epu16(v)));
+		}
+		SGM_TARGET_SSE41 static inline void Accumulate(uint16_t* cost_sum, const __m128i& v)
+		{
+			__m128i* sum = reinterpret_cast<__m128i*>(cost_sum);
+			_mm_storeu_si128(sum, _mm_add_epi16(_mm_loadu_si128(sum), v));
+		}
+	};
+
+	template <typename PathCost> struct Avx2Ops;
+
+	template <> struct Avx2Ops<uint8_t> {
+		static const int32_t kLanes = 32;
+		SGM_TARGET_AVX2 static inline __m256i Set1(const int32_t& v) { return _mm256_set1_epi8(static_cast<char>(v)); }
+		SGM_TARGET_AVX2 static inline __m256i LoadCost(const uint8_t* cost) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cost)); }
+		SGM_TARGET_AVX2 static inline __m256i AddSat(const __m256i& a, const __m256i& b) { return _mm256_adds_epu8(a, b); }
+		SGM_TARGET_AVX2 static inline __m256i Add(const __m256i& a, const __m256i& b) { return _mm256_add_epi8(a, b); }
+		SGM_TARGET_AVX2 static inline __m256i Sub(const __m256i& a, const __m256i& b) { return _mm256_sub_epi8(a, b); }
+		SGM_TARGET_AVX2 static inline __m256i Min(const __m256i& a, const __m256i& b) { return _mm256_min_epu8(a, b); }
+		SGM_TARGET_AVX2 static inline __m256i AvgFloor(const __m256i& a, const __m256i& b)
+		{
+			return _mm256_sub_epi8(_mm256_avg_epu8(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi8(1)));
+		}
+		SGM_TARGET_AVX2 static inline __m128i HalfMin(const __m256i& v)
+		{
+			return _mm_min_epu8(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+		}
+		SGM_TARGET_AVX2 static inline void Accumulate(uint16_t* cost_sum, const __m256i& v)
+		{
+			__m256i* sum = reinterpret_cast<__m256i*>(cost_sum);
+			_mm256_storeu_si256(sum, _mm256_add_epi16(_mm256_loadu_si256(sum), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(v))));
+			_mm256_storeu_si256(sum + 1, _mm256_add_epi16(_mm256_loadu_si256(sum + 1), _mm256_cvtepu8_epi16(_mm256_extracti128_si256(v, 1))));
+		}
+	};
+
+	template <> struct Avx2Ops<uint16_t> {
+		static const int32_t kLanes = 16;
+		SGM_TARGET_AVX2 static inline __m256i Set1(const int32_t& v) { return _mm256_set1_epi16(static_cast<short>(v)); }
+		SGM_TARGET_AVX2 static inline __m256i LoadCost(const uint8_t* cost) { return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(cost))); }
+		SGM_TARGET_AVX2 static inline __m256i AddSat(const __m256i& a, const __m256i& b) { return _mm256_adds_epu16(a, b); }
+		SGM_TARGET_AVX2 static inline __m256i Add(const __m256i& a, const __m256i& b) { return _mm256_add_epi16(a, b); }
+		SGM_TARGET_AVX2 static inline __m256i Sub(const __m256i& a, const __m256i& b) { return _mm256_sub_epi16(a, b); }
+		SGM_TARGET_AVX2 static inline __m256i Min(const __m256i& a, const __m256i& b) { return _mm256_min_epu16(a, b); }
+		SGM_TARGET_AVX2 static inline __m256i AvgFloor(const __m256i& a, const __m256i& b)
+		{
+			return _mm256_sub_epi16(_mm256_avg_epu16(a, b), _mm256_and_si256(_mm256_xor_si256(a, b), _mm256_set1_epi16(1)));
+		}
+		SGM_TARGET_AVX2 static inline __m128i HalfMin(const __m256i& v)
+		{
+			return _mm_min_epu16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+		}
+		SGM_TARGET_AVX2 static inline void Accumulate(uint16_t* cost_sum, const __m256i& v)
+		{
+			__m256i* sum = reinterpret_cast<__m256i*>(cost_sum);
+			_mm256_storeu_si256(sum, _mm256_add_epi16(_mm256_loadu_si256(sum), v));
+		}
+	};
+
+	template <typename PathCost>
+	SGM_TARGET_SSE41 static inline __m128i AggregateStepLanes(const uint8_t* cost_init, const PathCost* cost_last_path, PathCost* cost_aggr,
+		const __m128i& p1, const __m128i& l4, const __m128i& min_last)
+	{
+		typedef Sse41Ops<PathCost> Ops;
+		const __m128i l1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cost_last_path + 1));
+		const __m128i l2 = Ops::AddSat(_mm_loadu_si128(reinterpret_cast<const __m128i*>(cost_last_path)), p1);
+		const __m128i l3 = Ops::AddSat(_mm_loadu_si128(reinterpret_cast<const __m128i*>(cost_last_path + 2)), p1);
+		const __m128i l = Ops::Min(Ops::Min(l1, l2), Ops::Min(l3, l4));
+		const __m128i cost_s = Ops::Add(Ops::LoadCost(cost_init), Ops::Sub(l, min_last));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(cost_aggr), cost_s);
+		return cost_s;
+	}
+
+	template <typename PathCost>
+	SGM_TARGET_SSE41 static PathCost AggregateStepSSE41(const uint8_t* cost_init, const PathCost* cost_last_path, PathCost* cost_aggr,
+		const int32_t& disp_range, const int32_t& p1, const int32_t& p2, const PathCost& mincost_last_path)
+	{
+		typedef Sse41Ops<PathCost> Ops;
+		const int32_t max_cost = std::numeric_limits<PathCost>::max();
+		const __m128i v_p1 = Ops::Set1(std::min(p1, max_cost));
+		const __m128i v_l4 = Ops::Set1(std::min(mincost_last_path + p2, max_cost));
+		const __m128i v_min_last = Ops::Set1(mincost_last_path);
+
+		__m128i v_min = Ops::Set1(max_cost);
+		int32_t d = 0;
+		for (; d + Ops::kLanes <= disp_range; d += Ops::kLanes) {
+			v_min = Ops::Min(v_min, AggregateStepLanes(cost_init + d, cost_last_path + d, cost_aggr + d, v_p1, v_l4, v_min_last));
+		}
+		PathCost min_cost = Ops::HorizontalMin(v_min);
+		if (d < disp_range) {
+			min_cost = std::min(min_cost, AggregateStep(cost_init + d, cost_last_path + d, cost_aggr + d, disp_range - d, p1, p2, mincost_last_path));
+		}
+		return min_cost;
+	}
+
+	template <typename PathCost>
+	SGM_TARGET_AVX2 static PathCost AggregateStepAVX2(const uint8_t* cost_init, const PathCost* cost_last_path, PathCost* cost_aggr,
+		const int32_t& disp_range, const int32_t& p1, const int32_t& p2, const PathCost& mincost_last_path)
+	{
+		typedef Avx2Ops<PathCost> Ops;
+		typedef Sse41Ops<PathCost> HalfOps;
+		const int32_t max_cost = std::numeric_limits<PathCost>::max();
+		const __m256i v_p1 = Ops::Set1(std::min(p1, max_cost));
+		const __m256i v_l4 = Ops::Set1(std::min(mincost_last_path + p2, max_cost));
+		const __m256i v_min_last = Ops::Set1(mincost_last_path);
+
+		__m256i v_min = Ops::Set1(max_cost);
+		int32_t d = 0;
+		for (; d + Ops::kLanes <= disp_range; d += Ops::kLanes) {
+			const __m256i l1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cost_last_path + d + 1));
+			const __m256i l2 = Ops::AddSat(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(cost_last_path + d)), v_p1);
+			const __m256i l3 = Ops::AddSat(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(cost_last_path + d + 2)), v_p1);
+			const __m256i l = Ops::Min(Ops::Min(l1, l2), Ops::Min(l3, v_l4));
+			const __m256i cost_s = Ops::Add(Ops::LoadCost(cost_init + d), Ops::Sub(l, v_min_last));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(cost_aggr + d), cost_s);
+			v_min = Ops::Min(v_min, cost_s);
+		}
+		__m128i v_min_128 = Ops::HalfMin(v_min);
+		if (d + HalfOps::kLanes <= disp_range) {
+			v_min_128 = HalfOps::Min(v_min_128, AggregateStepLanes(cost_init + d, cost_last_path + d, cost_aggr + d,
+				_mm256_castsi256_si128(v_p1), _mm256_castsi256_si128(v_l4), _mm256_castsi256_si128(v_min_last)));
+			d += HalfOps::kLanes;
+		}
+		PathCost min_cost = HalfOps::HorizontalMin(v_min_128);
+		if (d < disp_range) {
+			min_cost = std::min(min_cost, AggregateStep(cost_init + d, cost_last_path + d, cost_aggr + d, disp_range - d, p1, p2, mincost_last_path));
+		}
+		return min_cost;
+	}
+
+	// min(Lr(p-r,d), Lr(p-r,d-1) + P1, Lr(p-r,d+1) + P1, l4) - min(Lr(p-r)) of one predecessor.
+	template <typename PathCost>
+	SGM_TARGET_SSE41 static inline __m128i TransitionLanes(const PathCost* cost_last_path, const __m128i& p1, const __m128i& l4, const __m128i& min_last)
+	{
+		typedef Sse41Ops<PathCost> Ops;
+		const __m128i l1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cost_last_path + 1));
+		const __m128i l2 = Ops::AddSat(_mm_loadu_si128(reinterpret_cast<const __m128i*>(cost_last_path)), p1);
+		const __m128i l3 = Ops::AddSat(_mm_loadu_si128(reinterpret_cast<const __m128i*>(cost_last_path + 2)), p1);
+		return Ops::Sub(Ops::Min(Ops::Min(l1, l2), Ops::Min(l3, l4)), min_last);
+	}
+
+	template <typename PathCost>
+	SGM_TARGET_AVX2 static inline __m256i TransitionLanesAVX2(const PathCost* cost_last_path, const __m256i& p1, const __m256i& l4, const __m256i& min_last)
+	{
+		typedef Avx2Ops<PathCost> Ops;
+		const __m256i l1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cost_last_path + 1));
+		const __m256i l2 = Ops::AddSat(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(cost_last_path)), p1);
+		const __m256i l3 = Ops::AddSat(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(cost_last_path + 2)), p1);
+		return Ops::Sub(Ops::Min(Ops::Min(l1, l2), Ops::Min(l3, l4)), min_last);
+	}
+
+	// Lr(p-r) at the positions in 'index', the maximum outside [0, last_size).
+	SGM_TARGET_SSE41 static inline __m128i CompactLastLanes(const __m128i& v_last, const __m128i& v_last_size, const __m128i& index)
+	{
+		const __m128i inside = _mm_andnot_si128(_mm_cmplt_epi8(index, _mm_setzero_si128()), _mm_cmplt_epi8(index, v_last_size));
+		return _mm_blendv_epi8(_mm_set1_epi8(-1), _mm_shuffle_epi8(v_last, index), inside);
+	}
+
+	SGM_TARGET_SSE41 static uint8_t CompactStepSSE41(const uint8_t* cost_init, const uint8_t* cost_last, const int32_t& shift,
+		const int32_t& last_size, uint8_t* cost_aggr, const int32_t& size, const int32_t& p1, const int32_t& p2,
+		const uint8_t& mincost_last_path)
+	{
+		typedef Sse41Ops<uint8_t> Ops;
+		const __m128i v_iota = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+		const __m128i v_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cost_last));
+		const __m128i v_last_size = _mm_set1_epi8(static_cast<char>(last_size));
+
+		// Lr(p-r) at k + shift - 1 for the lanes k and the 16 after them; Lr(p-r, d) and Lr(p-r, d + 1) are these moved
+		// by one and two lanes. Shifts past the 16 lanes never overlap and are clamped so the positions stay within int8.
+		const __m128i index_lo = _mm_add_epi8(v_iota, _mm_set1_epi8(static_cast<char>(std::max(-32, std::min(32, shift - 1)))));
+		const __m128i last_lo = CompactLastLanes(v_last, v_last_size, index_lo);
+		const __m128i last_hi = CompactLastLanes(v_last, v_last_size, _mm_add_epi8(index_lo, _mm_set1_epi8(16)));
+
+		const __m128i v_p1 = Ops::Set1(std::min(p1, static_cast<int32_t>(UINT8_MAX)));
+		const __m128i v_l4 = Ops::Set1(std::min(mincost_last_path + p2, static_cast<int32_t>(UINT8_MAX)));
+		const __m128i l1 = _mm_alignr_epi8(last_hi, last_lo, 1);
+		const __m128i l2 = Ops::AddSat(last_lo, v_p1);
+		const __m128i l3 = Ops::AddSat(_mm_alignr_epi8(last_hi, last_lo, 2), v_p1);
+		const __m128i l = Ops::Min(Ops::Min(l1, l2), Ops::Min(l3, v_l4));
+		const __m128i cost_s = Ops::Add(Ops::LoadCost(cost_init), Ops::Sub(l, Ops::Set1(mincost_last_path)));
+
+		// The lanes past 'size' keep what the next ranges hold.
+		const __m128i in_range = _mm_cmplt_epi8(v_iota, _mm_set1_epi8(static_cast<char>(size)));
+		__m128i* aggr = reinterpret_cast<__m128i*>(cost_aggr);
+		_mm_storeu_si128(aggr, _mm_blendv_epi8(_mm_loadu_si128(aggr), cost_s, in_range));
+		return Ops::HorizontalMin(_mm_blendv_epi8(_mm_set1_epi8(-1), cost_s, in_range));
+	}
+
+	template <typename PathCost>
+	SGM_TARGET_SSE41 static PathCost AggregateStepMgmSSE41(const uint8_t* cost_init, const PathCost* cost_last_a, const PathCost* cost_last_b,
+		PathCost* cost_aggr, const int32_t& disp_range, const int32_t& p1, const int32_t& p2_a, const int32_t& p2_b,
+		const PathCost& mincost_last_a, const PathCost& mincost_last_b)
+	{
+		typedef Sse41Ops<PathCost> Ops;
+		const int32_t max_cost = std::numeric_limits<PathCost>::max();
+		const __m128i v_p1 = Ops::Set1(std::min(p1, max_cost));
+		const __m128i v_l4_a = Ops::Set1(std::min(mincost_last_a + p2_a, max_cost));
+		const __m128i v_l4_b = Ops::Set1(std::min(mincost_last_b + p2_b, max_cost));
+		const __m128i v_min_a = Ops::Set1(mincost_last_a);
+		const __m128i v_min_b = Ops::Set1(mincost_last_b);
+
+		__m128i v_min = Ops::Set1(max_cost);
+		int32_t d = 0;
+		for (; d + Ops::kLanes <= disp_range; d += Ops::kLanes) {
+			const __m128i m = Ops::AvgFloor(TransitionLanes(cost_last_a + d, v_p1, v_l4_a, v_min_a),
+				TransitionLanes(cost_last_b + d, v_p1, v_l4_b, v_min_b));
+			const __m128i cost_s = Ops::AddSat(Ops::LoadCost(cost_init + d), m);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(cost_aggr + d), cost_s);
+			v_min = Ops::Min(v_min, cost_s);
+		}
+		PathCost min_cost = Ops::HorizontalMin(v_min);
+		if (d < disp_range) {
+			min_cost = std::min(min_cost, AggregateStepMgm(cost_init + d, cost_last_a + d, cost_last_b + d, cost_aggr + d, disp_range - d,
+				p1, p2_a, p2_b, mincost_last_a, mincost_last_b));
+		}
+		return min_cost;
+	}
+
+	template <typename PathCost>
+	SGM_TARGET_AVX2 static PathCost AggregateStepMgmAVX2(const uint8_t* cost_init, const PathCost* cost_last_a, const PathCost* cost_last_b,
+		PathCost* cost_aggr, const int32_t& disp_range, const int32_t& p1, const int32_t& p2_a, const int32_t& p2_b,
+		const PathCost& mincost_last_a, const PathCost& mincost_last_b)
+	{
+		typedef Avx2Ops<PathCost> Ops;
+		typedef Sse41Ops<PathCost> HalfOps;
+		const int32_t max_cost = std::numeric_limits<PathCost>::max();
+		const __m256i v_p1 = Ops::Set1(std::min(p1, max_cost));
+		const __m256i v_l4_a = Ops::Set1(std::min(mincost_last_a + p2_a, max_cost));
+		const __m256i v_l4_b = Ops::Set1(std::min(mincost_last_b + p2_b, max_cost));
+		const __m256i v_min_a = Ops::Set1(mincost_last_a);
+		const __m256i v_min_b = Ops::Set1(mincost_last_b);
+
+		__m256i v_min = Ops::Set1(max_cost);
+		int32_t d = 0;
+		for (; d + Ops::kLanes <= disp_range; d += Ops::kLanes) {
+			const __m256i m = Ops::AvgFloor(TransitionLanesAVX2(cost_last_a + d, v_p1, v_l4_a, v_min_a),
+				TransitionLanesAVX2(cost_last_b + d, v_p1, v_l4_b, v_min_b));
+			const __m256i cost_s = Ops::AddSat(Ops::LoadCost(cost_init + d), m);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(cost_aggr + d), cost_s);
+			v_min = Ops::Min(v_min, cost_s);
+		}
+		__m128i v_min_128 = Ops::HalfMin(v_min);
+		if (d + HalfOps::kLanes <= disp_range) {
+			const __m128i m = HalfOps::AvgFloor(
+				TransitionLanes(cost_last_a + d, _mm256_castsi256_si128(v_p1), _mm256_castsi256_si128(v_l4_a), _mm256_castsi256_si128(v_min_a)),
+				TransitionLanes(cost_last_b + d, _mm256_castsi256_si128(v_p1), _mm256_castsi256_si128(v_l4_b), _mm256_castsi256_si128(v_min_b)));
+			const __m128i cost_s = HalfOps::AddSat(HalfOps::LoadCost(cost_init + d), m);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(cost_aggr + d), cost_s);
+			v_min_128 = HalfOps::Min(v_min_128, cost_s);
+			d += HalfOps::kLanes;
+		}
+		PathCost min_cost = HalfOps::HorizontalMin(v_min_128);
+		if (d < disp_range) {
+			min_cost = std::min(min_cost, AggregateStepMgm(cost_init + d, cost_last_a + d, cost_last_b + d, cost_aggr + d, disp_range - d,
+				p1, p2_a, p2_b, mincost_last_a, mincost_last_b));
+		}
+		return min_cost;
+	}
+
+	// 16 costs from the 12 packed bytes at packed: each 16-bit lane takes the two bytes holding its 6 bits,
+	// the multiply moves them to the top and the shift back down.
+	SGM_TARGET_SSE41 static inline __m128i UnpackCosts16(const __m128i& packed)
+	{
+		const __m128i lo = _mm_shuffle_epi8(packed, _mm_setr_epi8(0, 1, 0, 1, 1, 2, 1, 2, 3, 4, 3, 4, 4, 5, 4, 5));
+		const __m128i hi = _mm_shuffle_epi8(packed, _mm_setr_epi8(6, 7, 6, 7, 7, 8, 7, 8, 9, 10, 9, 10, 10, 11, 10, 11));
+		const __m128i shift = _mm_setr_epi16(1024, 16, 64, 1, 1024, 16, 64, 1);
+		const __m128i cost = _mm_packus_epi16(_mm_srli_epi16(_mm_mullo_epi16(lo, shift), 10), _mm_srli_epi16(_mm_mullo_epi16(hi, shift), 10));
+		return _mm_or_si128(cost, _mm_cmpgt_epi8(cost, _mm_set1_epi8(static_cast<char>(kPackedCostMax))));
+	}
+
+	SGM_TARGET_SSE41 static inline void UnpackCostsSSE41(const uint8_t* packed, const int32_t& disp_range, uint8_t* cost)
+	{
+		const int32_t bytes = static_cast<int32_t>(CostBytes(CostStorage::Packed6, disp_range));
+		int32_t d = 0;
+		for (; d + 16 <= disp_range; d += 16) {
+			const int32_t offset = d / 4 * 3;
+			// The last group is loaded from 4 bytes earlier, so no load leaves the pixel.
+			const __m128i bytes16 = (offset + 16 <= bytes) ? _mm_loadu_si128(reinterpret_cast<const __m128i*>(packed + offset)) :
+				_mm_srli_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(packed + offset - 4)), 4);
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(cost + d), UnpackCosts16(bytes16));
+		}
+		if (d < disp_range) {
+			UnpackCosts(packed + d / 4 * 3, disp_range - d, cost + d);
+		}
+	}
+
+	// Inverse of UnpackCosts16: pairs of costs into 12-bit words, pairs of words into 24-bit lanes, three bytes of each lane kept.
+	SGM_TARGET_SSE41 static inline __m128i PackCosts16(const __m128i& cost)
+	{
+		const __m128i clamped = _mm_min_epu8(cost, _mm_set1_epi8(static_cast<char>(kPackedCostMax + 1)));
+		const __m128i words = _mm_maddubs_epi16(clamped, _mm_set1_epi16(64 << 8 | 1));
+		const __m128i lanes = _mm_madd_epi16(words, _mm_set1_epi32(4096 << 16 | 1));
+		return _mm_shuffle_epi8(lanes, _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1));
+	}
+
+	SGM_TARGET_SSE41 void PackCostsSSE41(const uint8_t* cost, const int32_t& disp_range, uint8_t* packed)
+	{
+		int32_t d = 0;
+		for (; d + 16 <= disp_range; d += 16) {
+			// 12 bytes, stored without touching the following ones.
+			const __m128i bytes12 = PackCosts16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(cost + d)));
+			uint8_t* target = packed + d / 4 * 3;
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(target), bytes12);
+			const uint32_t tail = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(bytes12, 8)));
+			memcpy(target + 8, &tail, sizeof(tail));
+		}
+		if (d < disp_range) {
+			PackCosts(cost + d, disp_range - d, packed + d / 4 * 3);
+		}
+	}
+#else
+	void PackCostsSSE41(const uint8_t* cost, const int32_t& disp_range, uint8_t* packed)
+	{
+		PackCosts(cost, disp_range, packed);
+	}
+
+	template <typename PathCost>
+	static PathCost AggregateStepSSE41(const uint8_t* cost_init, const PathCost* cost_last_path, PathCost* cost_aggr,
+		const int32_t& disp_range, const int32_t& p1, const int32_t& p2, const PathCost& mincost_last_path)
+	{
+		return AggregateStep(cost_init, cost_last_path, cost_aggr, disp_range, p1, p2, mincost_last_path);
+	}
+
+	template <typename PathCost>
+	static PathCost AggregateStepAVX2(const uint8_t* cost_init, const PathCost* cost_last_path, PathCost* cost_aggr,
+		const int32_t& disp_range, const int32_t& p1, const int32_t& p2, const PathCost& mincost_last_path)
+	{
+		return AggregateStep(cost_init, cost_last_path, cost_aggr, disp_range, p1, p2, mincost_last_path);
+	}
+
+	static uint8_t CompactStepSSE41(const uint8_t* cost_init, const uint8_t* cost_last, const int32_t& shift,
+		const int32_t& last_size, uint8_t* cost_aggr, const int32_t& size, const int32_t& p1, const int32_t& p2,
+		const uint8_t& mincost_last_path)
+	{
+		return CompactStep(cost_init, cost_last, shift, last_size, cost_aggr, size, p1, p2, mincost_last_path);
+	}
+
+	template <typename PathCost>
+	static PathCost AggregateStepMgmSSE41(const uint8_t* cost_init, const PathCost* cost_last_a, const PathCost* cost_last_b,
+		PathCost* cost_aggr, const int32_t& disp_range, const int32_t& p1, const int32_t& p2_a, const int32_t& p2_b,
+		const PathCost& mincost_last_a, const PathCost& mincost_last_b)
+	{
+		return AggregateStepMgm(cost_init, cost_last_a, cost_last_b, cost_aggr, disp_range, p1, p2_a, p2_b, mincost_last_a, mincost_last_b);
+	}
+
+	template <typename PathCost>
+	static PathCost AggregateStepMgmAVX2(const uint8_t* cost_init, const PathCost* cost_last_a, const PathCost* cost_last_b,
+		PathCost* cost_aggr, const int32_t& disp_range, const int32_t& p1, const int32_t& p2_a, const int32_t& p2_b,
+		const PathCost& mincost_last_a, const PathCost& mincost_last_b)
+	{
+		return AggregateStepMgm(cost_init, cost_last_a, cost_last_b, cost_aggr, disp_range, p1, p2_a, p2_b, mincost_last_a, mincost_last_b);
+	}
+#endif
+
+	PackCostsFunc SelectPackCosts(bool use_simd)
+	{
+		return (use_simd && DetectIsa() != Isa::Scalar) ? PackCostsSSE41 : PackCosts;
+	}
+
+	template <typename PathCost>
+	AggregateStepFunc<PathCost> SelectAggregateStep(bool use_simd)
+	{
+		if (!use_simd) {
+			return AggregateStep<PathCost>;
+		}
+		switch (DetectIsa()) {
+		case Isa::AVX2:
+			return AggregateStepAVX2<PathCost>;
+		case Isa::SSE41:
+			return AggregateStepSSE41<PathCost>;
+		default:
+			return AggregateStep<PathCost>;
+		}
+	}
+
+	template AggregateStepFunc<uint8_t> SelectAggregateStep<uint8_t>(bool use_simd);
+	template AggregateStepFunc<uint16_t> SelectAggregateStep<uint16_t>(bool use_simd);
+
+	template <typename PathCost>
+	AggregateStepMgmFunc<PathCost> SelectAggregateStepMgm(bool use_simd)
+	{
+		if (!use_simd) {
+			return AggregateStepMgm<PathCost>;
+		}
+		switch (DetectIsa()) {
+		case Isa::AVX2:
+			return AggregateStepMgmAVX2<PathCost>;
+		case Isa::SSE41:
+			return AggregateStepMgmSSE41<PathCost>;
+		default:
+			return AggregateStepMgm<PathCost>;
+		}
+	}
+
+	template AggregateStepMgmFunc<uint8_t> SelectAggregateStepMgm<uint8_t>(bool use_simd);
+
+	CompactStepFunc SelectCompactStep(bool use_simd)
+	{
+		return (use_simd && DetectIsa() != Isa::Scalar) ? CompactStepSSE41 : CompactStep;
+	}
+	template AggregateStepMgmFunc<uint16_t> SelectAggregateStepMgm<uint16_t>(bool use_simd);
+
+	// The fixed-range path kernels keep Lr(p-r) and Lr(p) in stack buffers with the values starting at
+	// kPathPad, so the loads of Lr(p-r,d) and the stores of Lr(p,d) are aligned and the sentinels sit
+	// at kPathPad - 1 and kPathPad + D.
+	static const int32_t kPathPad = 32;
+
+	template <typename PathCost>
+	static inline void NextPixel(const PathWalk<PathCost>& walk, int32_t& row, int32_t& col)
+	{
+		row += walk.dr;
+		col += walk.dc;
+		if (col < 0) {
+			col += walk.width;
+		}
+		else if (col >= walk.width) {
+			col -= walk.width;
+		}
+	}
+
+	template <int32_t D, CostStorage S>
+	static void AggregatePathFixed(const PathWalk<typename StorageTraits<S>::PathCost>& walk)
+	{
+		typedef typename StorageTraits<S>::PathCost PathCost;
+		const PathCost max_cost = std::numeric_limits<PathCost>::max();
+		const size_t cost_bytes = CostBytes(S, D);
+		PathCost path[2][D + 2 * kPathPad];
+		uint8_t unpacked[D];
+		PathCost* cost_last_path = path[0];
+		PathCost* cost_cur_path = path[1];
+		cost_last_path[kPathPad - 1] = cost_last_path[kPathPad + D] = max_cost;
+		cost_cur_path[kPathPad - 1] = cost_cur_path[kPathPad + D] = max_cost;
+		PathCost mincost_last_path = max_cost;
+		uint8_t gray_last = 0;
+
+		int32_t row = walk.row, col = walk.col;
+		for (int32_t t = 0; t < walk.length; t++) {
+			if (t > 0) {
+				NextPixel(walk, row, col);
+			}
+			const size_t pixel = static_cast<size_t>(row) * walk.width + col;
+			const uint8_t gray = walk.img[pixel];
+			const uint8_t* cost_init = walk.cost_init + pixel * cost_bytes;
+			if (StorageTraits<S>::kIsPacked) {
+				UnpackCosts(cost_init, D, unpacked);
+				cost_init = unpacked;
+			}
+			PathCost* cost = cost_cur_path + kPathPad;
+
+			PathCost min_cost = max_cost;
+			if (t == 0) {
+				for (int32_t d = 0; d < D; d++) {
+					cost[d] = cost_init[d];
+					min_cost = std::min(min_cost, cost[d]);
+				}
+			}
+			else {
+				const int32_t p2 = std::max(walk.p1, walk.p2_init / (abs(gray - gray_last) + 1));
+				min_cost = AggregateStep(cost_init, cost_last_path + kPathPad - 1, cost, D, walk.p1, p2, mincost_last_path);
+			}
+			if (walk.cost_aggr != nullptr) {
+				memcpy(walk.cost_aggr + pixel * D, cost, D * sizeof(PathCost));
+			}
+			if (walk.cost_sum != nullptr) {
+				uint16_t* sum = walk.cost_sum + pixel * D;
+				for (int32_t d = 0; d < D; d++) {
+					sum[d] += cost[d];
+				}
+			}
+
+			mincost_last_path = min_cost;
+			std::swap(cost_last_path, cost_cur_path);
+			gray_last = gray;
+		}
+	}
+
+#ifdef SGM_X86
+	template <int32_t D, CostStorage S>
+	SGM_TARGET_SSE41 static void AggregatePathFixedSSE41(const PathWalk<typename StorageTraits<S>::PathCost>& walk)
+	{
+		typedef typename StorageTraits<S>::PathCost PathCost;
+		typedef Sse41Ops<PathCost> Ops;
+		const int32_t max_cost = std::numeric_limits<PathCost>::max();
+		const size_t cost_bytes = CostBytes(S, D);
+		alignas(16) PathCost path[2][D + 2 * kPathPad];
+		uint8_t unpacked[D];
+		PathCost* cost_last_path = path[0];
+		PathCost* cost_cur_path = path[1];
+		cost_last_path[kPathPad - 1] = cost_last_path[kPathPad + D] = max_cost;
+		cost_cur_path[kPathPad - 1] = cost_cur_path[kPathPad + D] = max_cost;
+		PathCost mincost_last_path = max_cost;
+		uint8_t gray_last = 0;
+
+		const __m128i v_p1 = Ops::Set1(std::min(walk.p1, max_cost));
+		int32_t row = walk.row, col = walk.col;
+		for (int32_t t = 0; t < walk.length; t++) {
+			if (t > 0) {
+				NextPixel(walk, row, col);
+			}
+			const size_t pixel = static_cast<size_t>(row) * walk.width + col;
+			const uint8_t gray = walk.img[pixel];
+			const uint8_t* cost_init = walk.cost_init + pixel * cost_bytes;
+			if (StorageTraits<S>::kIsPacked) {
+				UnpackCostsSSE41(cost_init, D, unpacked);
+				cost_init = unpacked;
+			}
+			const PathCost* last = cost_last_path + kPathPad;
+			PathCost* cur = cost_cur_path + kPathPad;
+			PathCost* cost_aggr = (walk.cost_aggr != nullptr) ? walk.cost_aggr + pixel * D : nullptr;
+			uint16_t* cost_sum = (walk.cost_sum != nullptr) ? walk.cost_sum + pixel * D : nullptr;
+
+			const int32_t p2 = std::max(walk.p1, walk.p2_init / (abs(gray - gray_last) + 1));
+			const __m128i v_l4 = Ops::Set1(std::min(mincost_last_path + p2, max_cost));
+			const __m128i v_min_last = Ops::Set1(mincost_last_path);
+			const bool is_first = (t == 0);
+
+			__m128i v_min = Ops::Set1(max_cost);
+			SGM_UNROLL
+			for (int32_t d = 0; d < D; d += Ops::kLanes) {
+				__m128i cost_s = Ops::LoadCost(cost_init + d);
+				if (!is_first) {
+					const __m128i l1 = _mm_load_si128(reinterpret_cast<const __m128i*>(last + d));
+					const __m128i l2 = Ops::AddSat(_mm_loadu_si128(reinterpret_cast<const __m128i*>(last + d - 1)), v_p1);
+					const __m128i l3 = Ops::AddSat(_mm_loadu_si128(reinterpret_cast<const __m128i*>(last + d + 1)), v_p1);
+					const __m128i l = Ops::Min(Ops::Min(l1, l2), Ops::Min(l3, v_l4));
+					cost_s = Ops::Add(cost_s, Ops::Sub(l, v_min_last));
+				}
+				_mm_store_si128(reinterpret_cast<__m128i*>(cur + d), cost_s);
+				if (cost_aggr != nullptr) {
+					_mm_storeu_si128(reinterpret_cast<__m128i*>(cost_aggr + d), cost_s);
+				}
+				if (cost_sum != nullptr) {
+					Ops::Accumulate(cost_sum + d, cost_s);
+				}
+				v_min = Ops::Min(v_min, cost_s);
+			}
+
+			mincost_last_path = Ops::HorizontalMin(v_min);
+			std::swap(cost_last_path, cost_cur_path);
+			gray_last = gray;
+		}
+	}
+
+	template <int32_t D, CostStorage S>
+	SGM_TARGET_AVX2 static void AggregatePathFixedAVX2(const PathWalk<typename StorageTraits<S>::PathCost>& walk)
+	{
+		typedef typename StorageTraits<S>::PathCost PathCost;
+		typedef Avx2Ops<PathCost> Ops;
+		const int32_t max_cost = std::numeric_limits<PathCost>::max();
+		const size_t cost_bytes = CostBytes(S, D);
+		alignas(32) PathCost path[2][D + 2 * kPathPad];
+		uint8_t unpacked[D];
+		PathCost* cost_last_path = path[0];
+		PathCost* cost_cur_path = path[1];
+		cost_last_path[kPathPad - 1] = cost_last_path[kPathPad + D] = max_cost;
+		cost_cur_path[kPathPad - 1] = cost_cur_path[kPathPad + D] = max_cost;
+		PathCost mincost_last_path = max_cost;
+		uint8_t gray_last = 0;
+
+		const __m256i v_p1 = Ops::Set1(std::min(walk.p1, max_cost));
+		int32_t row = walk.row, col = walk.col;
+		for (int32_t t = 0; t < walk.length; t++) {
+			if (t > 0) {
+				NextPixel(walk, row, col);
+			}
+			const size_t pixel = static_cast<size_t>(row) * walk.width + col;
+			const uint8_t gray = walk.img[pixel];
+			const uint8_t* cost_init = walk.cost_init + pixel * cost_bytes;
+			if (StorageTraits<S>::kIsPacked) {
+				UnpackCostsSSE41(cost_init, D, unpacked);
+				cost_init = unpacked;
+			}
+			const PathCost* last = cost_last_path + kPathPad;
+			PathCost* cur = cost_cur_path + kPathPad;
+			PathCost* cost_aggr = (walk.cost_aggr != nullptr) ? walk.cost_aggr + pixel * D : nullptr;
+			uint16_t* cost_sum = (walk.cost_sum != nullptr) ? walk.cost_sum + pixel * D : nullptr;
+
+			const int32_t p2 = std::max(walk.p1, walk.p2_init / (abs(gray - gray_last) + 1));
+			const __m256i v_l4 = Ops::Set1(std::min(mincost_last_path + p2, max_cost));
+			const __m256i v_min_last = Ops::Set1(mincost_last_path);
+			const bool is_first = (t == 0);
+
+			__m256i v_min = Ops::Set1(max_cost);
+			SGM_UNROLL
+			for (int32_t d = 0; d < D; d += Ops::kLanes) {
+				__m256i cost_s = Ops::LoadCost(cost_init + d);
+				if (!is_first) {
+					const __m256i l1 = _mm256_load_si256(reinterpret_cast<const __m256i*>(last + d));
+					const __m256i l2 = Ops::AddSat(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(last + d - 1)), v_p1);
+					const __m256i l3 = Ops::AddSat(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(last + d + 1)), v_p1);
+					const __m256i l = Ops::Min(Ops::Min(l1, l2), Ops::Min(l3, v_l4));
+					cost_s = Ops::Add(cost_s, Ops::Sub(l, v_min_last));
+				}
+				_mm256_store_si256(reinterpret_cast<__m256i*>(cur + d), cost_s);
+				if (cost_aggr != nullptr) {
+					_mm256_storeu_si256(reinterpret_cast<__m256i*>(cost_aggr + d), cost_s);
+				}
+				if (cost_sum != nullptr) {
+					Ops::Accumulate(cost_sum + d, cost_s);
+				}
+				v_min = Ops::Min(v_min, cost_s);
+			}
+
+			mincost_last_path = Sse41Ops<PathCost>::HorizontalMin(Ops::HalfMin(v_min));
+			std::swap(cost_last_path, cost_cur_path);
+			gray_last = gray;
+		}
+	}
+#endif
+
+	template <int32_t D, CostStorage S>
+	static AggregatePathFunc<S> SelectAggregatePathFixed(bool use_simd)
+	{
+#ifdef SGM_X86
+		if (use_simd) {
+			switch (DetectIsa()) {
+			case Isa::AVX2:
+				return AggregatePathFixedAVX2<D, S>;
+			case Isa::SSE41:
+				return AggregatePathFixedSSE41<D, S>;
+			default:
+				break;
+			}
+		}
+#endif
+		return AggregatePathFixed<D, S>;
+	}
+
+	template <CostStorage S>
+	AggregatePathFunc<S> SelectAggregatePath(const int32_t& disp_range, bool use_simd)
+	{
+		switch (disp_range) {
+		case 64:
+			return SelectAggregatePathFixed<64, S>(use_simd);
+		case 128:
+			return SelectAggregatePathFixed<128, S>(use_simd);
+		case 192:
+			return SelectAggregatePathFixed<192, S>(use_simd);
+		case 256:
+			return SelectAggregatePathFixed<256, S>(use_simd);
+		default:
+			return nullptr;
+		}
+	}
+
+	template AggregatePathFunc<CostStorage::Uint8> SelectAggregatePath<CostStorage::Uint8>(const int32_t& disp_range, bool use_simd);
+	template AggregatePathFunc<CostStorage::Uint16> SelectAggregatePath<CostStorage::Uint16>(const int32_t& disp_range, bool use_simd);
+	template AggregatePathFunc<CostStorage::Packed6> SelectAggregatePath<CostStorage::Packed6>(const int32_t& disp_range, bool use_simd);
+
+	// Per-lane minima of a SIMD WTA pass merged into the result: the minimum with the smallest index
+	// wins, every other lane minimum is a second-minimum candidate.
+	static inline void ReduceWtaLanes(const uint16_t* lane_min, const uint16_t* lane_sec, const uint16_t* lane_best,
+		const int32_t& lanes, WtaResult& result)
+	{
+		int32_t lane = 0;
+		for (int32_t l = 1; l < lanes; l++) {
+			if (lane_min[l] < lane_min[lane] || (lane_min[l] == lane_min[lane] && lane_best[l] < lane_best[lane])) {
+				lane = l;
+			}
+		}
+		uint16_t sec_min_cost = UINT16_MAX;
+		for (int32_t l = 0; l < lanes; l++) {
+			sec_min_cost = std::min(sec_min_cost, lane_sec[l]);
+			if (l != lane) {
+				sec_min_cost = std::min(sec_min_cost, lane_min[l]);
+			}
+		}
+		result.min_cost = lane_min[lane];
+		result.sec_min_cost = sec_min_cost;
+		result.best = lane_best[lane];
+	}
+
+	// Continues a WTA pass over cost[begin, end) and fills in the neighbour costs.
+	static inline void FinishWta(const uint16_t* cost, const int32_t& begin, const int32_t& end, WtaResult& result)
+	{
+		for (int32_t d = begin; d < end; d++) {
+			if (cost[d] < result.min_cost) {
+				result.sec_min_cost = result.min_cost;
+				result.min_cost = cost[d];
+				result.best = d;
+			}
+			else {
+				result.sec_min_cost = std::min(result.sec_min_cost, cost[d]);
+			}
+		}
+		result.cost_prev = (result.best > 0) ? cost[result.best - 1] : UINT16_MAX;
+		result.cost_next = (result.best < end - 1) ? cost[result.best + 1] : UINT16_MAX;
+	}
+
+	// kFixed != 0 fixes the disparity range at compile time, so the loop has a constant trip count.
+	template <int32_t kFixed>
+	static void WtaImpl(const uint16_t* cost, const int32_t& disp_range, WtaResult& result)
+	{
+		result.min_cost = UINT16_MAX;
+		result.sec_min_cost = UINT16_MAX;
+		result.best = 0;
+		FinishWta(cost, 0, kFixed ? kFixed : disp_range, result);
+	}
+
+	void Wta(const uint16_t* cost, const int32_t& disp_range, WtaResult& result)
+	{
+		WtaImpl<0>(cost, disp_range, result);
+	}
+
+	// Candidate k of the right pixels [col, col + count), in increasing k per pixel.
+	static inline void UpdateRight(const uint16_t* cost, const int32_t& count, const uint16_t& k,
+		uint16_t* right_min, uint16_t* right_sec_min, uint16_t* right_best)
+	{
+		for (int32_t c = 0; c < count; c++) {
+			if (cost[c] < right_min[c]) {
+				right_sec_min[c] = right_min[c];
+				right_min[c] = cost[c];
+				right_best[c] = k;
+			}
+			else {
+				right_sec_min[c] = std::min(right_sec_min[c], cost[c]);
+			}
+		}
+	}
+
+	// Left pixels [begin, end) that have a right pixel j - min_disparity - k inside the image.
+	static inline void RightCandidates(const int32_t& width, const int32_t& min_disparity, const int32_t& k, int32_t& begin, int32_t& end)
+	{
+		begin = std::max(0, min_disparity + k);
+		end = std::min(width, width + min_disparity + k);
+	}
+
+	void WtaRightRow(const uint16_t* cost_row, const int32_t& width, const int32_t& disp_range, const int32_t& min_disparity,
+		uint16_t* scratch, uint16_t* right_min, uint16_t* right_sec_min, uint16_t* right_best)
+	{
+		(void)scratch;
+		std::fill(right_min, right_min + width, UINT16_MAX);
+		std::fill(right_sec_min, right_sec_min + width, UINT16_MAX);
+		std::fill(right_best, right_best + width, UINT16_MAX);
+		for (int32_t k = 0; k < disp_range; k++) {
+			int32_t begin = 0, end = 0;
+			RightCandidates(width, min_disparity, k, begin, end);
+			for (int32_t j = begin; j < end; j++) {
+				const int32_t c = j - min_disparity - k;
+				UpdateRight(cost_row + static_cast<size_t>(j) * disp_range + k, 1, static_cast<uint16_t>(k),
+					right_min + c, right_sec_min + c, right_best + c);
+			}
+		}
+	}
+
+#ifdef SGM_X86
+	// Every lane keeps the minimum of its disparities, the first index of it and the second minimum:
+	// a cost that is not below the minimum only competes for the second minimum, one that is pushes
+	// the old minimum there.
+
+	template <int32_t kFixed>
+	SGM_TARGET_SSE41 static void WtaSSE41Impl(const uint16_t* cost, const int32_t& disp_range, WtaResult& result)
+	{
+		const int32_t D = kFixed ? kFixed : disp_range;
+		__m128i v_min = _mm_set1_epi16(-1);
+		__m128i v_sec = v_min;
+		__m128i v_best = _mm_setzero_si128();
+		__m128i v_index = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m128i v_step = _mm_set1_epi16(8);
+
+		int32_t d = 0;
+		for (; d + 8 <= D; d += 8) {
+			const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cost + d));
+			const __m128i ge = _mm_cmpeq_epi16(_mm_min_epu16(c, v_min), v_min);
+			v_sec = _mm_blendv_epi8(v_min, _mm_min_epu16(v_sec, c), ge);
+			v_best = _mm_blendv_epi8(v_index, v_best, ge);
+			v_min = _mm_min_epu16(v_min, c);
+			v_index = _mm_add_epi16(v_index, v_step);
+		}
+
+		alignas(16) uint16_t lane_min[8], lane_sec[8], lane_best[8];
+		_mm_store_si128(reinterpret_cast<__m128i*>(lane_min), v_min);
+		_mm_store_si128(reinterpret_cast<__m128i*>(lane_sec), v_sec);
+		_mm_store_si128(reinterpret_cast<__m128i*>(lane_best), v_best);
+		ReduceWtaLanes(lane_min, lane_sec, lane_best, 8, result);
+		FinishWta(cost, d, D, result);
+	}
+
+	template <int32_t kFixed>
+	SGM_TARGET_AVX2 static void WtaAVX2Impl(const uint16_t* cost, const int32_t& disp_range, WtaResult& result)
+	{
+		const int32_t D = kFixed ? kFixed : disp_range;
+		__m256i v_min = _mm256_set1_epi16(-1);
+		__m256i v_sec = v_min;
+		__m256i v_best = _mm256_setzero_si256();
+		__m256i v_index = _mm256_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+		const __m256i v_step = _mm256_set1_epi16(16);
+
+		int32_t d = 0;
+		for (; d + 16 <= D; d += 16) {
+			const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cost + d));
+			const __m256i ge = _mm256_cmpeq_epi16(_mm256_min_epu16(c, v_min), v_min);
+			v_sec = _mm256_blendv_epi8(v_min, _mm256_min_epu16(v_sec, c), ge);
+			v_best = _mm256_blendv_epi8(v_index, v_best, ge);
+			v_min = _mm256_min_epu16(v_min, c);
+			v_index = _mm256_add_epi16(v_index, v_step);
+		}
+
+		alignas(32) uint16_t lane_min[16], lane_sec[16], lane_best[16];
+		_mm256_store_si256(reinterpret_cast<__m256i*>(lane_min), v_min);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(lane_sec), v_sec);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(lane_best), v_best);
+		ReduceWtaLanes(lane_min, lane_sec, lane_best, 16, result);
+		FinishWta(cost, d, D, result);
+	}
+
+	void WtaSSE41(const uint16_t* cost, const int32_t& disp_range, WtaResult& result)
+	{
+		WtaSSE41Impl<0>(cost, disp_range, result);
+	}
+
+	// Transposes an 8x8 block of 16-bit values held in eight registers.
+	SGM_TARGET_SSE41 static inline void Transpose8x8(__m128i* r)
+	{
+		const __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]);
+		const __m128i a1 = _mm_unpackhi_epi16(r[0], r[1]);
+		const __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]);
+		const __m128i a3 = _mm_unpackhi_epi16(r[2], r[3]);
+		const __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]);
+		const __m128i a5 = _mm_unpackhi_epi16(r[4], r[5]);
+		const __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]);
+		const __m128i a7 = _mm_unpackhi_epi16(r[6], r[7]);
+		const __m128i b0 = _mm_unpacklo_epi32(a0, a2);
+		const __m128i b1 = _mm_unpackhi_epi32(a0, a2);
+		const __m128i b2 = _mm_unpacklo_epi32(a1, a3);
+		const __m128i b3 = _mm_unpackhi_epi32(a1, a3);
+		const __m128i b4 = _mm_unpacklo_epi32(a4, a6);
+		const __m128i b5 = _mm_unpackhi_epi32(a4, a6);
+		const __m128i b6 = _mm_unpacklo_epi32(a5, a7);
+		const __m128i b7 = _mm_unpackhi_epi32(a5, a7);
+		r[0] = _mm_unpacklo_epi64(b0, b4);
+		r[1] = _mm_unpackhi_epi64(b0, b4);
+		r[2] = _mm_unpacklo_epi64(b1, b5);
+		r[3] = _mm_unpackhi_epi64(b1, b5);
+		r[4] = _mm_unpacklo_epi64(b2, b6);
+		r[5] = _mm_unpackhi_epi64(b2, b6);
+		r[6] = _mm_unpacklo_epi64(b3, b7);
+		r[7] = _mm_unpackhi_epi64(b3, b7);
+	}
+
+	// The row is transposed eight disparities at a time into scratch (8 rows of width), so every disparity
+	// updates the right pixels with contiguous loads instead of a stride of disp_range.
+	SGM_TARGET_SSE41 void WtaRightRowSSE41(const uint16_t* cost_row, const int32_t& width, const int32_t& disp_range, const int32_t& min_disparity,
+		uint16_t* scratch, uint16_t* right_min, uint16_t* right_sec_min, uint16_t* right_best)
+	{
+		std::fill(right_min, right_min + width, UINT16_MAX);
+		std::fill(right_sec_min, right_sec_min + width, UINT16_MAX);
+		std::fill(right_best, right_best + width, UINT16_MAX);
+
+		for (int32_t k0 = 0; k0 < disp_range; k0 += 8) {
+			const int32_t kn = std::min(8, disp_range - k0);
+			int32_t j = 0;
+			if (kn == 8) {
+				for (; j + 8 <= width; j += 8) {
+					__m128i r[8];
+					for (int32_t i = 0; i < 8; i++) {
+						r[i] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cost_row + static_cast<size_t>(j + i) * disp_range + k0));
+					}
+					Transpose8x8(r);
+					for (int32_t i = 0; i < 8; i++) {
+						_mm_storeu_si128(reinterpret_cast<__m128i*>(scratch + i * width + j), r[i]);
+					}
+				}
+			}
+			for (; j < width; j++) {
+				for (int32_t i = 0; i < kn; i++) {
+					scratch[i * width + j] = cost_row[static_cast<size_t>(j) * disp_range + k0 + i];
+				}
+			}
+
+			for (int32_t i = 0; i < kn; i++) {
+				const int32_t k = k0 + i;
+				int32_t begin = 0, end = 0;
+				RightCandidates(width, min_disparity, k, begin, end);
+				const uint16_t* cost = scratch + i * width + begin;
+				const int32_t col = begin - min_disparity - k;
+				const int32_t count = end - begin;
+				const __m128i v_k = _mm_set1_epi16(static_cast<short>(k));
+				int32_t c = 0;
+				for (; c + 8 <= count; c += 8) {
+					__m128i* min = reinterpret_cast<__m128i*>(right_min + col + c);
+					__m128i* sec = reinterpret_cast<__m128i*>(right_sec_min + col + c);
+					__m128i* best = reinterpret_cast<__m128i*>(right_best + col + c);
+					const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cost + c));
+					const __m128i m = _mm_loadu_si128(min);
+					const __m128i ge = _mm_cmpeq_epi16(_mm_min_epu16(v, m), m);
+					_mm_storeu_si128(sec, _mm_blendv_epi8(m, _mm_min_epu16(_mm_loadu_si128(sec), v), ge));
+					_mm_storeu_si128(best, _mm_blendv_epi8(v_k, _mm_loadu_si128(best), ge));
+					_mm_storeu_si128(min, _mm_min_epu16(m, v));
+				}
+				UpdateRight(cost + c, count - c, static_cast<uint16_t>(k), right_min + col + c, right_sec_min + col + c, right_best + col + c);
+			}
+		}
+	}
+
+	void WtaAVX2(const uint16_t* cost, const int32_t& disp_range, WtaResult& result)
+	{
+		WtaAVX2Impl<0>(cost, disp_range, result);
+	}
+
+#else
+	void WtaSSE41(const uint16_t* cost, const int32_t& disp_range, WtaResult& result)
+	{
+		Wta(cost, disp_range, result);
+	}
+
+	void WtaAVX2(const uint16_t* cost, const int32_t& disp_range, WtaResult& result)
+	{
+		Wta(cost, disp_range, result);
+	}
+
+	void WtaRightRowSSE41(const uint16_t* cost_row, const int32_t& width, const int32_t& disp_range, const int32_t& min_disparity,
+		uint16_t* scratch, uint16_t* right_min, uint16_t* right_sec_min, uint16_t* right_best)
+	{
+		WtaRightRow(cost_row, width, disp_range, min_disparity, scratch, right_min, right_sec_min, right_best);
+	}
+
+#endif
+
+	template <int32_t kFixed>
+	static WtaFunc SelectWtaFixed(bool use_simd)
+	{
+#ifdef SGM_X86
+		if (use_simd) {
+			switch (DetectIsa()) {
+			case Isa::AVX2:
+				return WtaAVX2Impl<kFixed>;
+			case Isa::SSE41:
+				return WtaSSE41Impl<kFixed>;
+			default:
+				break;
+			}
+		}
+#endif
+		return WtaImpl<kFixed>;
+	}
+
+	WtaFunc SelectWta(const int32_t& disp_range, bool use_simd)
+	{
+		// The SIMD lanes count disparities in 16 bits.
+		if (disp_range > UINT16_MAX) {
+			return Wta;
+		}
+		switch (disp_range) {
+		case 64:
+			return SelectWtaFixed<64>(use_simd);
+		case 128:
+			return SelectWtaFixed<128>(use_simd);
+		case 192:
+			return SelectWtaFixed<192>(use_simd);
+		case 256:
+			return SelectWtaFixed<256>(use_simd);
+		default:
+			return SelectWtaFixed<0>(use_simd);
+		}
+	}
+
+	WtaRightRowFunc SelectWtaRightRow(bool use_simd)
+	{
+		if (use_simd && DetectIsa() != Isa::Scalar) {
+			return WtaRightRowSSE41;
+		}
+		return WtaRightRow;
+	}
+
+	void AccumulateCost(uint16_t* cost_sum, const uint8_t* cost, const int32_t& size)
+	{
+		int32_t i = 0;
+#ifdef SGM_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		for (; i + 16 <= size; i += 16) {
+			const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(cost + i));
+			__m128i* sum = reinterpret_cast<__m128i*>(cost_sum + i);
+			_mm_storeu_si128(sum, _mm_add_epi16(_mm_loadu_si128(sum), _mm_unpacklo_epi8(c, zero)));
+			_mm_storeu_si128(sum + 1, _mm_add_epi16(_mm_loadu_si128(sum + 1), _mm_unpackhi_epi8(c, zero)));
+		}
+#endif
+		for (; i < size; i++) {
+			cost_sum[i] += cost[i];
+		}
+	}
+
+	void AccumulateCost(uint16_t* cost_sum, const uint16_t* cost, const int32_t& size)
+	{
+		int32_t i = 0;
+#ifdef SGM_SSE2
+		for (; i + 8 <= size; i += 8) {
+			__m128i* sum = reinterpret_cast<__m128i*>(cost_sum + i);
+			_mm_storeu_si128(sum, _mm_add_epi16(_mm_loadu_si128(sum), _mm_loadu_si128(reinterpret_cast<const __m128i*>(cost + i))));
+		}
+#endif
+		for (; i < size; i++) {
+			cost_sum[i] += cost[i];
+		}
+	}
+
+	// Pixel pairs of a census type, the first pair in the highest bit.
+	struct CensusPattern {
+		int32_t	num_bits;
+		int32_t	rows, cols;			// window radius
+		int8_t	pairs[64][4];		// row and column offset of the first and of the second pixel
+	};
+
+	static CensusPattern MakeCensusPattern(const CensusType& type)
+	{
+		CensusPattern pattern;
+		const bool is_symmetric = type == CensusType::CenterSymmetric7x9;
+		pattern.num_bits = 0;
+		pattern.rows = (type == CensusType::Census5x5) ? 2 : 3;
+		pattern.cols = (type == CensusType::Census5x5) ? 2 : 4;
+		for (int32_t r = -pattern.rows; r <= pattern.rows; r++) {
+			for (int32_t c = -pattern.cols; c <= pattern.cols; c++) {
+				// The symmetric census compares the first half of the window with its mirror image.
+				const bool is_first_half = r < 0 || (r == 0 && c < 0);
+				if ((r == 0 && c == 0) || (is_symmetric && !is_first_half)) {
+					continue;
+				}
+				int8_t* pair = pattern.pairs[pattern.num_bits++];
+				pair[0] = static_cast<int8_t>(r);
+				pair[1] = static_cast<int8_t>(c);
+				pair[2] = static_cast<int8_t>(is_symmetric ? -r : 0);
+				pair[3] = static_cast<int8_t>(is_symmetric ? -c : 0);
+			}
+		}
+		return pattern;
+	}
+
+	static const CensusPattern& GetCensusPattern(const CensusType& type)
+	{
+		static const CensusPattern patterns[] = { MakeCensusPattern(CensusType::Census5x5),
+			MakeCensusPattern(CensusType::Census7x9), MakeCensusPattern(CensusType::CenterSymmetric7x9) };
+		return patterns[static_cast<int32_t>(type)];
+	}
+
+	// Pointers to the window rows around 'row', rows[r] for r in [-pattern.rows, pattern.rows], clamped to the image.
+	static inline void CensusWindowRows(const uint8_t* source, const int32_t& width, const int32_t& height, const int32_t& row,
+		const CensusPattern& pattern, const uint8_t** rows)
+	{
+		for (int32_t r = -pattern.rows; r <= pattern.rows; r++) {
+			rows[r] = source + static_cast<size_t>(std::min(std::max(row + r, 0), height - 1)) * width;
+		}
+	}
+
+	// Scalar census of the columns [col_begin, col_end), with the window clamped at the left and right border.
+	template <typename Census>
+	static void CensusSpan(const uint8_t* const* rows, const CensusPattern& pattern, const int32_t& width,
+		const int32_t& col_begin, const int32_t& col_end, Census* census_row)
+	{
+		for (int32_t j = col_begin; j < col_end; j++) {
+			const bool is_inside = j >= pattern.cols && j < width - pattern.cols;
+			Census census = 0;
+			for (int32_t k = 0; k < pattern.num_bits; k++) {
+				const int8_t* pair = pattern.pairs[k];
+				int32_t col_a = j + pair[1];
+				int32_t col_b = j + pair[3];
+				if (!is_inside) {
+					col_a = std::min(std::max(col_a, 0), width - 1);
+					col_b = std::min(std::max(col_b, 0), width - 1);
+				}
+				census = static_cast<Census>((census << 1) | (rows[pair[0]][col_a] < rows[pair[2]][col_b] ? 1u : 0u));
+			}
+			census_row[j] = census;
+		}
+	}
+
+	template <typename Census>
+	void CensusRow(const uint8_t* source, const int32_t& width, const int32_t& height, const int32_t& row,
+		const CensusType& type, Census* census_row)
+	{
+		const CensusPattern& pattern = GetCensusPattern(type);
+		const uint8_t* rows[7];
+		CensusWindowRows(source, width, height, row, pattern, rows + pattern.rows);
+		CensusSpan(rows + pattern.rows, pattern, width, 0, width, census_row);
+	}
+
+	template void CensusRow<uint32_t>(const uint8_t*, const int32_t&, const int32_t&, const int32_t&, const CensusType&, uint32_t*);
+	template void CensusRow<uint64_t>(const uint8_t*, const int32_t&, const int32_t&, const int32_t&, const CensusType&, uint64_t*);
+
+#ifdef SGM_X86
+	// The vector kernels build the census as byte planes, plane b holding bits 8b..8b+7 of every pixel.
+	// cmpeq(min(a, b), b) is all ones where the bit is 0, so the planes collect minus the zero bits,
+	// 2 * plane + mask per bit, and add the all-ones value of their bits once they are full.
+
+	// Transposes the byte planes of 16 pixels into their census words.
+	SGM_TARGET_SSE41 static inline void StoreCensusPlanes(const __m128i* planes, uint32_t* census)
+	{
+		const __m128i lo_0 = _mm_unpacklo_epi8(planes[0], planes[1]);
+		const __m128i hi_0 = _mm_unpackhi_epi8(planes[0], planes[1]);
+		const __m128i lo_1 = _mm_unpacklo_epi8(planes[2], planes[3]);
+		const __m128i hi_1 = _mm_unpackhi_epi8(planes[2], planes[3]);
+		__m128i* out = reinterpret_cast<__m128i*>(census);
+		_mm_storeu_si128(out, _mm_unpacklo_epi16(lo_0, lo_1));
+		_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(lo_0, lo_1));
+		_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(hi_0, hi_1));
+		_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(hi_0, hi_1));
+	}
+
+	SGM_TARGET_SSE41 static inline void StoreCensusPlanes(const __m128i* planes, uint64_t* census)
+	{
+		uint32_t low[16], high[16];
+		StoreCensusPlanes(planes, low);
+		StoreCensusPlanes(planes + 4, high);
+		for (int32_t i = 0; i < 16; i += 4) {
+			const __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(low + i));
+			const __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i*>(high + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(census + i), _mm_unpacklo_epi32(l, h));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(census + i + 2), _mm_unpackhi_epi32(l, h));
+		}
+	}
+
+	template <typename Census>
+	SGM_TARGET_SSE41 static void CensusRowSSE41(const uint8_t* source, const int32_t& width, const int32_t& height, const int32_t& row,
+		const CensusType& type, Census* census_row)
+	{
+		const CensusPattern& pattern = GetCensusPattern(type);
+		const uint8_t* rows[7];
+		CensusWindowRows(source, width, height, row, pattern, rows + pattern.rows);
+		const uint8_t* const* window = rows + pattern.rows;
+		const uint8_t* first[64];
+		const uint8_t* second[64];
+		for (int32_t k = 0; k < pattern.num_bits; k++) {
+			first[k] = window[pattern.pairs[k][0]] + pattern.pairs[k][1];
+			second[k] = window[pattern.pairs[k][2]] + pattern.pairs[k][3];
+		}
+
+		const int32_t num_planes = (pattern.num_bits + 7) / 8;
+		__m128i planes[8];
+		for (int32_t p = 0; p < 8; p++) {
+			planes[p] = _mm_setzero_si128();
+		}
+		int32_t j = pattern.cols;
+		for (; j + 16 + pattern.cols <= width; j += 16) {
+			int32_t k = 0;
+			for (int32_t p = num_planes - 1; p >= 0; p--) {
+				const int32_t count = pattern.num_bits - k - 8 * p;
+				__m128i plane = _mm_setzero_si128();
+				for (int32_t n = 0; n < count; n++, k++) {
+					const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(first[k] + j));
+					const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(second[k] + j));
+					plane = _mm_add_epi8(_mm_add_epi8(plane, plane), _mm_cmpeq_epi8(_mm_min_epu8(a, b), b));
+				}
+				planes[p] = _mm_add_epi8(plane, _mm_set1_epi8(static_cast<char>((1 << count) - 1)));
+			}
+			StoreCensusPlanes(planes, census_row + j);
+		}
+		CensusSpan(window, pattern, width, 0, std::min(pattern.cols, width), census_row);
+		CensusSpan(window, pattern, width, std::max(j, std::min(pattern.cols, width)), width, census_row);
+	}
+
+	// As the SSE4.1 transposition, with pixels 0-15 in the low and 16-31 in the high 128-bit lane.
+	SGM_TARGET_AVX2 static inline void StoreCensusPlanes(const __m256i* planes, uint32_t* census)
+	{
+		const __m256i lo_0 = _mm256_unpacklo_epi8(planes[0], planes[1]);
+		const __m256i hi_0 = _mm256_unpackhi_epi8(planes[0], planes[1]);
+		const __m256i lo_1 = _mm256_unpacklo_epi8(planes[2], planes[3]);
+		const __m256i hi_1 = _mm256_unpackhi_epi8(planes[2], planes[3]);
+		const __m256i w0 = _mm256_unpacklo_epi16(lo_0, lo_1);
+		const __m256i w1 = _mm256_unpackhi_epi16(lo_0, lo_1);
+		const __m256i w2 = _mm256_unpacklo_epi16(hi_0, hi_1);
+		const __m256i w3 = _mm256_unpackhi_epi16(hi_0, hi_1);
+		__m256i* out = reinterpret_cast<__m256i*>(census);
+		_mm256_storeu_si256(out, _mm256_permute2x128_si256(w0, w1, 0x20));
+		_mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(w2, w3, 0x20));
+		_mm256_storeu_si256(out + 2, _mm256_permute2x128_si256(w0, w1, 0x31));
+		_mm256_storeu_si256(out + 3, _mm256_permute2x128_si256(w2, w3, 0x31));
+	}
+
+	SGM_TARGET_AVX2 static inline void StoreCensusPlanes(const __m256i* planes, uint64_t* census)
+	{
+		uint32_t low[32], high[32];
+		StoreCensusPlanes(planes, low);
+		StoreCensusPlanes(planes + 4, high);
+		for (int32_t i = 0; i < 32; i += 8) {
+			const __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(low + i));
+			const __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(high + i));
+			const __m256i q0 = _mm256_unpacklo_epi32(l, h);
+			const __m256i q1 = _mm256_unpackhi_epi32(l, h);
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(census + i), _mm256_permute2x128_si256(q0, q1, 0x20));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(census + i + 4), _mm256_permute2x128_si256(q0, q1, 0x31));
+		}
+	}
+
+	template <typename Census>
+	SGM_TARGET_AVX2 static void CensusRowAVX2(const uint8_t* source, const int32_t& width, const int32_t& height, const int32_t& row,
+		const CensusType& type, Census* census_row)
+	{
+		const CensusPattern& pattern = GetCensusPattern(type);
+		const uint8_t* rows[7];
+		CensusWindowRows(source, width, height, row, pattern, rows + pattern.rows);
+		const uint8_t* const* window = rows + pattern.rows;
+		const uint8_t* first[64];
+		const uint8_t* second[64];
+		for (int32_t k = 0; k < pattern.num_bits; k++) {
+			first[k] = window[pattern.pairs[k][0]] + pattern.pairs[k][1];
+			second[k] = window[pattern.pairs[k][2]] + pattern.pairs[k][3];
+		}
+
+		const int32_t num_planes = (pattern.num_bits + 7) / 8;
+		__m256i planes[8];
+		for (int32_t p = 0; p < 8; p++) {
+			planes[p] = _mm256_setzero_si256();
+		}
+		int32_t j = pattern.cols;
+		for (; j + 32 + pattern.cols <= width; j += 32) {
+			int32_t k = 0;
+			for (int32_t p = num_planes - 1; p >= 0; p--) {
+				const int32_t count = pattern.num_bits - k - 8 * p;
+				__m256i plane = _mm256_setzero_si256();
+				for (int32_t n = 0; n < count; n++, k++) {
+					const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(first[k] + j));
+					const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(second[k] + j));
+					plane = _mm256_add_epi8(_mm256_add_epi8(plane, plane), _mm256_cmpeq_epi8(_mm256_min_epu8(a, b), b));
+				}
+				planes[p] = _mm256_add_epi8(plane, _mm256_set1_epi8(static_cast<char>((1 << count) - 1)));
+			}
+			StoreCensusPlanes(planes, census_row + j);
+		}
+		CensusSpan(window, pattern, width, 0, std::min(pattern.cols, width), census_row);
+		CensusSpan(window, pattern, width, std::max(j, std::min(pattern.cols, width)), width, census_row);
+	}
+#else
+	template <typename Census>
+	static void CensusRowSSE41(const uint8_t* source, const int32_t& width, const int32_t& height, const int32_t& row,
+		const CensusType& type, Census* census_row)
+	{
+		CensusRow(source, width, height, row, type, census_row);
+	}
+
+	template <typename Census>
+	static void CensusRowAVX2(const uint8_t* source, const int32_t& width, const int32_t& height, const int32_t& row,
+		const CensusType& type, Census* census_row)
+	{
+		CensusRow(source, width, height, row, type, census_row);
+	}
+#endif
+
+	template <typename Census>
+	CensusRowFunc<Census> SelectCensusRow(bool use_simd)
+	{
+		if (use_simd) {
+			switch (DetectIsa()) {
+			case Isa::AVX2: return CensusRowAVX2<Census>;
+			case Isa::SSE41: return CensusRowSSE41<Census>;
+			default: break;
+			}
+		}
+		return CensusRow<Census>;
+	}
+
+	template CensusRowFunc<uint32_t> SelectCensusRow<uint32_t>(bool use_simd);
+	template CensusRowFunc<uint64_t> SelectCensusRow<uint64_t>(bool use_simd);
+
+	// Disparities [d_lo, d_hi) of pixel j whose match lies inside the image.
+	static inline void InImageSegment(const int32_t& j, const int32_t& width, const int32_t& min_disparity, const int32_t& max_disparity,
+		int32_t& d_lo, int32_t& d_hi)
+	{
+		d_lo = std::min(std::max(min_disparity, j - width + 1), max_disparity);
+		d_hi = std::max(std::min(max_disparity, j + 1), d_lo);
+	}
+
+	// Splits every pixel's disparity range into the out-of-image parts (UINT8_MAX) and one contiguous
+	// in-image segment, so the Hamming kernels run without a per-disparity bounds check.
+	template <typename Census>
+	static inline void CensusCostRowImpl(const Census* census_left, const Census* census_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, uint8_t* cost_row, HammingSegmentFunc<Census> segment)
+	{
+		const int32_t disp_range = max_disparity - min_disparity;
+		for (int32_t j = 0; j < width; j++) {
+			uint8_t* cost = cost_row + static_cast<size_t>(j) * disp_range;
+			int32_t d_lo, d_hi;
+			InImageSegment(j, width, min_disparity, max_disparity, d_lo, d_hi);
+			memset(cost, UINT8_MAX, d_lo - min_disparity);
+			if (d_hi > d_lo) {
+				segment(census_left[j], census_right_rev + (width - 1 - j + d_lo), cost + (d_lo - min_disparity), d_hi - d_lo);
+			}
+			memset(cost + (d_hi - min_disparity), UINT8_MAX, max_disparity - d_hi);
+		}
+	}
+
+	template <typename Census>
+	static void HammingSegment(const Census& census_left, const Census* census_right, uint8_t* cost, const int32_t& count)
+	{
+		for (int32_t i = 0; i < count; i++) {
+			cost[i] = Hamming(census_left, census_right[i]);
+		}
+	}
+
+	template <typename Census>
+	void CensusCostRow(const Census* census_left, const Census* census_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, uint8_t* cost_row)
+	{
+		CensusCostRowImpl<Census>(census_left, census_right_rev, width, min_disparity, max_disparity, cost_row, HammingSegment<Census>);
+	}
+
+#ifdef SGM_X86
+	SGM_TARGET_POPCNT static inline uint8_t HammingPopcnt(const uint32_t& x, const uint32_t& y)
+	{
+#ifdef _MSC_VER
+		return static_cast<uint8_t>(__popcnt(x ^ y));
+#else
+		return static_cast<uint8_t>(__builtin_popcount(x ^ y));
+#endif
+	}
+
+	SGM_TARGET_POPCNT static inline uint8_t HammingPopcnt(const uint64_t& x, const uint64_t& y)
+	{
+#if defined(_MSC_VER) && defined(_M_X64)
+		return static_cast<uint8_t>(__popcnt64(x ^ y));
+#elif defined(_MSC_VER)
+		return static_cast<uint8_t>(__popcnt(static_cast<uint32_t>(x ^ y)) + __popcnt(static_cast<uint32_t>((x ^ y) >> 32)));
+#else
+		return static_cast<uint8_t>(__builtin_popcountll(x ^ y));
+#endif
+	}
+
+	template <typename Census>
+	SGM_TARGET_POPCNT static void HammingSegmentPopcnt(const Census& census_left, const Census* census_right, uint8_t* cost, const int32_t& count)
+	{
+		for (int32_t i = 0; i < count; i++) {
+			cost[i] = HammingPopcnt(census_left, census_right[i]);
+		}
+	}
+
+	// Per-byte popcount through a nibble lookup table, then summed up to the four bytes of each 32-bit lane.
+	SGM_TARGET_AVX2 static inline __m256i Popcount32(const __m256i& x)
+	{
+		const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+			0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+		const __m256i nibble = _mm256_set1_epi8(0x0F);
+		const __m256i count = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, nibble)),
+			_mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibble)));
+		return _mm256_madd_epi16(_mm256_maddubs_epi16(count, _mm256_set1_epi8(1)), _mm256_set1_epi16(1));
+	}
+
+	// Hamming distances of census_left to eight right census values, in the 32-bit lanes of the result.
+	SGM_TARGET_AVX2 static inline __m256i HammingLanes(const uint32_t& census_left, const uint32_t* census_right)
+	{
+		const __m256i left = _mm256_set1_epi32(static_cast<int>(census_left));
+		return Popcount32(_mm256_xor_si256(left, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(census_right))));
+	}
+
+	// hadd sums the halves of each 64-bit value but interleaves the two inputs per 128-bit lane, the permute undoes that.
+	SGM_TARGET_AVX2 static inline __m256i HammingLanes(const uint64_t& census_left, const uint64_t* census_right)
+	{
+		const __m256i left = _mm256_set1_epi64x(static_cast<long long>(census_left));
+		const __m256i* right = reinterpret_cast<const __m256i*>(census_right);
+		const __m256i c0 = Popcount32(_mm256_xor_si256(left, _mm256_loadu_si256(right)));
+		const __m256i c1 = Popcount32(_mm256_xor_si256(left, _mm256_loadu_si256(right + 1)));
+		return _mm256_permutevar8x32_epi32(_mm256_hadd_epi32(c0, c1), _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+	}
+
+	template <typename Census>
+	SGM_TARGET_AVX2 static void HammingSegmentAVX2(const Census& census_left, const Census* census_right, uint8_t* cost, const int32_t& count)
+	{
+		const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+		int32_t i = 0;
+		for (; i + 32 <= count; i += 32) {
+			const __m256i c0 = HammingLanes(census_left, census_right + i);
+			const __m256i c1 = HammingLanes(census_left, census_right + i + 8);
+			const __m256i c2 = HammingLanes(census_left, census_right + i + 16);
+			const __m256i c3 = HammingLanes(census_left, census_right + i + 24);
+			// packs work per 128-bit lane, the permute restores the disparity order
+			const __m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(c0, c1), _mm256_packus_epi32(c2, c3));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(cost + i), _mm256_permutevar8x32_epi32(bytes, order));
+		}
+		for (; i + 8 <= count; i += 8) {
+			const __m256i c = HammingLanes(census_left, census_right + i);
+			const __m256i words = _mm256_packus_epi32(c, c);
+			const __m256i bytes = _mm256_packus_epi16(words, words);
+			const uint32_t lo = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm256_castsi256_si128(bytes)));
+			const uint32_t hi = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm256_extracti128_si256(bytes, 1)));
+			memcpy(cost + i, &lo, 4);
+			memcpy(cost + i + 4, &hi, 4);
+		}
+		for (; i < count; i++) {
+			cost[i] = Hamming(census_left, census_right[i]);
+		}
+	}
+
+	template <typename Census>
+	void CensusCostRowPopcnt(const Census* census_left, const Census* census_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, uint8_t* cost_row)
+	{
+		CensusCostRowImpl<Census>(census_left, census_right_rev, width, min_disparity, max_disparity, cost_row, HammingSegmentPopcnt<Census>);
+	}
+
+	template <typename Census>
+	void CensusCostRowAVX2(const Census* census_left, const Census* census_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, uint8_t* cost_row)
+	{
+		CensusCostRowImpl<Census>(census_left, census_right_rev, width, min_disparity, max_disparity, cost_row, HammingSegmentAVX2<Census>);
+	}
+#else
+	template <typename Census>
+	static void HammingSegmentPopcnt(const Census& census_left, const Census* census_right, uint8_t* cost, const int32_t& count)
+	{
+		HammingSegment(census_left, census_right, cost, count);
+	}
+
+	template <typename Census>
+	void CensusCostRowPopcnt(const Census* census_left, const Census* census_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, uint8_t* cost_row)
+	{
+		CensusCostRow(census_left, census_right_rev, width, min_disparity, max_disparity, cost_row);
+	}
+
+	template <typename Census>
+	void CensusCostRowAVX2(const Census* census_left, const Census* census_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, uint8_t* cost_row)
+	{
+		CensusCostRow(census_left, census_right_rev, width, min_disparity, max_disparity, cost_row);
+	}
+#endif
+
+	template <typename Census>
+	CensusCostRowFunc<Census> SelectCensusCostRow(bool use_simd)
+	{
+		if (use_simd && DetectIsa() == Isa::AVX2) {
+			return CensusCostRowAVX2<Census>;
+		}
+		return HasPopcnt() ? CensusCostRowPopcnt<Census> : CensusCostRow<Census>;
+	}
+
+	template void CensusCostRow<uint32_t>(const uint32_t*, const uint32_t*, const int32_t&, const int32_t&, const int32_t&, uint8_t*);
+	template void CensusCostRow<uint64_t>(const uint64_t*, const uint64_t*, const int32_t&, const int32_t&, const int32_t&, uint8_t*);
+	template void CensusCostRowPopcnt<uint32_t>(const uint32_t*, const uint32_t*, const int32_t&, const int32_t&, const int32_t&, uint8_t*);
+	template void CensusCostRowPopcnt<uint64_t>(const uint64_t*, const uint64_t*, const int32_t&, const int32_t&, const int32_t&, uint8_t*);
+	template void CensusCostRowAVX2<uint32_t>(const uint32_t*, const uint32_t*, const int32_t&, const int32_t&, const int32_t&, uint8_t*);
+	template void CensusCostRowAVX2<uint64_t>(const uint64_t*, const uint64_t*, const int32_t&, const int32_t&, const int32_t&, uint8_t*);
+	template CensusCostRowFunc<uint32_t> SelectCensusCostRow<uint32_t>(bool use_simd);
+	template CensusCostRowFunc<uint64_t> SelectCensusCostRow<uint64_t>(bool use_simd);
+
+	template <typename Census>
+	HammingSegmentFunc<Census> SelectHammingSegment()
+	{
+		return HasPopcnt() ? HammingSegmentPopcnt<Census> : HammingSegment<Census>;
+	}
+
+	template HammingSegmentFunc<uint32_t> SelectHammingSegment<uint32_t>();
+	template HammingSegmentFunc<uint64_t> SelectHammingSegment<uint64_t>();
+
+	void GradientRow(const uint8_t* source, const int32_t& width, const int32_t& height, const int32_t& row, uint8_t* gradient)
+	{
+		const uint8_t* above = source + static_cast<size_t>(std::max(row - 1, 0)) * width;
+		const uint8_t* center = source + static_cast<size_t>(row) * width;
+		const uint8_t* below = source + static_cast<size_t>(std::min(row + 1, height - 1)) * width;
+		for (int32_t j = 0; j < width; j++) {
+			const int32_t l = std::max(j - 1, 0);
+			const int32_t r = std::min(j + 1, width - 1);
+			const int32_t gx = (above[r] - above[l]) + 2 * (center[r] - center[l]) + (below[r] - below[l]);
+			gradient[j] = static_cast<uint8_t>((gx + 1024) >> 3);
+		}
+	}
+
+	void CombineCostRow(uint8_t* cost_row, const uint8_t* term_left, const uint8_t* term_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, const uint8_t* census_lut, const uint8_t* term_lut)
+	{
+		const int32_t disp_range = max_disparity - min_disparity;
+		for (int32_t j = 0; j < width; j++) {
+			int32_t d_lo, d_hi;
+			InImageSegment(j, width, min_disparity, max_disparity, d_lo, d_hi);
+			uint8_t* cost = cost_row + static_cast<size_t>(j) * disp_range + (d_lo - min_disparity);
+			const uint8_t* term_right = term_right_rev + (width - 1 - j + d_lo);
+			for (int32_t i = 0; i < d_hi - d_lo; i++) {
+				const int32_t diff = std::min(abs(term_left[j] - term_right[i]), 63);
+				cost[i] = static_cast<uint8_t>(census_lut[cost[i]] + term_lut[diff]);
+			}
+		}
+	}
+
+	void TableCostRow(const uint8_t* img_left, const uint8_t* img_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, const uint8_t* table, uint8_t* cost_row)
+	{
+		const int32_t disp_range = max_disparity - min_disparity;
+		for (int32_t j = 0; j < width; j++) {
+			int32_t d_lo, d_hi;
+			InImageSegment(j, width, min_disparity, max_disparity, d_lo, d_hi);
+			uint8_t* cost = cost_row + static_cast<size_t>(j) * disp_range;
+			const uint8_t* table_row = table + img_left[j] * 256;
+			const uint8_t* right = img_right_rev + (width - 1 - j + d_lo);
+			memset(cost, UINT8_MAX, d_lo - min_disparity);
+			for (int32_t i = 0; i < d_hi - d_lo; i++) {
+				cost[d_lo - min_disparity + i] = table_row[right[i]];
+			}
+			memset(cost + (d_hi - min_disparity), UINT8_MAX, max_disparity - d_hi);
+		}
+	}
+
+#ifdef SGM_X86
+	// Entries 0..63 of a table: pshufb looks up 16 of them per 128-bit lane, index bits 4 and 5 pick the quarter.
+	SGM_TARGET_AVX2 static inline __m256i Lookup64(const __m256i* lut, const __m256i& index)
+	{
+		const __m256i bit4 = _mm256_slli_epi16(index, 3);
+		const __m256i bit5 = _mm256_slli_epi16(index, 2);
+		const __m256i low = _mm256_blendv_epi8(_mm256_shuffle_epi8(lut[0], index), _mm256_shuffle_epi8(lut[1], index), bit4);
+		const __m256i high = _mm256_blendv_epi8(_mm256_shuffle_epi8(lut[2], index), _mm256_shuffle_epi8(lut[3], index), bit4);
+		return _mm256_blendv_epi8(low, high, bit5);
+	}
+
+	SGM_TARGET_AVX2 void CombineCostRowAVX2(uint8_t* cost_row, const uint8_t* term_left, const uint8_t* term_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, const uint8_t* census_lut, const uint8_t* term_lut)
+	{
+		__m256i census_quarters[4], term_quarters[4];
+		for (int32_t q = 0; q < 4; q++) {
+			census_quarters[q] = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(census_lut + 16 * q)));
+			term_quarters[q] = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(term_lut + 16 * q)));
+		}
+		const __m256i max_diff = _mm256_set1_epi8(63);
+
+		const int32_t disp_range = max_disparity - min_disparity;
+		for (int32_t j = 0; j < width; j++) {
+			int32_t d_lo, d_hi;
+			InImageSegment(j, width, min_disparity, max_disparity, d_lo, d_hi);
+			uint8_t* cost = cost_row + static_cast<size_t>(j) * disp_range + (d_lo - min_disparity);
+			const uint8_t* term_right = term_right_rev + (width - 1 - j + d_lo);
+			const __m256i left = _mm256_set1_epi8(static_cast<char>(term_left[j]));
+			const int32_t count = d_hi - d_lo;
+			int32_t i = 0;
+			for (; i + 32 <= count; i += 32) {
+				const __m256i census = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(cost + i));
+				const __m256i right = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(term_right + i));
+				const __m256i diff = _mm256_min_epu8(_mm256_or_si256(_mm256_subs_epu8(left, right), _mm256_subs_epu8(right, left)), max_diff);
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(cost + i),
+					_mm256_add_epi8(Lookup64(census_quarters, census), Lookup64(term_quarters, diff)));
+			}
+			for (; i < count; i++) {
+				const int32_t diff = std::min(abs(term_left[j] - term_right[i]), 63);
+				cost[i] = static_cast<uint8_t>(census_lut[cost[i]] + term_lut[diff]);
+			}
+		}
+	}
+
+	// Entries of table_row for eight right intensities, in the 32-bit lanes of the result.
+	SGM_TARGET_AVX2 static inline __m256i GatherLanes(const uint8_t* table_row, const uint8_t* right)
+	{
+		const __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(right)));
+		return _mm256_and_si256(_mm256_i32gather_epi32(reinterpret_cast<const int*>(table_row), index, 1), _mm256_set1_epi32(0xFF));
+	}
+
+	SGM_TARGET_AVX2 void TableCostRowAVX2(const uint8_t* img_left, const uint8_t* img_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, const uint8_t* table, uint8_t* cost_row)
+	{
+		const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+		const int32_t disp_range = max_disparity - min_disparity;
+		for (int32_t j = 0; j < width; j++) {
+			int32_t d_lo, d_hi;
+			InImageSegment(j, width, min_disparity, max_disparity, d_lo, d_hi);
+			uint8_t* cost = cost_row + static_cast<size_t>(j) * disp_range;
+			const uint8_t* table_row = table + img_left[j] * 256;
+			const uint8_t* right = img_right_rev + (width - 1 - j + d_lo);
+			memset(cost, UINT8_MAX, d_lo - min_disparity);
+			uint8_t* segment = cost + (d_lo - min_disparity);
+			const int32_t count = d_hi - d_lo;
+			int32_t i = 0;
+			for (; i + 32 <= count; i += 32) {
+				const __m256i c0 = GatherLanes(table_row, right + i);
+				const __m256i c1 = GatherLanes(table_row, right + i + 8);
+				const __m256i c2 = GatherLanes(table_row, right + i + 16);
+				const __m256i c3 = GatherLanes(table_row, right + i + 24);
+				const __m256i bytes = _mm256_packus_epi16(_mm256_packus_epi32(c0, c1), _mm256_packus_epi32(c2, c3));
+				_mm256_storeu_si256(reinterpret_cast<__m256i*>(segment + i), _mm256_permutevar8x32_epi32(bytes, order));
+			}
+			for (; i < count; i++) {
+				segment[i] = table_row[right[i]];
+			}
+			memset(cost + (d_hi - min_disparity), UINT8_MAX, max_disparity - d_hi);
+		}
+	}
+#else
+	void CombineCostRowAVX2(uint8_t* cost_row, const uint8_t* term_left, const uint8_t* term_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, const uint8_t* census_lut, const uint8_t* term_lut)
+	{
+		CombineCostRow(cost_row, term_left, term_right_rev, width, min_disparity, max_disparity, census_lut, term_lut);
+	}
+
+	void TableCostRowAVX2(const uint8_t* img_left, const uint8_t* img_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, const uint8_t* table, uint8_t* cost_row)
+	{
+		TableCostRow(img_left, img_right_rev, width, min_disparity, max_disparity, table, cost_row);
+	}
+#endif
+
+	CombineCostRowFunc SelectCombineCostRow(bool use_simd)
+	{
+		return (use_simd && DetectIsa() == Isa::AVX2) ? CombineCostRowAVX2 : CombineCostRow;
+	}
+
+	TableCostRowFunc SelectTableCostRow(bool use_simd)
+	{
+		return (use_simd && DetectIsa() == Isa::AVX2) ? TableCostRowAVX2 : TableCostRow;
+	}
+
+	// Median of 9 (Devillard), the median ends up in element 4.
+	static const uint8_t kMedian9[][2] = {
+		{ 1, 2 }, { 4, 5 }, { 7, 8 }, { 0, 1 }, { 3, 4 }, { 6, 7 }, { 1, 2 }, { 4, 5 }, { 7, 8 }, { 0, 3 },
+		{ 5, 8 }, { 4, 7 }, { 3, 6 }, { 1, 4 }, { 2, 5 }, { 4, 7 }, { 4, 2 }, { 6, 4 }, { 4, 2 },
+	};
+
+	// Median of 25, Batcher's merge network pruned to the comparators element 12 depends on.
+	static const uint8_t kMedian25[][2] = {
+		{ 0, 1 }, { 2, 3 }, { 0, 2 }, { 1, 3 }, { 1, 2 }, { 4, 5 }, { 6, 7 }, { 4, 6 }, { 5, 7 }, { 5, 6 },
+		{ 0, 4 }, { 2, 6 }, { 2, 4 }, { 1, 5 }, { 3, 7 }, { 3, 5 }, { 1, 2 }, { 3, 4 }, { 5, 6 }, { 8, 9 },
+		{ 10, 11 }, { 8, 10 }, { 9, 11 }, { 9, 10 }, { 12, 13 }, { 14, 15 }, { 12, 14 }, { 13, 15 }, { 13, 14 }, { 8, 12 },
+		{ 10, 14 }, { 10, 12 }, { 9, 13 }, { 11, 15 }, { 11, 13 }, { 9, 10 }, { 11, 12 }, { 13, 14 }, { 0, 8 }, { 4, 12 },
+		{ 4, 8 }, { 2, 10 }, { 6, 14 }, { 6, 10 }, { 2, 4 }, { 6, 8 }, { 10, 12 }, { 1, 9 }, { 5, 13 }, { 5, 9 },
+		{ 3, 11 }, { 7, 15 }, { 7, 11 }, { 3, 5 }, { 7, 9 }, { 11, 13 }, { 1, 2 }, { 3, 4 }, { 5, 6 }, { 7, 8 },
+		{ 9, 10 }, { 11, 12 }, { 13, 14 }, { 16, 17 }, { 18, 19 }, { 16, 18 }, { 17, 19 }, { 17, 18 }, { 20, 21 }, { 22, 23 },
+		{ 20, 22 }, { 21, 23 }, { 21, 22 }, { 16, 20 }, { 18, 22 }, { 18, 20 }, { 17, 21 }, { 19, 23 }, { 19, 21 }, { 17, 18 },
+		{ 19, 20 }, { 21, 22 }, { 16, 24 }, { 20, 24 }, { 18, 20 }, { 22, 24 }, { 19, 21 }, { 17, 18 }, { 19, 20 }, { 21, 22 },
+		{ 23, 24 }, { 0, 16 }, { 8, 24 }, { 8, 16 }, { 4, 20 }, { 12, 20 }, { 12, 16 }, { 2, 18 }, { 10, 18 }, { 6, 22 },
+		{ 6, 10 }, { 10, 12 }, { 1, 17 }, { 9, 17 }, { 5, 21 }, { 13, 21 }, { 13, 17 }, { 3, 19 }, { 11, 19 }, { 7, 23 },
+		{ 7, 11 }, { 11, 13 }, { 11, 12 },
+	};
+
+	static const int32_t kMedianLanes = 8;
+
+	// Elementwise min into a and max into b for kMedianLanes aligned values.
+	static inline void SortLanes(float* a, float* b)
+	{
+#ifdef SGM_SSE2
+		for (int32_t l = 0; l < kMedianLanes; l += 4) {
+			const __m128 x = _mm_load_ps(a + l);
+			const __m128 y = _mm_load_ps(b + l);
+			_mm_store_ps(a + l, _mm_min_ps(x, y));
+			_mm_store_ps(b + l, _mm_max_ps(x, y));
+		}
+#else
+		for (int32_t l = 0; l < kMedianLanes; l++) {
+			const float lo = std::min(a[l], b[l]);
+			b[l] = std::max(a[l], b[l]);
+			a[l] = lo;
+		}
+#endif
+	}
+
+	// Median of the window around (i, j) clipped to the image, radius <= 2.
+	static inline float MedianClipped(const float* in, const int32_t& width, const int32_t& height, const int32_t& radius,
+		const int32_t& i, const int32_t& j)
+	{
+		float window[25];
+		int32_t n = 0;
+		for (int32_t r = std::max(0, i - radius); r <= std::min(height - 1, i + radius); r++) {
+			for (int32_t c = std::max(0, j - radius); c <= std::min(width - 1, j + radius); c++) {
+				window[n++] = in[static_cast<size_t>(r) * width + c];
+			}
+		}
+		std::nth_element(window, window + n / 2, window + n);
+		return window[n / 2];
+	}
+
+	template <int32_t kRadius, size_t kNetworkSize>
+	static void MedianRowsNetworkImpl(const float* in, float* out, const int32_t& width, const int32_t& height,
+		const int32_t& row_begin, const int32_t& row_end, const uint8_t(&network)[kNetworkSize][2])
+	{
+		const int32_t size = (2 * kRadius + 1) * (2 * kRadius + 1);
+		alignas(32) float lanes[size][kMedianLanes];
+
+		for (int32_t i = row_begin; i < row_end; i++) {
+			float* out_row = out + static_cast<size_t>(i) * width;
+			int32_t j = 0;
+			if (i >= kRadius && i + kRadius < height) {
+				for (; j < kRadius && j < width; j++) {
+					out_row[j] = MedianClipped(in, width, height, kRadius, i, j);
+				}
+				for (; j + kMedianLanes + kRadius <= width; j += kMedianLanes) {
+					int32_t k = 0;
+					for (int32_t r = -kRadius; r <= kRadius; r++) {
+						const float* src = in + static_cast<size_t>(i + r) * width + j;
+						for (int32_t c = -kRadius; c <= kRadius; c++, k++) {
+							for (int32_t l = 0; l < kMedianLanes; l++) {
+								lanes[k][l] = src[c + l];
+							}
+						}
+					}
+					for (size_t n = 0; n < kNetworkSize; n++) {
+						SortLanes(lanes[network[n][0]], lanes[network[n][1]]);
+					}
+					for (int32_t l = 0; l < kMedianLanes; l++) {
+						out_row[j + l] = lanes[size / 2][l];
+					}
+				}
+			}
+			for (; j < width; j++) {
+				out_row[j] = MedianClipped(in, width, height, kRadius, i, j);
+			}
+		}
+	}
+
+	void MedianRowsNetwork(const float* in, float* out, const int32_t& width, const int32_t& height, const int32_t& radius,
+		const int32_t& row_begin, const int32_t& row_end)
+	{
+		if (radius == 1) {
+			MedianRowsNetworkImpl<1>(in, out, width, height, row_begin, row_end, kMedian9);
+		}
+		else if (radius == 2) {
+			MedianRowsNetworkImpl<2>(in, out, width, height, row_begin, row_end, kMedian25);
+		}
+	}
+
+	// Fine bins per coarse bin of the histogram median.
+	static const int32_t kMedianCoarse = 16;
+
+	// Fine bins: the quantized disparities, padding and the bin of infinity last.
+	static inline int32_t MedianBins(const int32_t& disp_range)
+	{
+		return ((disp_range - 1) * kMedianSubpixel + 2 + kMedianCoarse - 1) / kMedianCoarse * kMedianCoarse;
+	}
+
+	size_t MedianHistogramSize(const int32_t& tile_width, const int32_t& radius, const int32_t& disp_range)
+	{
+		const size_t bins = MedianBins(disp_range);
+		const size_t coarse = bins / kMedianCoarse;
+		const size_t columns = tile_width + 2 * radius;
+		const size_t bytes = coarse * sizeof(int32_t) + (coarse + bins) * sizeof(uint32_t) + columns * (coarse + bins) * sizeof(uint16_t);
+		return (bytes + 63) / 64 * 64;
+	}
+
+	void MedianTileHistogram(const float* in, float* out, const int32_t& width, const int32_t& height, const int32_t& radius,
+		const int32_t& min_disparity, const int32_t& max_disparity, const int32_t& row_begin, const int32_t& row_end,
+		const int32_t& col_begin, const int32_t& col_end, uint8_t* scratch)
+	{
+		const int32_t bins = MedianBins(max_disparity - min_disparity);
+		const int32_t coarse = bins / kMedianCoarse;
+		const int32_t invalid = bins - 1;
+		const int32_t top = (max_disparity - min_disparity - 1) * kMedianSubpixel;
+		const float infinity = std::numeric_limits<float>::infinity();
+
+		// Column histograms of the tile columns and radius columns on each side.
+		const int32_t col_first = std::max(0, col_begin - radius);
+		const int32_t columns = std::min(width, col_end + radius) - col_first;
+
+		// Window histogram: the coarse bins are kept up to date, a fine slice only when the median falls into it,
+		// last[b] is the column its slice was last brought to.
+		int32_t* last = reinterpret_cast<int32_t*>(scratch);
+		uint32_t* wnd_coarse = reinterpret_cast<uint32_t*>(last + coarse);
+		uint32_t* wnd_fine = wnd_coarse + coarse;
+		uint16_t* col_coarse = reinterpret_cast<uint16_t*>(wnd_fine + bins);
+		uint16_t* col_fine = col_coarse + static_cast<size_t>(columns) * coarse;
+		memset(col_coarse, 0, static_cast<size_t>(columns) * (coarse + bins) * sizeof(uint16_t));
+
+		auto update_columns = [&](const int32_t& row, const uint16_t& delta) {
+			const float* in_row = in + static_cast<size_t>(row) * width + col_first;
+			for (int32_t x = 0; x < columns; x++) {
+				int32_t q = invalid;
+				if (in_row[x] < infinity) {
+					q = static_cast<int32_t>(std::max(in_row[x] - static_cast<float>(min_disparity), 0.0f) * kMedianSubpixel + 0.5f);
+					q = std::min(q, top);
+				}
+				col_fine[static_cast<size_t>(x) * bins + q] += delta;
+				col_coarse[static_cast<size_t>(x) * coarse + q / kMedianCoarse] += delta;
+			}
+		};
+		auto update_coarse = [&](const int32_t& col, const bool& add) {
+			const uint16_t* hist = col_coarse + static_cast<size_t>(col - col_first) * coarse;
+			if (add) {
+				for (int32_t b = 0; b < coarse; b++) {
+					wnd_coarse[b] += hist[b];
+				}
+			}
+			else {
+				for (int32_t b = 0; b < coarse; b++) {
+					wnd_coarse[b] -= hist[b];
+				}
+			}
+		};
+		auto update_fine = [&](const int32_t& col, const int32_t& b, const bool& add) {
+			const uint16_t* hist = col_fine + static_cast<size_t>(col - col_first) * bins + b * kMedianCoarse;
+			uint32_t* fine = wnd_fine + b * kMedianCoarse;
+			if (add) {
+				for (int32_t f = 0; f < kMedianCoarse; f++) {
+					fine[f] += hist[f];
+				}
+			}
+			else {
+				for (int32_t f = 0; f < kMedianCoarse; f++) {
+					fine[f] -= hist[f];
+				}
+			}
+		};
+
+		for (int32_t y = std::max(0, row_begin - radius); y < std::min(height, row_begin + radius); y++) {
+			update_columns(y, 1);
+		}
+		for (int32_t i = row_begin; i < row_end; i++) {
+			if (i + radius < height) {
+				update_columns(i + radius, 1);
+			}
+			if (i > row_begin && i - radius - 1 >= 0) {
+				update_columns(i - radius - 1, UINT16_MAX);
+			}
+			const uint32_t rows = std::min(height - 1, i + radius) - std::max(0, i - radius) + 1;
+
+			memset(wnd_coarse, 0, coarse * sizeof(uint32_t));
+			std::fill(last, last + coarse, INT32_MIN);
+			for (int32_t x = std::max(0, col_begin - radius); x < std::min(width, col_begin + radius); x++) {
+				update_coarse(x, true);
+			}
+
+			float* out_row = out + static_cast<size_t>(i) * width;
+			for (int32_t j = col_begin; j < col_end; j++) {
+				if (j + radius < width) {
+					update_coarse(j + radius, true);
+				}
+				if (j > col_begin && j - radius - 1 >= 0) {
+					update_coarse(j - radius - 1, false);
+				}
+
+				uint32_t rank = rows * (std::min(width - 1, j + radius) - std::max(0, j - radius) + 1) / 2;
+				int32_t b = 0;
+				while (wnd_coarse[b] <= rank) {
+					rank -= wnd_coarse[b++];
+				}
+
+				// Slide the fine slice over to column j, or rebuild it when that is cheaper.
+				if (last[b] == INT32_MIN || j - last[b] > radius) {
+					memset(wnd_fine + b * kMedianCoarse, 0, kMedianCoarse * sizeof(uint32_t));
+					for (int32_t x = std::max(0, j - radius); x <= std::min(width - 1, j + radius); x++) {
+						update_fine(x, b, true);
+					}
+				}
+				else {
+					for (int32_t x = last[b] + 1; x <= j; x++) {
+						if (x + radius < width) {
+							update_fine(x + radius, b, true);
+						}
+						if (x - radius - 1 >= 0) {
+							update_fine(x - radius - 1, b, false);
+						}
+					}
+				}
+				last[b] = j;
+
+				const uint32_t* fine = wnd_fine + b * kMedianCoarse;
+				int32_t f = 0;
+				while (fine[f] <= rank) {
+					rank -= fine[f++];
+				}
+				const int32_t q = b * kMedianCoarse + f;
+				out_row[j] = (q == invalid) ? infinity : min_disparity + static_cast<float>(q) / kMedianSubpixel;
+			}
+		}
+	}
+
+	// Class of pixel j from the row as it was before the check.
+	static inline uint8_t LrCheckPixel(const float* disp_left, const float* disp_right, const int32_t& width, const float& threshold,
+		const int32_t& j)
+	{
+		const float infinity = std::numeric_limits<float>::infinity();
+		const float disp = disp_left[j];
+		if (disp == infinity) {
+			return kLrMismatched;
+		}
+		const int32_t col_right = static_cast<int32_t>(j - disp + 0.5f);
+		if (col_right < 0 || col_right >= width) {
+			return kLrMismatched;
+		}
+		const float disp_r = disp_right[col_right];
+		if (std::fabs(disp - disp_r) <= threshold) {
+			return kLrValid;
+		}
+		if (disp_r == infinity) {
+			return kLrMismatched;
+		}
+		const int32_t col_rl = static_cast<int32_t>(col_right + disp_r + 0.5f);
+		return (col_rl > 0 && col_rl < width && disp_left[col_rl] > disp) ? kLrOccluded : kLrMismatched;
+	}
+
+	// Invalidates the failed pixels once the whole row is classified, so every pixel looks back at the unchanged row.
+	static void LrInvalidate(float* disp_left, const int32_t& width, const uint8_t* classes)
+	{
+		for (int32_t j = 0; j < width; j++) {
+			if (LrClassAt(classes, j) != kLrValid) {
+				disp_left[j] = std::numeric_limits<float>::infinity();
+			}
+		}
+	}
+
+	void LrCheckRow(float* disp_left, const float* disp_right, const int32_t& width, const float& threshold,
+		uint8_t* classes, int32_t& num_occlusions, int32_t& num_mismatches)
+	{
+		memset(classes, 0, (width + 3) / 4);
+		num_occlusions = num_mismatches = 0;
+		for (int32_t j = 0; j < width; j++) {
+			const uint8_t lr_class = LrCheckPixel(disp_left, disp_right, width, threshold, j);
+			num_occlusions += (lr_class == kLrOccluded) ? 1 : 0;
+			num_mismatches += (lr_class == kLrMismatched) ? 1 : 0;
+			classes[j >> 2] |= lr_class << (2 * (j & 3));
+		}
+		LrInvalidate(disp_left, width, classes);
+	}
+
+#ifdef SGM_X86
+	// Bit i of x moved to bit 2 * i.
+	static inline uint32_t SpreadBits8(uint32_t x)
+	{
+		x = (x | (x << 4)) & 0x0F0Fu;
+		x = (x | (x << 2)) & 0x3333u;
+		return (x | (x << 1)) & 0x5555u;
+	}
+
+	SGM_TARGET_AVX2 void LrCheckRowAVX2(float* disp_left, const float* disp_right, const int32_t& width, const float& threshold,
+		uint8_t* classes, int32_t& num_occlusions, int32_t& num_mismatches)
+	{
+		memset(classes, 0, (width + 3) / 4);
+		num_occlusions = num_mismatches = 0;
+
+		const __m256 infinity = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+		const __m256 half = _mm256_set1_ps(0.5f);
+		const __m256 thres = _mm256_set1_ps(threshold);
+		const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+		const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i neg_one = _mm256_set1_epi32(-1);
+		const __m256i cols = _mm256_set1_epi32(width);
+		int32_t j = 0;
+		for (; j + 8 <= width; j += 8) {
+			const __m256 disp = _mm256_loadu_ps(disp_left + j);
+			const __m256 pos = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(j), lanes));
+			const __m256 is_invalid = _mm256_cmp_ps(disp, infinity, _CMP_EQ_OQ);
+
+			// Right match, out-of-image lanes gather infinity and fail.
+			const __m256i col_right = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_sub_ps(pos, disp), half));
+			const __m256i in_right = _mm256_and_si256(_mm256_cmpgt_epi32(col_right, neg_one), _mm256_cmpgt_epi32(cols, col_right));
+			const __m256 disp_r = _mm256_mask_i32gather_ps(infinity, disp_right, col_right, _mm256_castsi256_ps(in_right), 4);
+			const __m256 is_fail = _mm256_cmp_ps(_mm256_and_ps(_mm256_sub_ps(disp, disp_r), abs_mask), thres, _CMP_NLE_UQ);
+
+			// Back to the left image, lanes outside (or from an invalid right disparity) gather -infinity and count as mismatches.
+			const __m256i col_rl = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_add_ps(_mm256_cvtepi32_ps(col_right), disp_r), half));
+			const __m256i in_left = _mm256_and_si256(_mm256_cmpgt_epi32(col_rl, zero), _mm256_cmpgt_epi32(cols, col_rl));
+			const __m256 disp_l = _mm256_mask_i32gather_ps(_mm256_sub_ps(_mm256_setzero_ps(), infinity), disp_left, col_rl,
+				_mm256_castsi256_ps(in_left), 4);
+
+			const __m256 is_occluded = _mm256_andnot_ps(is_invalid, _mm256_and_ps(is_fail, _mm256_cmp_ps(disp_l, disp, _CMP_GT_OQ)));
+			const __m256 is_mismatched = _mm256_andnot_ps(is_occluded, _mm256_or_ps(is_invalid, is_fail));
+			const uint32_t occluded = static_cast<uint32_t>(_mm256_movemask_ps(is_occluded));
+			const uint32_t mismatched = static_cast<uint32_t>(_mm256_movemask_ps(is_mismatched));
+			const uint32_t bits = SpreadBits8(occluded) | (SpreadBits8(mismatched) << 1);
+			classes[j >> 2] = static_cast<uint8_t>(bits);
+			classes[(j >> 2) + 1] = static_cast<uint8_t>(bits >> 8);
+			num_occlusions += Hamming32(occluded, 0);
+			num_mismatches += Hamming32(mismatched, 0);
+		}
+		for (; j < width; j++) {
+			const uint8_t lr_class = LrCheckPixel(disp_left, disp_right, width, threshold, j);
+			num_occlusions += (lr_class == kLrOccluded) ? 1 : 0;
+			num_mismatches += (lr_class == kLrMismatched) ? 1 : 0;
+			classes[j >> 2] |= lr_class << (2 * (j & 3));
+		}
+		LrInvalidate(disp_left, width, classes);
+	}
+#else
+	void LrCheckRowAVX2(float* disp_left, const float* disp_right, const int32_t& width, const float& threshold,
+		uint8_t* classes, int32_t& num_occlusions, int32_t& num_mismatches)
+	{
+		LrCheckRow(disp_left, disp_right, width, threshold, classes, num_occlusions, num_mismatches);
+	}
+#endif
+
+	LrCheckRowFunc SelectLrCheckRow(bool use_simd)
+	{
+		return (use_simd && DetectIsa() == Isa::AVX2) ? LrCheckRowAVX2 : LrCheckRow;
+	}
+}
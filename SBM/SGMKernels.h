@@ -0,0 +1,353 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace sgm_kernels
+{
+	enum class Isa { Scalar, SSE41, AVX2 };
+
+	// Best instruction set supported by the running CPU (and OS), detected once.
+	Isa DetectIsa();
+
+	bool HasPopcnt();
+
+	inline uint8_t Hamming32(const uint32_t& x, const uint32_t& y)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		return static_cast<uint8_t>(__builtin_popcount(x ^ y));
+#else
+		uint32_t val = x ^ y;
+		val = val - ((val >> 1) & 0x55555555u);
+		val = (val & 0x33333333u) + ((val >> 2) & 0x33333333u);
+		return static_cast<uint8_t>((((val + (val >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24);
+#endif
+	}
+
+	inline uint8_t Hamming64(const uint64_t& x, const uint64_t& y)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		return static_cast<uint8_t>(__builtin_popcountll(x ^ y));
+#else
+		return static_cast<uint8_t>(Hamming32(static_cast<uint32_t>(x), static_cast<uint32_t>(y)) +
+			Hamming32(static_cast<uint32_t>(x >> 32), static_cast<uint32_t>(y >> 32)));
+#endif
+	}
+
+	inline uint8_t Hamming(const uint32_t& x, const uint32_t& y) { return Hamming32(x, y); }
+	inline uint8_t Hamming(const uint64_t& x, const uint64_t& y) { return Hamming64(x, y); }
+
+	// Census window of the matching cost. Every bit compares two pixels of the window and is 1 when the first is darker.
+	enum class CensusType {
+		Census5x5,			// 24 bits, each pixel of the 5x5 window against the centre
+		Census7x9,			// 62 bits (uint64_t), each pixel of a 7 rows by 9 columns window against the centre
+		CenterSymmetric7x9	// 31 bits, the pixel pairs of the 7x9 window mirrored about the centre
+	};
+
+	// Bits of the census, which is also the largest Hamming distance.
+	inline int32_t CensusBits(const CensusType& type)
+	{
+		return (type == CensusType::Census5x5) ? 24 : ((type == CensusType::Census7x9) ? 62 : 31);
+	}
+
+	// Matching cost C(p,d) of a pixel pair.
+	enum class MatchingCost {
+		Census,				// Hamming distance of the census
+		AdCensus,			// census and absolute intensity difference, each through 1 - exp(-c / lambda) (Mei et al.)
+		GradientCensus,		// census and the truncated difference of the horizontal Sobel gradients, both linear
+		MutualInformation	// hierarchical mutual information (Hirschmueller), a 256 x 256 table estimated per match (strip)
+	};
+
+	// Largest combined (census plus a second term) and MI cost, each term of a combined cost takes half.
+	// Packed6 stores them exactly.
+	const int32_t kCombinedCostMax = 62;
+
+	inline int32_t MaxMatchingCost(const MatchingCost& cost, const CensusType& census_type)
+	{
+		return (cost == MatchingCost::Census) ? CensusBits(census_type) : kCombinedCostMax;
+	}
+
+	// Per-pixel confidence in [0, 1] from the winner-take-all over the aggregated costs: the minimum c1, the
+	// smallest cost c2 at any other disparity, the neighbours c- and c+ of the minimum and the right-view
+	// minimum cr at the matched right pixel. Pixels without a disparity have confidence 0.
+	enum class ConfidenceMeasure {
+		None,
+		PeakRatio,				// (c2 - c1) / c2
+		Curvature,				// (c- + c+ - 2 c1) / (c- + c+), the curvature of the sub-pixel parabola
+		LeftRightDifference		// (c2 - c1) / (c2 - c1 + |c1 - cr| + 1) (Hu and Mordohai)
+	};
+
+	// How the matching costs C(p,d) and the per-direction path costs Lr(p,d) are stored.
+	enum class CostStorage {
+		Uint8,		// uint8_t costs and path costs, costs and penalties scaled down when C + P2 could reach UINT8_MAX
+		Uint16,		// uint16_t path costs, exact while num_paths * (UINT8_MAX + P2) fits into the uint16_t sums
+		Packed6		// costs bit-packed to 6 bits, four in three bytes, path costs as for Uint8
+	};
+
+	template <CostStorage S> struct StorageTraits;
+	template <> struct StorageTraits<CostStorage::Uint8> { typedef uint8_t PathCost; static const bool kIsPacked = false; };
+	template <> struct StorageTraits<CostStorage::Uint16> { typedef uint16_t PathCost; static const bool kIsPacked = false; };
+	template <> struct StorageTraits<CostStorage::Packed6> { typedef uint8_t PathCost; static const bool kIsPacked = true; };
+
+	// Bytes of the matching costs of one pixel.
+	inline size_t CostBytes(const CostStorage& storage, const int32_t& disp_range)
+	{
+		return (storage == CostStorage::Packed6) ? static_cast<size_t>(disp_range + 3) / 4 * 3 : static_cast<size_t>(disp_range);
+	}
+
+	inline size_t PathCostBytes(const CostStorage& storage)
+	{
+		return (storage == CostStorage::Uint16) ? sizeof(uint16_t) : sizeof(uint8_t);
+	}
+
+	// Largest cost Packed6 stores, larger ones (the UINT8_MAX of disparities outside the image) read back as UINT8_MAX.
+	const uint8_t kPackedCostMax = 62;
+
+	// Packed6 costs of one pixel, CostBytes() bytes at packed.
+	typedef void(*PackCostsFunc)(const uint8_t* cost, const int32_t& disp_range, uint8_t* packed);
+
+	void PackCosts(const uint8_t* cost, const int32_t& disp_range, uint8_t* packed);
+
+	void PackCostsSSE41(const uint8_t* cost, const int32_t& disp_range, uint8_t* packed);
+
+	PackCostsFunc SelectPackCosts(bool use_simd);
+
+	void UnpackCosts(const uint8_t* packed, const int32_t& disp_range, uint8_t* cost);
+
+	// One step along an aggregation path for all disparities:
+	// Lr(p,d) = C(p,d) + min( Lr(p-r,d), Lr(p-r,d-1) + P1, Lr(p-r,d+1) + P1, min(Lr(p-r))+P2 ) - min(Lr(p-r))
+	// cost_last_path holds Lr(p-r) with a maximum-value sentinel on each side (disp_range + 2 values),
+	// p2 is the already adapted penalty max(P1, P2_Init / (|dI| + 1)). Returns min(Lr(p)).
+	template <typename PathCost>
+	using AggregateStepFunc = PathCost(*)(const uint8_t* cost_init, const PathCost* cost_last_path, PathCost* cost_aggr,
+		const int32_t& disp_range, const int32_t& p1, const int32_t& p2, const PathCost& mincost_last_path);
+
+	// Scalar reference, the SSE4.1/AVX2 variants behind SelectAggregateStep() produce bit-identical results
+	// for non-negative penalties. Instantiated for uint8_t and uint16_t path costs.
+	template <typename PathCost>
+	PathCost AggregateStep(const uint8_t* cost_init, const PathCost* cost_last_path, PathCost* cost_aggr,
+		const int32_t& disp_range, const int32_t& p1, const int32_t& p2, const PathCost& mincost_last_path);
+
+	template <typename PathCost>
+	AggregateStepFunc<PathCost> SelectAggregateStep(bool use_simd);
+
+	// One step of a More-Global Matching pass (Facciolo et al.), which joins the paths arriving from two predecessors:
+	// Lr(p,d) = C(p,d) + (m_a(d) + m_b(d)) / 2, rounded down, with m_x(d) the min(...) - min(Lr(p-x)) term of
+	// AggregateStep for predecessor p-x and its own adapted penalty p2_x. Lr(p) stays below C(p,d) + P2 like a
+	// single path; unlike AggregateStep the sum saturates, so the costs of disparities outside the image stay at
+	// the maximum. Passing the same predecessor twice is a saturating single path step. Returns min(Lr(p)).
+	template <typename PathCost>
+	using AggregateStepMgmFunc = PathCost(*)(const uint8_t* cost_init, const PathCost* cost_last_a, const PathCost* cost_last_b,
+		PathCost* cost_aggr, const int32_t& disp_range, const int32_t& p1, const int32_t& p2_a, const int32_t& p2_b,
+		const PathCost& mincost_last_a, const PathCost& mincost_last_b);
+
+	template <typename PathCost>
+	PathCost AggregateStepMgm(const uint8_t* cost_init, const PathCost* cost_last_a, const PathCost* cost_last_b,
+		PathCost* cost_aggr, const int32_t& disp_range, const int32_t& p1, const int32_t& p2_a, const int32_t& p2_b,
+		const PathCost& mincost_last_a, const PathCost& mincost_last_b);
+
+	template <typename PathCost>
+	AggregateStepMgmFunc<PathCost> SelectAggregateStepMgm(bool use_simd);
+
+	// AggregateStep for the compact volumes of short search ranges and 8-bit path costs, without remapping Lr(p-r)
+	// first: p searches [begin, begin + size), p-r searched [begin - shift, begin - shift + last_size), and the
+	// disparities p-r did not search count as the maximum. Both sizes are at most kCompactStepLanes, and that many
+	// values are read from cost_init, cost_last and cost_aggr whatever the sizes; cost_aggr is written back
+	// unchanged past 'size', so no other thread may write there meanwhile. Returns min(Lr(p)).
+	const int32_t kCompactStepLanes = 16;
+
+	using CompactStepFunc = uint8_t(*)(const uint8_t* cost_init, const uint8_t* cost_last, const int32_t& shift,
+		const int32_t& last_size, uint8_t* cost_aggr, const int32_t& size, const int32_t& p1, const int32_t& p2,
+		const uint8_t& mincost_last_path);
+
+	uint8_t CompactStep(const uint8_t* cost_init, const uint8_t* cost_last, const int32_t& shift, const int32_t& last_size,
+		uint8_t* cost_aggr, const int32_t& size, const int32_t& p1, const int32_t& p2, const uint8_t& mincost_last_path);
+
+	CompactStepFunc SelectCompactStep(bool use_simd);
+
+	// One aggregation path, visiting (row + t * dr, (col + t * dc) mod width) for t < length.
+	template <typename PathCost>
+	struct PathWalk {
+		const uint8_t*	img;			// left image, P2 adapts to its gradient along the path
+		const uint8_t*	cost_init;		// C(p,d), CostBytes() per pixel
+		PathCost*		cost_aggr;		// receives Lr(p,d), may be nullptr
+		uint16_t*		cost_sum;		// Lr(p,d) is added to it, may be nullptr
+		int32_t			width;
+		int32_t			row, col;
+		int32_t			dr, dc;
+		int32_t			length;
+		int32_t			p1, p2_init;
+	};
+
+	// Aggregates a whole path for a disparity range fixed at compile time: the path costs live on the
+	// stack and the steps are fully unrolled, bit-identical to AggregateStep along the same path.
+	template <CostStorage S>
+	using AggregatePathFunc = void(*)(const PathWalk<typename StorageTraits<S>::PathCost>& walk);
+
+	// Kernel specialized for disp_range 64, 128, 192 or 256, nullptr for any other range.
+	template <CostStorage S>
+	AggregatePathFunc<S> SelectAggregatePath(const int32_t& disp_range, bool use_simd);
+
+	struct WtaResult {
+		uint16_t	min_cost;
+		uint16_t	sec_min_cost;	// smallest cost at any index other than best
+		int32_t		best;			// first index of min_cost
+		uint16_t	cost_prev;		// costs at best - 1 and best + 1, UINT16_MAX outside the range
+		uint16_t	cost_next;
+	};
+
+	// Winner-take-all over the aggregated costs of one pixel in a single pass.
+	typedef void(*WtaFunc)(const uint16_t* cost, const int32_t& disp_range, WtaResult& result);
+
+	void Wta(const uint16_t* cost, const int32_t& disp_range, WtaResult& result);
+
+	void WtaSSE41(const uint16_t* cost, const int32_t& disp_range, WtaResult& result);
+
+	void WtaAVX2(const uint16_t* cost, const int32_t& disp_range, WtaResult& result);
+
+	// Also specialized for disp_range 64, 128, 192 and 256.
+	WtaFunc SelectWta(const int32_t& disp_range, bool use_simd);
+
+	// Right-view WTA of one row of aggregated left costs, cost_right(j, k) = cost_row[(j + min_disparity + k) * disp_range + k]:
+	// per right pixel the minimum, its first k (UINT16_MAX when no candidate lies in the image) and the
+	// smallest cost at any other k. scratch holds 8 * width values.
+	typedef void(*WtaRightRowFunc)(const uint16_t* cost_row, const int32_t& width, const int32_t& disp_range, const int32_t& min_disparity,
+		uint16_t* scratch, uint16_t* right_min, uint16_t* right_sec_min, uint16_t* right_best);
+
+	void WtaRightRow(const uint16_t* cost_row, const int32_t& width, const int32_t& disp_range, const int32_t& min_disparity,
+		uint16_t* scratch, uint16_t* right_min, uint16_t* right_sec_min, uint16_t* right_best);
+
+	void WtaRightRowSSE41(const uint16_t* cost_row, const int32_t& width, const int32_t& disp_range, const int32_t& min_disparity,
+		uint16_t* scratch, uint16_t* right_min, uint16_t* right_sec_min, uint16_t* right_best);
+
+	WtaRightRowFunc SelectWtaRightRow(bool use_simd);
+
+	// Census of image row 'row' of a width x height image for every column. Window pixels outside the image are
+	// replaced by the nearest border pixel. Census is uint32_t for the types of up to 32 bits, uint64_t for all.
+	template <typename Census>
+	using CensusRowFunc = void(*)(const uint8_t* source, const int32_t& width, const int32_t& height, const int32_t& row,
+		const CensusType& type, Census* census_row);
+
+	// Scalar reference, instantiated for uint32_t and uint64_t.
+	template <typename Census>
+	void CensusRow(const uint8_t* source, const int32_t& width, const int32_t& height, const int32_t& row,
+		const CensusType& type, Census* census_row);
+
+	// The SSE4.1/AVX2 variants compare 16/32 pixels at a time, bit-identical to CensusRow().
+	template <typename Census>
+	CensusRowFunc<Census> SelectCensusRow(bool use_simd);
+
+	// Matching costs of one image row, cost_row[j * disp_range + d - min_disparity] = Hamming(census_left[j], census_right[j - d])
+	// and UINT8_MAX where j - d falls outside the image. census_right_rev is the right census row mirrored
+	// (census_right_rev[k] = census_right[width - 1 - k]) so the candidates of consecutive disparities are contiguous.
+	// Instantiated for 32-bit and 64-bit census.
+	template <typename Census>
+	using CensusCostRowFunc = void(*)(const Census* census_left, const Census* census_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, uint8_t* cost_row);
+
+	template <typename Census>
+	void CensusCostRow(const Census* census_left, const Census* census_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, uint8_t* cost_row);
+
+	template <typename Census>
+	void CensusCostRowPopcnt(const Census* census_left, const Census* census_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, uint8_t* cost_row);
+
+	template <typename Census>
+	void CensusCostRowAVX2(const Census* census_left, const Census* census_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, uint8_t* cost_row);
+
+	template <typename Census>
+	CensusCostRowFunc<Census> SelectCensusCostRow(bool use_simd);
+
+	// Hamming distances of census_left to 'count' consecutive candidates, cost[i] = Hamming(census_left, census_right[i]).
+	template <typename Census>
+	using HammingSegmentFunc = void(*)(const Census& census_left, const Census* census_right, uint8_t* cost, const int32_t& count);
+
+	// For the few candidates of a compact range, popcnt when the CPU has it.
+	template <typename Census>
+	HammingSegmentFunc<Census> SelectHammingSegment();
+
+	// Horizontal Sobel response of image row 'row', (gx + 1024) / 8 in [0, 255], window clamped at the image border.
+	void GradientRow(const uint8_t* source, const int32_t& width, const int32_t& height, const int32_t& row, uint8_t* gradient);
+
+	// Adds a second pixel-pair term to a row of census costs (as from CensusCostRow) through two 64-entry tables:
+	// cost = census_lut[cost] + term_lut[min(|term_left[j] - term_right[j - d]|, 63)]. The UINT8_MAX of disparities
+	// outside the image stays, term_right_rev is mirrored like census_right_rev.
+	typedef void(*CombineCostRowFunc)(uint8_t* cost_row, const uint8_t* term_left, const uint8_t* term_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, const uint8_t* census_lut, const uint8_t* term_lut);
+
+	void CombineCostRow(uint8_t* cost_row, const uint8_t* term_left, const uint8_t* term_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, const uint8_t* census_lut, const uint8_t* term_lut);
+
+	// Looks the tables up 32 disparities at a time with pshufb.
+	void CombineCostRowAVX2(uint8_t* cost_row, const uint8_t* term_left, const uint8_t* term_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, const uint8_t* census_lut, const uint8_t* term_lut);
+
+	CombineCostRowFunc SelectCombineCostRow(bool use_simd);
+
+	// Bytes of a cost table over two intensities, padded for the 32-bit gathers.
+	const size_t kCostTableSize = 256 * 256 + 4;
+
+	// Matching costs of one image row from a cost table, cost_row[j * disp_range + d - min_disparity] =
+	// table[img_left[j] * 256 + img_right[j - d]] and UINT8_MAX where j - d falls outside the image.
+	// img_right_rev is the right image row mirrored like census_right_rev.
+	typedef void(*TableCostRowFunc)(const uint8_t* img_left, const uint8_t* img_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, const uint8_t* table, uint8_t* cost_row);
+
+	void TableCostRow(const uint8_t* img_left, const uint8_t* img_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, const uint8_t* table, uint8_t* cost_row);
+
+	// Gathers eight table entries at a time.
+	void TableCostRowAVX2(const uint8_t* img_left, const uint8_t* img_right_rev, const int32_t& width,
+		const int32_t& min_disparity, const int32_t& max_disparity, const uint8_t* table, uint8_t* cost_row);
+
+	TableCostRowFunc SelectTableCostRow(bool use_simd);
+
+	// cost_sum[i] += cost[i]
+	void AccumulateCost(uint16_t* cost_sum, const uint8_t* cost, const int32_t& size);
+
+	void AccumulateCost(uint16_t* cost_sum, const uint16_t* cost, const int32_t& size);
+
+	// Median of the (2 * radius + 1)^2 windows (clipped at the image border, infinity sorting last) of rows
+	// [row_begin, row_end) for radius 1 or 2. Windows inside the image go through a sorting network eight
+	// pixels at a time. out must not alias in.
+	void MedianRowsNetwork(const float* in, float* out, const int32_t& width, const int32_t& height, const int32_t& radius,
+		const int32_t& row_begin, const int32_t& row_end);
+
+	// Disparities are quantized to 1 / kMedianSubpixel for the histogram median.
+	const int32_t kMedianSubpixel = 16;
+
+	// Bytes of scratch MedianTileHistogram() needs for tiles up to tile_width columns.
+	size_t MedianHistogramSize(const int32_t& tile_width, const int32_t& radius, const int32_t& disp_range);
+
+	// Constant-time median (Perreault and Hebert) of the tile [row_begin, row_end) x [col_begin, col_end) for any
+	// radius, with column histograms of the disparities in [min_disparity, max_disparity) quantized to
+	// 1 / kMedianSubpixel and infinity in a bin of its own. out must not alias in.
+	void MedianTileHistogram(const float* in, float* out, const int32_t& width, const int32_t& height, const int32_t& radius,
+		const int32_t& min_disparity, const int32_t& max_disparity, const int32_t& row_begin, const int32_t& row_end,
+		const int32_t& col_begin, const int32_t& col_end, uint8_t* scratch);
+
+	// Outcome of the LR check per pixel, 2 bits each and 4 pixels per byte from bit 0 on.
+	enum LrClass : uint8_t { kLrValid = 0, kLrOccluded = 1, kLrMismatched = 2 };
+
+	inline uint8_t LrClassAt(const uint8_t* classes, const int32_t& col)
+	{
+		return (classes[col >> 2] >> (2 * (col & 3))) & 3;
+	}
+
+	// LR check of one row: disp_left[j] (infinity when invalid) is consistent when its match j - disp_left[j]
+	// lies in the image and the right disparity there is within threshold. Otherwise it is occluded when the
+	// left disparity the right one points back to is larger, mismatched if not, and set to infinity. The
+	// classes of the (width + 3) / 4 bytes are always written, the counts of the failures are returned.
+	typedef void(*LrCheckRowFunc)(float* disp_left, const float* disp_right, const int32_t& width, const float& threshold,
+		uint8_t* classes, int32_t& num_occlusions, int32_t& num_mismatches);
+
+	void LrCheckRow(float* disp_left, const float* disp_right, const int32_t& width, const float& threshold,
+		uint8_t* classes, int32_t& num_occlusions, int32_t& num_mismatches);
+
+	// Gathers eight pixels at a time.
+	void LrCheckRowAVX2(float* disp_left, const float* disp_right, const int32_t& width, const float& threshold,
+		uint8_t* classes, int32_t& num_occlusions, int32_t& num_mismatches);
+
+	LrCheckRowFunc SelectLrCheckRow(bool use_simd);
+}
@@ -1,22 +1,159 @@
 #include "SemiGlobalMatching.h"
 #include <algorithm>
+#include <atomic>
 #include <vector>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include "ThreadPool.h"
 
 #ifndef SAFE_DELETE
 #define SAFE_DELETE(P) {if(P) delete[](P);(P)=nullptr;}
 #endif
 
-SemiGlobalMatching::SemiGlobalMatching() : width_(0), height_(0), img_left_(nullptr), img_right_(nullptr),
+// Aggregation directions as (row step, col step), in the order of cost_aggr_paths_: 4 and 8 paths take the
+// first ones, 16 paths add the knight moves.
+static const int32_t kPathDirections[16][2] = { {0, 1}, {0, -1}, {1, 0}, {-1, 0}, {1, 1}, {-1, -1}, {1, -1}, {-1, 1},
+	{1, 2}, {-1, -2}, {2, 1}, {-2, -1}, {1, -2}, {-1, 2}, {2, -1}, {-2, 1} };
+
+// Sweep of an MGM pass with predecessors a = (dr_a, dc_a) and b = a turned by 90 degrees. Both lie on the previous
+// line or earlier on the same line when the image is swept by rows, or by columns when they lie on both sides of
+// the row (a diagonal turned across it). line_step and pos_step give the sweep directions.
+struct MgmSweep {
+	bool	is_column;
+	int32_t	line_a, pos_a, line_b, pos_b;
+	int32_t	line_step, pos_step;
+
+	MgmSweep(const int32_t& dr_a, const int32_t& dc_a)
+	{
+		const int32_t dr_b = dc_a;
+		const int32_t dc_b = -dr_a;
+		is_column = dr_a * dr_b < 0;
+		line_a = is_column ? dc_a : dr_a;
+		pos_a = is_column ? dr_a : dc_a;
+		line_b = is_column ? dc_b : dr_b;
+		pos_b = is_column ? dr_b : dc_b;
+		line_step = (line_a != 0) ? line_a : line_b;
+		pos_step = (line_a == 0) ? pos_a : ((line_b == 0) ? pos_b : 1);
+	}
+};
+
+// Column tile of the histogram median.
+static const int32_t kMedianTileWidth = 64;
+
+// Mutual information: refinements of the table at the coarsest level and the floats of its estimation
+// (joint histogram, smoothing buffer and the two marginals).
+static const int32_t kMiIterations = 3;
+static const size_t kMiScratchSize = 2 * 256 * 256 + 2 * 256;
+
+// Gradient difference at which the gradient term of MatchingCost::GradientCensus saturates.
+static const int32_t kGradientTruncation = 16;
+
+// Gaussian smoothing (sigma 1) of rows x 256 histogram bins in place, 1D for a single row, borders clamped.
+static void SmoothHistogram(float* data, float* temp, const int32_t& rows)
+{
+	static const float kernel[7] = { 0.00443f, 0.05400f, 0.24204f, 0.39894f, 0.24204f, 0.05400f, 0.00443f };
+	for (int32_t r = 0; r < rows; r++) {
+		for (int32_t c = 0; c < 256; c++) {
+			float sum = 0;
+			for (int32_t k = -3; k <= 3; k++) {
+				sum += kernel[k + 3] * data[r * 256 + std::min(255, std::max(0, c + k))];
+			}
+			temp[r * 256 + c] = sum;
+		}
+	}
+	if (rows == 1) {
+		memcpy(data, temp, 256 * sizeof(float));
+		return;
+	}
+	for (int32_t r = 0; r < rows; r++) {
+		for (int32_t c = 0; c < 256; c++) {
+			float sum = 0;
+			for (int32_t k = -3; k <= 3; k++) {
+				sum += kernel[k + 3] * temp[std::min(rows - 1, std::max(0, r + k)) * 256 + c];
+			}
+			data[r * 256 + c] = sum;
+		}
+	}
+}
+
+// Nearest valid disparities of the rays one row further on: nearest[j] is the first valid value from
+// disp_row[j + dc] on, where nearest_row holds those of disp_row's own pixels.
+static void NearestFromRow(const float* disp_row, const float* nearest_row, float* nearest, const int32_t& width, const int32_t& dc)
+{
+	const int32_t begin = std::max(0, -dc);
+	const int32_t end = std::min(width, width - dc);
+	for (int32_t j = 0; j < begin; j++) {
+		nearest[j] = INVALID_FLOAT;
+	}
+	for (int32_t j = begin; j < end; j++) {
+		nearest[j] = (disp_row[j + dc] != INVALID_FLOAT) ? disp_row[j + dc] : nearest_row[j + dc];
+	}
+	for (int32_t j = end; j < width; j++) {
+		nearest[j] = INVALID_FLOAT;
+	}
+}
+
+// cost_sum[i] = sum of the num_dirs (4, 8 or 16) path volumes at i, for i in [begin, end).
+template <typename PathCost>
+static void SumPathCosts(PathCost* const* cost_paths, const int32_t& num_dirs, const size_t& begin, const size_t& end, uint16_t* cost_sum)
+{
+	for (size_t i = begin; i < end; i++) {
+		if (num_dirs >= 4) {
+			cost_sum[i] = cost_paths[0][i] + cost_paths[1][i] + cost_paths[2][i] + cost_paths[3][i];
+		}
+		if (num_dirs >= 8) {
+			cost_sum[i] += cost_paths[4][i] + cost_paths[5][i] + cost_paths[6][i] + cost_paths[7][i];
+		}
+		if (num_dirs == 16) {
+			cost_sum[i] += cost_paths[8][i] + cost_paths[9][i] + cost_paths[10][i] + cost_paths[11][i] +
+				cost_paths[12][i] + cost_paths[13][i] + cost_paths[14][i] + cost_paths[15][i];
+		}
+	}
+}
+
+// cost_remap[1 + k] = Lr(q, begin + k) for k in [-1, size] from the compact path costs cost_last of a pixel q with
+// the disparities [last_begin, last_begin + last_size). Disparities q did not search count as max_cost.
+template <typename PathCost>
+static void RemapPathCost(const PathCost* cost_last, const int32_t& last_begin, const int32_t& last_size, const int32_t& begin,
+	const int32_t& size, PathCost* cost_remap)
+{
+	std::fill(cost_remap, cost_remap + size + 2, std::numeric_limits<PathCost>::max());
+	const int32_t lo = std::max(begin - 1, last_begin);
+	const int32_t hi = std::min(begin + size + 1, last_begin + last_size);
+	if (lo < hi) {
+		memcpy(cost_remap + 1 + lo - begin, cost_last + lo - last_begin, (hi - lo) * sizeof(PathCost));
+	}
+}
+
+// Milliseconds since 'start', which is moved on to now.
+static double ElapsedMs(std::chrono::steady_clock::time_point& start)
+{
+	const auto now = std::chrono::steady_clock::now();
+	const double ms = std::chrono::duration<double, std::milli>(now - start).count();
+	start = now;
+	return ms;
+}
+
+SemiGlobalMatching::SemiGlobalMatching() : p1_(0), p2_init_(0), width_(0), height_(0), img_left_(nullptr), img_right_(nullptr),
 census_left_(nullptr), census_right_(nullptr),
-cost_init_(nullptr), cost_aggr_(nullptr),
-cost_aggr_1_(nullptr), cost_aggr_2_(nullptr),
-cost_aggr_3_(nullptr), cost_aggr_4_(nullptr),
-cost_aggr_5_(nullptr), cost_aggr_6_(nullptr),
-cost_aggr_7_(nullptr), cost_aggr_8_(nullptr),
+cost_init_(nullptr), cost_init_next_(nullptr), cost_capacity_(0), cost_rows_(nullptr), cost_terms_(nullptr), mi_cost_(nullptr), mi_scratch_(nullptr), cost_aggr_(nullptr),
 disp_left_(nullptr), disp_right_(nullptr),
-is_initialized_(false)
+is_initialized_(false), census_row_(nullptr), census_row64_(nullptr), cost_row_(nullptr), cost_row64_(nullptr), combine_cost_row_(nullptr), table_cost_row_(nullptr), pack_costs_(nullptr), wta_(nullptr), wta_right_(nullptr), lr_check_row_(nullptr),
+pool_(nullptr), owns_pool_(false), path_buffer_(nullptr), path_buffer_capacity_(0), num_path_chunks_(1), seam_(nullptr),
+img_capacity_(0), row_capacity_(0), disp_capacity_(0), volume_capacity_(0),
+is_pyramid_(false), coarse_(nullptr), img_coarse_left_(nullptr), img_coarse_right_(nullptr), disp_coarse_(nullptr), coarse_capacity_(0),
+right_ref_(nullptr), img_ref_left_(nullptr), img_ref_right_(nullptr), disp_ref_(nullptr), ref_capacity_(0),
+region_(nullptr), img_region_left_(nullptr), img_region_right_(nullptr), disp_region_(nullptr), region_capacity_(0),
+has_history_(false), motion_(nullptr), is_compact_match_(false),
+range_begin_(nullptr), range_offset_(nullptr), range_widened_(nullptr), compact_cost_init_(nullptr), compact_cost_aggr_(nullptr), compact_cost_paths_(nullptr), compact_capacity_(0),
+right_cost_(nullptr), right_best_(nullptr), confidence_(nullptr), wta_rows_(nullptr)
 {
+	std::fill(cost_aggr_paths_, cost_aggr_paths_ + kMaxPaths, nullptr);
 }
 
 
@@ -32,6 +169,18 @@ bool SemiGlobalMatching::Initialize(const int32_t& width, const int32_t& height,
 	width_ = width;
 	height_ = height;
 	option_ = option;
+	census_row_ = sgm_kernels::SelectCensusRow<uint32_t>(option.is_use_simd);
+	census_row64_ = sgm_kernels::SelectCensusRow<uint64_t>(option.is_use_simd);
+	cost_row_ = sgm_kernels::SelectCensusCostRow<uint32_t>(option.is_use_simd);
+	cost_row64_ = sgm_kernels::SelectCensusCostRow<uint64_t>(option.is_use_simd);
+	combine_cost_row_ = sgm_kernels::SelectCombineCostRow(option.is_use_simd);
+	table_cost_row_ = sgm_kernels::SelectTableCostRow(option.is_use_simd);
+	pack_costs_ = sgm_kernels::SelectPackCosts(option.is_use_simd);
+	wta_ = sgm_kernels::SelectWta(option.max_disparity - option.min_disparity, option.is_use_simd);
+	wta_right_ = sgm_kernels::SelectWtaRightRow(option.is_use_simd);
+	lr_check_row_ = sgm_kernels::SelectLrCheckRow(option.is_use_simd);
+	ScaleCosts();
+	BuildCostTables();
 
 	if (width == 0 || height == 0) {
 		return false;
@@ -39,31 +188,94 @@ bool SemiGlobalMatching::Initialize(const int32_t& width, const int32_t& height,
 
 
 	const int32_t img_size = width * height;
-	census_left_ = new uint32_t[img_size]();
-	census_right_ = new uint32_t[img_size]();
-
 
 	const int32_t disp_range = option.max_disparity - option.min_disparity;
-	if (disp_range <= 0) {
+	const int32_t num_dirs = NumDirections(option);
+	if (disp_range <= 0 || num_dirs == 0) {
 		return false;
 	}
 
-	const int32_t size = width * height * disp_range;
-	cost_init_ = new uint8_t[size]();
-	cost_aggr_ = new uint16_t[size]();
-	cost_aggr_1_ = new uint8_t[size]();
-	cost_aggr_2_ = new uint8_t[size]();
-	cost_aggr_3_ = new uint8_t[size]();
-	cost_aggr_4_ = new uint8_t[size]();
-	cost_aggr_5_ = new uint8_t[size]();
-	cost_aggr_6_ = new uint8_t[size]();
-	cost_aggr_7_ = new uint8_t[size]();
-	cost_aggr_8_ = new uint8_t[size]();
+	// The hierarchical mode keeps its costs in the compact per-pixel volumes instead.
+	is_pyramid_ = IsPyramid(width, height, option);
+	const size_t size = is_pyramid_ ? 0 : static_cast<size_t>(width) * height * disp_range;
+	const size_t path_cost_bytes = sgm_kernels::PathCostBytes(option.cost_storage);
+	if (!is_pyramid_) {
+		cost_capacity_ = static_cast<size_t>(width) * height * sgm_kernels::CostBytes(option.cost_storage, disp_range);
+		cost_init_ = new uint8_t[cost_capacity_]();
+		cost_aggr_ = new uint16_t[size]();
+	}
+	if (!option.is_low_memory && !is_pyramid_) {
+		for (int32_t k = 0; k < num_dirs; k++) {
+			cost_aggr_paths_[k] = new uint8_t[size * path_cost_bytes]();
+		}
+	}
 
 	disp_left_ = new float[img_size]();
 	disp_right_ = new float[img_size]();
 
-	is_initialized_ = census_left_ && census_right_ && cost_init_ && cost_aggr_ && disp_left_;
+	// Pyramid levels share the pool of the finest level.
+	if (pool_ == nullptr) {
+		pool_ = new ThreadPool(option.num_threads);
+		owns_pool_ = true;
+	}
+	num_path_chunks_ = (pool_->Size() > 1) ? pool_->Size() * 2 : 1;
+	path_buffer_capacity_ = PathTaskCount(width, height, option, num_path_chunks_) * PathBufferSize(width, height, disp_range, option);
+	path_buffer_ = new uint8_t[path_buffer_capacity_]();
+	if (!is_pyramid_ && option.cost_storage == sgm_kernels::CostStorage::Packed6) {
+		cost_rows_ = new uint8_t[static_cast<size_t>(num_path_chunks_) * width * disp_range]();
+	}
+	census_left_ = new uint64_t[num_path_chunks_ * width]();
+	census_right_ = new uint64_t[num_path_chunks_ * width]();
+	right_cost_ = new uint16_t[num_path_chunks_ * 11 * width]();
+	cost_terms_ = new uint8_t[num_path_chunks_ * 2 * width]();
+	if (option.confidence != sgm_kernels::ConfidenceMeasure::None) {
+		confidence_ = new float[img_size]();
+		wta_rows_ = new uint16_t[num_path_chunks_ * 5 * width]();
+	}
+	if (option.matching_cost == sgm_kernels::MatchingCost::MutualInformation) {
+		mi_cost_ = new uint8_t[sgm_kernels::kCostTableSize]();
+		mi_scratch_ = new float[kMiScratchSize]();
+	}
+
+	bool is_coarse_ok = true;
+	if (is_pyramid_ || IsTemporal(option)) {
+		range_begin_ = new int32_t[img_size]();
+		range_offset_ = new size_t[img_size + 1]();
+		right_best_ = new int32_t[num_path_chunks_ * width]();
+	}
+	if (IsTemporal(option)) {
+		range_widened_ = new uint8_t[img_size]();
+	}
+	if (is_pyramid_ || HasMiGuide(width, height, option)) {
+		coarse_capacity_ = static_cast<size_t>(width / 2) * (height / 2);
+		img_coarse_left_ = new uint8_t[coarse_capacity_]();
+		img_coarse_right_ = new uint8_t[coarse_capacity_]();
+		disp_coarse_ = new float[coarse_capacity_]();
+
+		coarse_ = new SemiGlobalMatching();
+		coarse_->pool_ = pool_;
+		is_coarse_ok = coarse_->Initialize(width / 2, height / 2, is_pyramid_ ? CoarseOption(option) : MiGuideOption(option));
+	}
+	if (IsDecimatedLr(width, height, option)) {
+		ref_capacity_ = static_cast<size_t>(width / 2) * (height / 2);
+		img_ref_left_ = new uint8_t[ref_capacity_]();
+		img_ref_right_ = new uint8_t[ref_capacity_]();
+		disp_ref_ = new float[ref_capacity_]();
+
+		right_ref_ = new SemiGlobalMatching();
+		right_ref_->pool_ = pool_;
+		is_coarse_ok = right_ref_->Initialize(width / 2, height / 2, RightReferenceOption(option)) && is_coarse_ok;
+	}
+
+	img_capacity_ = img_size;
+	row_capacity_ = width;
+	disp_capacity_ = disp_range;
+	volume_capacity_ = size;
+	has_history_ = false;
+	is_compact_match_ = is_pyramid_;
+
+	is_initialized_ = census_left_ && census_right_ && (cost_init_ || is_pyramid_) && (cost_aggr_ || is_pyramid_) && disp_left_ && is_coarse_ok;
+	UpdateMemoryStats();
 
 	return is_initialized_;
 }
@@ -73,17 +285,53 @@ void SemiGlobalMatching::Release()
 	SAFE_DELETE(census_left_);
 	SAFE_DELETE(census_right_);
 	SAFE_DELETE(cost_init_);
+	SAFE_DELETE(cost_init_next_);
+	SAFE_DELETE(cost_rows_);
+	SAFE_DELETE(cost_terms_);
+	SAFE_DELETE(mi_cost_);
+	SAFE_DELETE(mi_scratch_);
 	SAFE_DELETE(cost_aggr_);
-	SAFE_DELETE(cost_aggr_1_);
-	SAFE_DELETE(cost_aggr_2_);
-	SAFE_DELETE(cost_aggr_3_);
-	SAFE_DELETE(cost_aggr_4_);
-	SAFE_DELETE(cost_aggr_5_);
-	SAFE_DELETE(cost_aggr_6_);
-	SAFE_DELETE(cost_aggr_7_);
-	SAFE_DELETE(cost_aggr_8_);
+	for (int32_t k = 0; k < kMaxPaths; k++) {
+		SAFE_DELETE(cost_aggr_paths_[k]);
+	}
 	SAFE_DELETE(disp_left_);
 	SAFE_DELETE(disp_right_);
+	SAFE_DELETE(path_buffer_);
+	path_buffer_capacity_ = 0;
+	delete coarse_;
+	coarse_ = nullptr;
+	SAFE_DELETE(img_coarse_left_);
+	SAFE_DELETE(img_coarse_right_);
+	SAFE_DELETE(disp_coarse_);
+	coarse_capacity_ = 0;
+	delete right_ref_;
+	right_ref_ = nullptr;
+	SAFE_DELETE(img_ref_left_);
+	SAFE_DELETE(img_ref_right_);
+	SAFE_DELETE(disp_ref_);
+	ref_capacity_ = 0;
+	delete region_;
+	region_ = nullptr;
+	SAFE_DELETE(img_region_left_);
+	SAFE_DELETE(img_region_right_);
+	SAFE_DELETE(disp_region_);
+	region_capacity_ = 0;
+	SAFE_DELETE(range_begin_);
+	SAFE_DELETE(range_offset_);
+	SAFE_DELETE(range_widened_);
+	SAFE_DELETE(compact_cost_init_);
+	SAFE_DELETE(compact_cost_aggr_);
+	SAFE_DELETE(compact_cost_paths_);
+	compact_capacity_ = 0;
+	SAFE_DELETE(right_cost_);
+	SAFE_DELETE(right_best_);
+	SAFE_DELETE(confidence_);
+	SAFE_DELETE(wta_rows_);
+	if (owns_pool_) {
+		delete pool_;
+	}
+	pool_ = nullptr;
+	owns_pool_ = false;
 }
 
 bool SemiGlobalMatching::Match(const uint8_t* img_left, const uint8_t* img_right, float* disp_left)
@@ -97,423 +345,980 @@ bool SemiGlobalMatching::Match(const uint8_t* img_left, const uint8_t* img_right
 
 	img_left_ = img_left;
 	img_right_ = img_right;
+	if (!MatchFrame()) {
+		return false;
+	}
+	memcpy(disp_left, disp_left_, height_ * width_ * sizeof(float));
+	return true;
+}
+
+bool SemiGlobalMatching::MatchFrame()
+{
+	const auto start = std::chrono::steady_clock::now();
+	// Strips have no previous frame of their own.
+	const bool is_warm = IsTemporal(option_) && has_history_ && seam_ == nullptr;
+	const float* motion = motion_;
+	motion_ = nullptr;
+	has_history_ = false;
+	stats_.num_full_range = 0;
+
+	is_compact_match_ = is_warm && MatchTemporal(motion);
+	if (!is_compact_match_ && is_pyramid_) {
+		if (!MatchPyramid()) {
+			return false;
+		}
+		is_compact_match_ = true;
+	}
+	else if (!is_compact_match_) {
+		auto stage = start;
+		ComputeCost(img_left_, img_right_, cost_init_);
+		stats_.cost_ms = ElapsedMs(stage);
+		stats_.pyramid_ms = 0;
+		MatchCost();
+	}
 
+	if (IsTemporal(option_)) {
+		const size_t img_size = static_cast<size_t>(width_) * height_;
+		if (is_compact_match_) {
+			const size_t disp_range = option_.max_disparity - option_.min_disparity;
+			int32_t count = 0;
+			for (size_t pixel = 0; pixel < img_size; pixel++) {
+				count += (range_offset_[pixel + 1] - range_offset_[pixel] == disp_range) ? 1 : 0;
+			}
+			stats_.num_full_range = count;
+		}
+		else {
+			stats_.num_full_range = static_cast<int32_t>(img_size);
+		}
+		has_history_ = seam_ == nullptr;
+	}
+	stats_.total_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	UpdateMemoryStats();
+	return true;
+}
+
+bool SemiGlobalMatching::Match(const uint8_t* img_left, const uint8_t* img_right, float* disp_left, float* confidence)
+{
+	if (confidence == nullptr || option_.confidence == sgm_kernels::ConfidenceMeasure::None) {
+		return false;
+	}
+	if (!Match(img_left, img_right, disp_left)) {
+		return false;
+	}
+	memcpy(confidence, confidence_, height_ * width_ * sizeof(float));
+	return true;
+}
+
+bool SemiGlobalMatching::MatchStream(const FrameSource& source, const FrameSink& sink)
+{
+	if (!is_initialized_) {
+		return false;
+	}
+
+	StereoFrame frame;
+	if (is_pyramid_ || option_.matching_cost == sgm_kernels::MatchingCost::MutualInformation || IsTemporal(option_)) {
+		// The pyramid levels and the MI estimation run one after another, and a temporal frame needs the result
+		// of the one before: frames are matched in turn.
+		for (int64_t index = 0; source(frame); index++) {
+			if (frame.img_left == nullptr || frame.img_right == nullptr) {
+				return false;
+			}
+			img_left_ = frame.img_left;
+			img_right_ = frame.img_right;
+			motion_ = frame.motion;
+			if (!MatchFrame()) {
+				return false;
+			}
+			sink(index, disp_left_);
+		}
+		return true;
+	}
+
+	if (!source(frame)) {
+		return true;
+	}
+	if (frame.img_left == nullptr || frame.img_right == nullptr) {
+		return false;
+	}
+
+	// Second cost volume, so that census/cost of frame N+1 is built while frame N aggregates.
+	// It is kept across streams like every other buffer.
+	if (cost_init_next_ == nullptr) {
+		cost_init_next_ = new uint8_t[cost_capacity_]();
+	}
+	auto stage = std::chrono::steady_clock::now();
+	ComputeCost(frame.img_left, frame.img_right, cost_init_);
+	double cost_ms = ElapsedMs(stage);
+	double cost_next_ms = 0;
+
+	std::mutex mutex;
+	std::condition_variable cond;
+	StereoFrame next_frame;
+	bool has_job = false;
+	bool stop = false;
+	std::thread producer([&]() {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			cond.wait(lock, [&]() { return has_job || stop; });
+			if (!has_job) {
+				return;
+			}
+			lock.unlock();
+			auto start = std::chrono::steady_clock::now();
+			ComputeCost(next_frame.img_left, next_frame.img_right, cost_init_next_);
+			const double ms = ElapsedMs(start);
+			lock.lock();
+			cost_next_ms = ms;
+			has_job = false;
+			cond.notify_all();
+		}
+	});
+
+	bool is_ok = true;
+	for (int64_t index = 0; ; index++) {
+		StereoFrame upcoming;
+		const bool has_next = source(upcoming);
+		if (has_next && (upcoming.img_left == nullptr || upcoming.img_right == nullptr)) {
+			is_ok = false;
+		}
+		if (has_next && is_ok) {
+			std::lock_guard<std::mutex> lock(mutex);
+			next_frame = upcoming;
+			has_job = true;
+			cond.notify_all();
+		}
+
+		img_left_ = frame.img_left;
+		img_right_ = frame.img_right;
+		// The cost volume was built while the previous frame aggregated, its time is not part of the frame's wall time.
+		auto start = std::chrono::steady_clock::now();
+		MatchCost();
+		stats_.cost_ms = cost_ms;
+		stats_.pyramid_ms = 0;
+		stats_.total_ms = cost_ms + ElapsedMs(start);
+		UpdateMemoryStats();
+		sink(index, disp_left_);
+
+		if (!has_next || !is_ok) {
+			break;
+		}
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			cond.wait(lock, [&]() { return !has_job; });
+			cost_ms = cost_next_ms;
+		}
+		std::swap(cost_init_, cost_init_next_);
+		frame = upcoming;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stop = true;
+		cond.notify_all();
+	}
+	producer.join();
+	return is_ok;
+}
 
-	CensusTransform();
-	ComputeCost();
+void SemiGlobalMatching::MatchCost()
+{
+	auto start = std::chrono::steady_clock::now();
 	CostAggregation();
+	stats_.aggregation_ms = ElapsedMs(start);
 	ComputeDisparity();
+	stats_.wta_ms = ElapsedMs(start);
+
+	PostProcessing();
+}
 
+void SemiGlobalMatching::PostProcessing()
+{
+	auto start = std::chrono::steady_clock::now();
+	stats_.lr_check_ms = stats_.speckle_ms = stats_.fill_ms = 0;
+	stats_.num_occlusions = stats_.num_mismatches = 0;
 
 	if (option_.is_check_lr) {
-		ComputeDisparityRight();
+		if (right_ref_ != nullptr) {
+			MatchRightReference();
+		}
 		LRCheck();
+		stats_.lr_check_ms = ElapsedMs(start);
 	}
 
 	if (option_.is_remove_speckles) {
 		RemoveSpeckles(disp_left_, width_, height_, 2.0f, option_.min_speckle_aera, INVALID_FLOAT);
+		stats_.speckle_ms = ElapsedMs(start);
+	}
+
+	if (option_.confidence != sgm_kernels::ConfidenceMeasure::None) {
+		// Pixels without a disparity have no confidence, also when the hole filling gives them one.
+		const size_t img_size = static_cast<size_t>(width_) * height_;
+		for (size_t k = 0; k < img_size; k++) {
+			if (disp_left_[k] == INVALID_FLOAT) {
+				confidence_[k] = 0.0f;
+			}
+		}
 	}
 
 	if (option_.is_fill_holes) {
 		FillHolesInDispMap();
+		stats_.fill_ms = ElapsedMs(start);
 	}
 
-	MedianFilter(disp_left_, disp_left_, width_, height_, 3);
-	memcpy(disp_left, disp_left_, height_ * width_ * sizeof(float));
+	if (option_.median_window >= 3) {
+		// disp_right_ is free after the LR check.
+		MedianFilter(disp_left_, disp_right_, width_, height_, option_.median_window);
+		std::swap(disp_left_, disp_right_);
+	}
+	stats_.median_ms = ElapsedMs(start);
+}
 
-	return true;
+void SemiGlobalMatching::UpdateMemoryStats()
+{
+	const size_t volume = volume_capacity_;
+	const size_t compact = compact_capacity_;
+	const size_t chunks = num_path_chunks_;
+	const size_t row = row_capacity_;
+	const size_t path_cost_bytes = sgm_kernels::PathCostBytes(option_.cost_storage);
+
+	stats_.cost_init_bytes = (cost_init_ ? cost_capacity_ : 0) + (cost_init_next_ ? cost_capacity_ : 0) + compact;
+	stats_.cost_aggr_bytes = (cost_aggr_ ? volume * sizeof(uint16_t) : 0) + compact * sizeof(uint16_t);
+	const int32_t num_dirs = NumDirections(option_);
+	size_t num_volumes = 0;
+	for (int32_t k = 0; k < kMaxPaths; k++) {
+		num_volumes += (cost_aggr_paths_[k] != nullptr) ? 1 : 0;
+	}
+	stats_.path_bytes = (num_volumes * volume + num_dirs * compact) * path_cost_bytes + path_buffer_capacity_;
+
+	size_t bytes = 2 * img_capacity_ * sizeof(float) + 2 * chunks * row * sizeof(uint64_t) + 11 * chunks * row * sizeof(uint16_t);
+	bytes += 2 * chunks * row;
+	if (confidence_ != nullptr) {
+		bytes += img_capacity_ * sizeof(float) + 5 * chunks * row * sizeof(uint16_t);
+	}
+	if (mi_cost_ != nullptr) {
+		bytes += sgm_kernels::kCostTableSize + kMiScratchSize * sizeof(float);
+	}
+	if (range_begin_ != nullptr) {
+		bytes += img_capacity_ * (sizeof(int32_t) + sizeof(size_t)) + sizeof(size_t) + chunks * row * sizeof(int32_t);
+	}
+	if (range_widened_ != nullptr) {
+		bytes += img_capacity_;
+	}
+	bytes += coarse_capacity_ * (2 * sizeof(uint8_t) + sizeof(float));
+	if (cost_rows_ != nullptr) {
+		bytes += chunks * row * disp_capacity_;
+	}
+	bytes += lr_classes_.capacity();
+	bytes += median_scratch_.capacity() + speckle_labels_.capacity() * sizeof(int32_t) + fill_nearest_.capacity() * sizeof(float);
+	stats_.buffer_bytes = bytes;
+
+	stats_.total_bytes = stats_.cost_init_bytes + stats_.cost_aggr_bytes + stats_.path_bytes + stats_.buffer_bytes;
+	if (coarse_ != nullptr) {
+		stats_.total_bytes += coarse_->stats_.total_bytes;
+	}
+	if (right_ref_ != nullptr) {
+		stats_.buffer_bytes += ref_capacity_ * (2 * sizeof(uint8_t) + sizeof(float));
+		stats_.total_bytes += ref_capacity_ * (2 * sizeof(uint8_t) + sizeof(float)) + right_ref_->stats_.total_bytes;
+	}
+	if (region_ != nullptr) {
+		stats_.buffer_bytes += region_capacity_ * (2 * sizeof(uint8_t) + sizeof(float)) + point_order_.capacity() * sizeof(int32_t);
+		stats_.total_bytes += region_capacity_ * (2 * sizeof(uint8_t) + sizeof(float)) + point_order_.capacity() * sizeof(int32_t) +
+			region_->stats_.total_bytes;
+	}
 }
 
 bool SemiGlobalMatching::Reset(const uint32_t& width, const uint32_t& height, const SGMOption& option)
 {
+	// Keep every buffer when the new size fits into what is allocated, so a stream that changes
+	// resolution (or disparity range) does not free and reallocate the volumes.
+	const int32_t disp_range = option.max_disparity - option.min_disparity;
+	if (is_initialized_ && width > 0 && height > 0 && disp_range > 0 && !is_pyramid_ && !IsPyramid(width, height, option) &&
+		option.num_threads == option_.num_threads && option.num_paths == option_.num_paths && option.is_mgm == option_.is_mgm &&
+		(option.is_low_memory || cost_aggr_paths_[0] != nullptr) && option.cost_storage == option_.cost_storage &&
+		PathTaskCount(width, height, option, num_path_chunks_) * PathBufferSize(width, height, disp_range, option) <= path_buffer_capacity_ &&
+		static_cast<size_t>(width) * height <= img_capacity_ && static_cast<int32_t>(width) <= row_capacity_ && disp_range <= disp_capacity_ &&
+		static_cast<size_t>(width) * height * disp_range <= volume_capacity_ &&
+		static_cast<size_t>(width) * height * sgm_kernels::CostBytes(option.cost_storage, disp_range) <= cost_capacity_ &&
+		IsDecimatedLr(width, height, option) == (right_ref_ != nullptr) &&
+		(right_ref_ == nullptr || static_cast<size_t>(width / 2) * (height / 2) <= ref_capacity_) &&
+		HasMiGuide(width, height, option) == (coarse_ != nullptr) &&
+		(coarse_ == nullptr || static_cast<size_t>(width / 2) * (height / 2) <= coarse_capacity_) &&
+		(option.matching_cost != sgm_kernels::MatchingCost::MutualInformation || mi_cost_ != nullptr) &&
+		(option.confidence == sgm_kernels::ConfidenceMeasure::None || confidence_ != nullptr) &&
+		(!IsTemporal(option) || range_widened_ != nullptr)) {
+		if (right_ref_ != nullptr && !right_ref_->Reset(width / 2, height / 2, RightReferenceOption(option))) {
+			return false;
+		}
+		if (coarse_ != nullptr && !coarse_->Reset(width / 2, height / 2, MiGuideOption(option))) {
+			return false;
+		}
+		if (region_ != nullptr && !region_->Reset(region_->width_, region_->height_, RegionOption(option))) {
+			return false;
+		}
+		width_ = width;
+		height_ = height;
+		option_ = option;
+		has_history_ = false;
+		census_row_ = sgm_kernels::SelectCensusRow<uint32_t>(option.is_use_simd);
+		census_row64_ = sgm_kernels::SelectCensusRow<uint64_t>(option.is_use_simd);
+		cost_row_ = sgm_kernels::SelectCensusCostRow<uint32_t>(option.is_use_simd);
+		cost_row64_ = sgm_kernels::SelectCensusCostRow<uint64_t>(option.is_use_simd);
+		combine_cost_row_ = sgm_kernels::SelectCombineCostRow(option.is_use_simd);
+		table_cost_row_ = sgm_kernels::SelectTableCostRow(option.is_use_simd);
+		pack_costs_ = sgm_kernels::SelectPackCosts(option.is_use_simd);
+		wta_ = sgm_kernels::SelectWta(disp_range, option.is_use_simd);
+		wta_right_ = sgm_kernels::SelectWtaRightRow(option.is_use_simd);
+		lr_check_row_ = sgm_kernels::SelectLrCheckRow(option.is_use_simd);
+		ScaleCosts();
+		BuildCostTables();
+		return true;
+	}
 
+	// A level that shares the pool of its parent keeps it.
+	ThreadPool* shared_pool = owns_pool_ ? nullptr : pool_;
 	Release();
+	pool_ = shared_pool;
 	is_initialized_ = false;
 	return Initialize(width, height, option);
 }
 
-void SemiGlobalMatching::census_transform_5x5(const uint8_t* source, uint32_t* census, const int32_t& width,
-	const int32_t& height)
+bool SemiGlobalMatching::CostSlice(const int32_t& row, const int32_t& rows, uint16_t* costs) const
 {
-	if (source == nullptr || census == nullptr || width <= 5u || height <= 5u) {
-		return;
+	if (!is_initialized_ || costs == nullptr || row < 0 || rows <= 0 || row + rows > height_) {
+		return false;
 	}
 
+	const int32_t disp_range = option_.max_disparity - option_.min_disparity;
+	const size_t row_size = static_cast<size_t>(width_) * disp_range;
+	if (!is_compact_match_) {
+		memcpy(costs, cost_aggr_ + row * row_size, rows * row_size * sizeof(uint16_t));
+		return true;
+	}
 
-	for (int32_t i = 2; i < height - 2; i++) {
-		for (int32_t j = 2; j < width - 2; j++) {
-			const uint8_t gray_center = source[i * width + j];
-			uint32_t census_val = 0u;
-			for (int32_t r = -2; r <= 2; r++) {
-				for (int32_t c = -2; c <= 2; c++) {
-					census_val <<= 1;
-					const uint8_t gray = source[(i + r) * width + j + c];
-					if (gray < gray_center) {
-						census_val += 1;
-					}
-				}
-			}
-
-			census[i * width + j] = census_val;
-		}
+	std::fill(costs, costs + rows * row_size, UINT16_MAX);
+	const size_t first = static_cast<size_t>(row) * width_;
+	for (size_t pixel = first; pixel < first + static_cast<size_t>(rows) * width_; pixel++) {
+		const size_t size = range_offset_[pixel + 1] - range_offset_[pixel];
+		memcpy(costs + (pixel - first) * disp_range + (range_begin_[pixel] - option_.min_disparity),
+			compact_cost_aggr_ + range_offset_[pixel], size * sizeof(uint16_t));
 	}
+	return true;
 }
 
-void SemiGlobalMatching::CensusTransform()
+int32_t SemiGlobalMatching::NumDirections(const SGMOption& option)
 {
-	census_transform_5x5(img_left_, census_left_, width_, height_);
-	census_transform_5x5(img_right_, census_right_, width_, height_);
+	if (option.is_mgm) {
+		return (option.num_paths == 4 || option.num_paths == 8) ? option.num_paths : 0;
+	}
+	return (option.num_paths == 4 || option.num_paths == 8 || option.num_paths == 16) ? option.num_paths : 0;
 }
 
-void SemiGlobalMatching::ComputeCost()
+int32_t SemiGlobalMatching::SeamPathCount(const SGMOption& option)
 {
-	const int32_t& min_disparity = option_.min_disparity;
-	const int32_t& max_disparity = option_.max_disparity;
-	const int32_t disp_range = max_disparity - min_disparity;
-	if (disp_range <= 0) {
-		return;
+	if (option.is_mgm) {
+		return 0;
 	}
+	const int32_t num_dirs = NumDirections(option);
+	return SeamSlot(num_dirs, 0, 0);
+}
 
-
-	for (int32_t i = 0; i < height_; i++) {
-		for (int32_t j = 0; j < width_; j++) {
-
-			const uint32_t census_val_l = census_left_[i * width_ + j];
-
-			for (int32_t d = min_disparity; d < max_disparity; d++) {
-				auto& cost = cost_init_[i * width_ * disp_range + j * disp_range + (d - min_disparity)];
-				if (j - d < 0 || j - d >= width_) {
-					cost = UINT8_MAX;
-					continue;
-				}
-				const uint32_t census_val_r = census_right_[i * width_ + j - d];
-
-				cost = Hamming32(census_val_l, census_val_r);
-			}
+int32_t SemiGlobalMatching::SeamSlot(const int32_t& num_dirs, const int32_t& dr, const int32_t& dc)
+{
+	// Directions of the side of dr (downward for dr == 0) in kPathDirections order, |dr| rows each. (0, 0) counts them all.
+	int32_t slot = 0;
+	for (int32_t k = 0; k < num_dirs; k++) {
+		if (kPathDirections[k][0] == dr && kPathDirections[k][1] == dc) {
+			break;
+		}
+		if (kPathDirections[k][0] * ((dr < 0) ? -1 : 1) > 0) {
+			slot += abs(kPathDirections[k][0]);
 		}
 	}
+	return slot;
 }
 
-void SemiGlobalMatching::CostAggregateLeftRight(const uint8_t* img_data, const int32_t& width, const int32_t& height, const int32_t& min_disparity, const int32_t& max_disparity,
-	const int32_t& p1, const int32_t& p2_init, const uint8_t* cost_init, uint8_t* cost_aggr, bool is_forward) {
-
-	const int32_t disp_range = max_disparity - min_disparity;
-
-	const auto& P1 = p1;
-	const auto& P2_Init = p2_init;
-
-	const int32_t direction = is_forward ? 1 : -1;
-
-	for (int32_t i = 0u; i < height; i++) {
-
-		auto cost_init_row = (is_forward) ? (cost_init + i * width * disp_range) : (cost_init + i * width * disp_range + (width - 1) * disp_range);
-		auto cost_aggr_row = (is_forward) ? (cost_aggr + i * width * disp_range) : (cost_aggr + i * width * disp_range + (width - 1) * disp_range);
-		auto img_row = (is_forward) ? (img_data + i * width) : (img_data + i * width + width - 1);
-
-
-		uint8_t gray = *img_row;
-		uint8_t gray_last = *img_row;
-
-		std::vector<uint8_t> cost_last_path(disp_range + 2, UINT8_MAX);
+bool SemiGlobalMatching::MatchStrip(const uint8_t* img_left, const uint8_t* img_right, float* disp_left, const PathSeam& seam)
+{
+	if (is_pyramid_) {
+		return false;
+	}
+	seam_ = &seam;
+	const bool is_ok = Match(img_left, img_right, disp_left);
+	seam_ = nullptr;
+	return is_ok;
+}
 
-		memcpy(cost_aggr_row, cost_init_row, disp_range * sizeof(uint8_t));
-		memcpy(&cost_last_path[1], cost_aggr_row, disp_range * sizeof(uint8_t));
-		cost_init_row += direction * disp_range;
-		cost_aggr_row += direction * disp_range;
-		img_row += direction;
+bool SemiGlobalMatching::AggregateUpward(const uint8_t* img_left, const uint8_t* img_right, const PathSeam& seam)
+{
+	if (!is_initialized_ || is_pyramid_ || option_.is_mgm) {
+		return false;
+	}
+	if (img_left == nullptr || img_right == nullptr) {
+		return false;
+	}
 
-		uint8_t mincost_last_path = UINT8_MAX;
-		for (auto cost : cost_last_path) {
-			mincost_last_path = std::min(mincost_last_path, cost);
+	img_left_ = img_left;
+	img_right_ = img_right;
+	seam_ = &seam;
+	ComputeCost(img_left_, img_right_, cost_init_);
+
+	const int32_t disp_range = option_.max_disparity - option_.min_disparity;
+	const int32_t num_dirs = NumDirections(option_);
+	const int32_t num_chunks = num_path_chunks_;
+	const size_t buffer_size = PathBufferSize(width_, height_, disp_range, option_);
+	for (int32_t k = 0; k < num_dirs; k++) {
+		const int32_t& dr = kPathDirections[k][0];
+		const int32_t& dc = kPathDirections[k][1];
+		if (dr >= 0) {
+			continue;
 		}
+		const int32_t count = PathCount(width_, height_, dr);
+		pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+			AggregatePaths(dr, dc, nullptr, nullptr, count * chunk / num_chunks, count * (chunk + 1) / num_chunks,
+				path_buffer_ + (k * num_chunks + chunk) * buffer_size);
+		});
+	}
+	seam_ = nullptr;
+	return true;
+}
 
-		for (int32_t j = 0; j < width - 1; j++) {
-			gray = *img_row;
-			uint8_t min_cost = UINT8_MAX;
-			for (int32_t d = 0; d < disp_range; d++) {
-				// Lr(p,d) = C(p,d) + min( Lr(p-r,d), Lr(p-r,d-1) + P1, Lr(p-r,d+1) + P1, min(Lr(p-r))+P2 ) - min(Lr(p-r))
-				const uint8_t  cost = cost_init_row[d];
-				const uint16_t l1 = cost_last_path[d + 1];
-				const uint16_t l2 = cost_last_path[d] + P1;
-				const uint16_t l3 = cost_last_path[d + 2] + P1;
-				const uint16_t l4 = mincost_last_path + std::max(P1, P2_Init / (abs(gray - gray_last) + 1));
-
-				const uint8_t cost_s = cost + static_cast<uint8_t>(std::min(std::min(l1, l2), std::min(l3, l4)) - mincost_last_path);
-
-				cost_aggr_row[d] = cost_s;
-				min_cost = std::min(min_cost, cost_s);
-			}
+size_t SemiGlobalMatching::RequiredMemory(const int32_t& width, const int32_t& height, const SGMOption& option)
+{
+	const int32_t disp_range = option.max_disparity - option.min_disparity;
+	const int32_t num_dirs = NumDirections(option);
+	if (width <= 0 || height <= 0 || disp_range <= 0 || num_dirs == 0) {
+		return 0;
+	}
 
-			mincost_last_path = min_cost;
-			memcpy(&cost_last_path[1], cost_aggr_row, disp_range * sizeof(uint8_t));
+	int32_t num_threads = option.num_threads;
+	if (num_threads <= 0) {
+		num_threads = std::max(1, static_cast<int32_t>(std::thread::hardware_concurrency()));
+	}
+	const size_t num_chunks = (num_threads > 1) ? num_threads * 2 : 1;
+	const size_t path_buffer = PathTaskCount(width, height, option, static_cast<int32_t>(num_chunks)) *
+		PathBufferSize(width, height, disp_range, option);
+
+	const size_t img_size = static_cast<size_t>(width) * height;
+	const size_t path_cost_bytes = sgm_kernels::PathCostBytes(option.cost_storage);
+	size_t bytes = 2 * img_size * sizeof(float);
+	if (IsDecimatedLr(width, height, option)) {
+		bytes += static_cast<size_t>(width / 2) * (height / 2) * (2 * sizeof(uint8_t) + sizeof(float));
+		bytes += RequiredMemory(width / 2, height / 2, RightReferenceOption(option));
+	}
+	bytes += 2 * num_chunks * width * sizeof(uint64_t);
+	bytes += 11 * num_chunks * width * sizeof(uint16_t);
+	bytes += 2 * num_chunks * width;
+	if (option.confidence != sgm_kernels::ConfidenceMeasure::None) {
+		bytes += img_size * sizeof(float) + 5 * num_chunks * width * sizeof(uint16_t);
+	}
+	if (option.matching_cost == sgm_kernels::MatchingCost::MutualInformation) {
+		bytes += sgm_kernels::kCostTableSize + kMiScratchSize * sizeof(float);
+	}
+	if (HasMiGuide(width, height, option)) {
+		bytes += static_cast<size_t>(width / 2) * (height / 2) * (2 * sizeof(uint8_t) + sizeof(float));
+		bytes += RequiredMemory(width / 2, height / 2, MiGuideOption(option));
+	}
+	if (IsPyramid(width, height, option)) {
+		// The compact volumes depend on the scene, counted here for ranges of 2 * pyramid_margin + 3.
+		const size_t coarse_size = static_cast<size_t>(width / 2) * (height / 2);
+		bytes += img_size * (sizeof(int32_t) + sizeof(size_t)) + sizeof(size_t);
+		bytes += img_size * (2 * option.pyramid_margin + 3) * (sizeof(uint8_t) + sizeof(uint16_t) + num_dirs * path_cost_bytes);
+		bytes += path_buffer;
+		bytes += num_chunks * width * sizeof(int32_t);
+		bytes += coarse_size * (2 * sizeof(uint8_t) + sizeof(float));
+		return bytes + RequiredMemory(width / 2, height / 2, CoarseOption(option));
+	}
 
-			cost_init_row += direction * disp_range;
-			cost_aggr_row += direction * disp_range;
-			img_row += direction;
+	const size_t size = img_size * disp_range;
+	bytes += img_size * sgm_kernels::CostBytes(option.cost_storage, disp_range) + size * sizeof(uint16_t);
+	if (!option.is_low_memory) {
+		bytes += num_dirs * size * path_cost_bytes;
+	}
+	bytes += path_buffer;
+	if (option.cost_storage == sgm_kernels::CostStorage::Packed6) {
+		bytes += num_chunks * width * disp_range;
+	}
+	if (IsTemporal(option)) {
+		// Compact volumes of the frames matched around the previous one, counted for ranges of 2 * temporal_margin + 3.
+		bytes += img_size * (sizeof(int32_t) + sizeof(size_t) + sizeof(uint8_t)) + sizeof(size_t) + num_chunks * width * sizeof(int32_t);
+		bytes += img_size * (2 * option.temporal_margin + 3) * (sizeof(uint8_t) + sizeof(uint16_t) + num_dirs * path_cost_bytes);
+	}
+	return bytes;
+}
 
-			gray_last = gray;
-		}
+void SemiGlobalMatching::ComputeCost(const uint8_t* img_left, const uint8_t* img_right, uint8_t* cost_init)
+{
+	if (option_.matching_cost == sgm_kernels::MatchingCost::MutualInformation) {
+		UpdateMutualInformation(img_left, img_right, cost_init);
 	}
+	ComputeCostVolume(img_left, img_right, cost_init);
 }
 
-void SemiGlobalMatching::CostAggregateUpDown(const uint8_t* img_data, const int32_t& width, const int32_t& height,
-	const int32_t& min_disparity, const int32_t& max_disparity, const int32_t& p1, const int32_t& p2_init,
-	const uint8_t* cost_init, uint8_t* cost_aggr, bool is_forward)
+void SemiGlobalMatching::ComputeCostVolume(const uint8_t* img_left, const uint8_t* img_right, uint8_t* cost_init)
 {
+	if (sgm_kernels::CensusBits(option_.census_type) > 32) {
+		ComputeMatchingCost<uint64_t>(img_left, img_right, cost_init, census_row64_, cost_row64_);
+	}
+	else {
+		ComputeMatchingCost<uint32_t>(img_left, img_right, cost_init, census_row_, cost_row_);
+	}
+}
 
+template <typename Census>
+void SemiGlobalMatching::ComputeMatchingCost(const uint8_t* img_left, const uint8_t* img_right, uint8_t* cost_init,
+	sgm_kernels::CensusRowFunc<Census> census_row, sgm_kernels::CensusCostRowFunc<Census> cost_row_func)
+{
+	const int32_t& min_disparity = option_.min_disparity;
+	const int32_t& max_disparity = option_.max_disparity;
 	const int32_t disp_range = max_disparity - min_disparity;
+	if (disp_range <= 0) {
+		return;
+	}
 
-	const auto& P1 = p1;
-	const auto& P2_Init = p2_init;
-
-
-	const int32_t direction = is_forward ? 1 : -1;
-
-	for (int32_t j = 0; j < width; j++) {
-
-		auto cost_init_col = (is_forward) ? (cost_init + j * disp_range) : (cost_init + (height - 1) * width * disp_range + j * disp_range);
-		auto cost_aggr_col = (is_forward) ? (cost_aggr + j * disp_range) : (cost_aggr + (height - 1) * width * disp_range + j * disp_range);
-		auto img_col = (is_forward) ? (img_data + j) : (img_data + (height - 1) * width + j);
-
-		uint8_t gray = *img_col;
-		uint8_t gray_last = *img_col;
-
-
-		std::vector<uint8_t> cost_last_path(disp_range + 2, UINT8_MAX);
-
-
-		memcpy(cost_aggr_col, cost_init_col, disp_range * sizeof(uint8_t));
-		memcpy(&cost_last_path[1], cost_aggr_col, disp_range * sizeof(uint8_t));
-		cost_init_col += direction * width * disp_range;
-		cost_aggr_col += direction * width * disp_range;
-		img_col += direction * width;
-
-		uint8_t mincost_last_path = UINT8_MAX;
-		for (auto cost : cost_last_path) {
-			mincost_last_path = std::min(mincost_last_path, cost);
-		}
-
-
-		for (int32_t i = 0; i < height - 1; i++) {
-			gray = *img_col;
-			uint8_t min_cost = UINT8_MAX;
-			for (int32_t d = 0; d < disp_range; d++) {
-				// Lr(p,d) = C(p,d) + min( Lr(p-r,d), Lr(p-r,d-1) + P1, Lr(p-r,d+1) + P1, min(Lr(p-r))+P2 ) - min(Lr(p-r))
-				const uint8_t  cost = cost_init_col[d];
-				const uint16_t l1 = cost_last_path[d + 1];
-				const uint16_t l2 = cost_last_path[d] + P1;
-				const uint16_t l3 = cost_last_path[d + 2] + P1;
-				const uint16_t l4 = mincost_last_path + std::max(P1, P2_Init / (abs(gray - gray_last) + 1));
-
-				const uint8_t cost_s = cost + static_cast<uint8_t>(std::min(std::min(l1, l2), std::min(l3, l4)) - mincost_last_path);
-
-				cost_aggr_col[d] = cost_s;
-				min_cost = std::min(min_cost, cost_s);
+	// Census and Hamming costs (and the second term of a combined cost) are fused per row: the census rows
+	// stay in cache and the full-image census buffers are gone.
+	// A strip reads the census window across its border from the surrounding image, the window is clamped
+	// to the image border only.
+	const int32_t rows_above = (seam_ != nullptr) ? seam_->rows_above : 0;
+	const int32_t rows_below = (seam_ != nullptr) ? seam_->rows_below : 0;
+	const uint8_t* source_left = img_left - static_cast<size_t>(rows_above) * width_;
+	const uint8_t* source_right = img_right - static_cast<size_t>(rows_above) * width_;
+	const int32_t source_height = rows_above + height_ + rows_below;
+
+	// Packed costs are computed into a plain row first.
+	const bool is_packed = option_.cost_storage == sgm_kernels::CostStorage::Packed6;
+	const size_t cost_bytes = sgm_kernels::CostBytes(option_.cost_storage, disp_range);
+	const size_t row_size = static_cast<size_t>(width_) * disp_range;
+
+	const int32_t num_chunks = num_path_chunks_;
+	const sgm_kernels::CensusType census_type = option_.census_type;
+	const bool is_mi = option_.matching_cost == sgm_kernels::MatchingCost::MutualInformation;
+	const bool is_combined = !is_mi && option_.matching_cost != sgm_kernels::MatchingCost::Census;
+	pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+		Census* census_row_left = reinterpret_cast<Census*>(census_left_ + static_cast<size_t>(chunk) * width_);
+		Census* census_row_right = reinterpret_cast<Census*>(census_right_ + static_cast<size_t>(chunk) * width_);
+		uint8_t* term_left = cost_terms_ + static_cast<size_t>(chunk) * 2 * width_;
+		uint8_t* term_right = term_left + width_;
+		for (int32_t i = height_ * chunk / num_chunks; i < height_ * (chunk + 1) / num_chunks; i++) {
+			uint8_t* cost_row = is_packed ? cost_rows_ + chunk * row_size : cost_init + static_cast<size_t>(i) * row_size;
+			if (is_mi) {
+				const uint8_t* row_right = source_right + static_cast<size_t>(rows_above + i) * width_;
+				std::reverse_copy(row_right, row_right + width_, term_right);
+				table_cost_row_(source_left + static_cast<size_t>(rows_above + i) * width_, term_right, width_,
+					min_disparity, max_disparity, mi_cost_, cost_row);
 			}
+			else {
+				census_row(source_left, width_, source_height, rows_above + i, census_type, census_row_left);
+				census_row(source_right, width_, source_height, rows_above + i, census_type, census_row_right);
+				std::reverse(census_row_right, census_row_right + width_);
+				cost_row_func(census_row_left, census_row_right, width_, min_disparity, max_disparity, cost_row);
+			}
+			if (is_combined) {
+				CostTermRow(source_left, source_height, rows_above + i, term_left);
+				CostTermRow(source_right, source_height, rows_above + i, term_right);
+				std::reverse(term_right, term_right + width_);
+				combine_cost_row_(cost_row, term_left, term_right, width_, min_disparity, max_disparity, census_lut_, term_lut_);
+			}
+			if (!cost_scale_.empty()) {
+				for (size_t k = 0; k < row_size; k++) {
+					cost_row[k] = cost_scale_[cost_row[k]];
+				}
+			}
+			if (is_packed) {
+				uint8_t* packed = cost_init + static_cast<size_t>(i) * width_ * cost_bytes;
+				for (int32_t j = 0; j < width_; j++) {
+					pack_costs_(cost_row + j * disp_range, disp_range, packed + j * cost_bytes);
+				}
+			}
+		}
+	});
+}
 
-			mincost_last_path = min_cost;
-			memcpy(&cost_last_path[1], cost_aggr_col, disp_range * sizeof(uint8_t));
-
-			cost_init_col += direction * width * disp_range;
-			cost_aggr_col += direction * width * disp_range;
-			img_col += direction * width;
+void SemiGlobalMatching::CostTermRow(const uint8_t* source, const int32_t& height, const int32_t& row, uint8_t* term) const
+{
+	if (option_.matching_cost == sgm_kernels::MatchingCost::GradientCensus) {
+		sgm_kernels::GradientRow(source, width_, height, row, term);
+	}
+	else {
+		memcpy(term, source + static_cast<size_t>(row) * width_, width_);
+	}
+}
 
-			gray_last = gray;
+void SemiGlobalMatching::BuildCostTables()
+{
+	// Census and second term take up to half of the combined cost each.
+	const int32_t half = sgm_kernels::kCombinedCostMax / 2;
+	const int32_t bits = sgm_kernels::CensusBits(option_.census_type);
+	for (int32_t k = 0; k < 64; k++) {
+		if (option_.matching_cost == sgm_kernels::MatchingCost::AdCensus) {
+			// lambda_census of half the census bits and lambda_AD = 10.
+			census_lut_[k] = static_cast<uint8_t>(lround(half * (1.0 - exp(-k / (bits / 2.0)))));
+			term_lut_[k] = static_cast<uint8_t>(lround(half * (1.0 - exp(-k / 10.0))));
+		}
+		else {
+			census_lut_[k] = static_cast<uint8_t>((half * std::min(k, bits) + bits / 2) / bits);
+			term_lut_[k] = static_cast<uint8_t>((half * std::min(k, kGradientTruncation) + kGradientTruncation / 2) / kGradientTruncation);
 		}
 	}
 }
 
-void SemiGlobalMatching::CostAggregateDagonal_1(const uint8_t* img_data, const int32_t& width, const int32_t& height,
-	const int32_t& min_disparity, const int32_t& max_disparity, const int32_t& p1, const int32_t& p2_init,
-	const uint8_t* cost_init, uint8_t* cost_aggr, bool is_forward)
+bool SemiGlobalMatching::HasMiGuide(const int32_t& width, const int32_t& height, const SGMOption& option)
 {
-	const int32_t disp_range = max_disparity - min_disparity;
-
-	const auto& P1 = p1;
-	const auto& P2_Init = p2_init;
-
-	const int32_t direction = is_forward ? 1 : -1;
-
-	int32_t current_row = 0;
-	int32_t current_col = 0;
-
-	for (int32_t j = 0; j < width; j++) {
-
-		auto cost_init_col = (is_forward) ? (cost_init + j * disp_range) : (cost_init + (height - 1) * width * disp_range + j * disp_range);
-		auto cost_aggr_col = (is_forward) ? (cost_aggr + j * disp_range) : (cost_aggr + (height - 1) * width * disp_range + j * disp_range);
-		auto img_col = (is_forward) ? (img_data + j) : (img_data + (height - 1) * width + j);
-
-		std::vector<uint8_t> cost_last_path(disp_range + 2, UINT8_MAX);
-
+	return option.matching_cost == sgm_kernels::MatchingCost::MutualInformation && !IsPyramid(width, height, option) &&
+		width / 2 >= 16 && height / 2 >= 16;
+}
 
-		memcpy(cost_aggr_col, cost_init_col, disp_range * sizeof(uint8_t));
-		memcpy(&cost_last_path[1], cost_aggr_col, disp_range * sizeof(uint8_t));
+SemiGlobalMatching::SGMOption SemiGlobalMatching::MiGuideOption(const SGMOption& option)
+{
+	// Only the raw disparities are needed, an LR check would leave too few pairs at the coarse levels.
+	SGMOption guide = CoarseOption(option);
+	guide.num_pyramid_levels = 1;
+	guide.is_check_lr = false;
+	guide.is_decimated_lr = false;
+	guide.is_remove_speckles = false;
+	guide.is_fill_holes = false;
+	guide.median_window = 0;
+	return guide;
+}
 
-		uint8_t gray = *img_col;
-		uint8_t gray_last = *img_col;
+void SemiGlobalMatching::UpdateMutualInformation(const uint8_t* img_left, const uint8_t* img_right, uint8_t* cost_init)
+{
+	if (coarse_ != nullptr) {
+		Downsample(img_left, width_, height_, img_coarse_left_);
+		Downsample(img_right, width_, height_, img_coarse_right_);
+		if (coarse_->Match(img_coarse_left_, img_coarse_right_, disp_coarse_)) {
+			EstimateMutualInformation(img_left, img_right, disp_coarse_, width_ / 2, height_ / 2, 2);
+			return;
+		}
+	}
 
+	// Coarsest level: random disparities first, then the table of the previous raw disparities, which an
+	// early LR check would mostly reject. The iterations stay inside the strip.
+	const PathSeam* seam = seam_;
+	seam_ = nullptr;
+	EstimateMutualInformation(img_left, img_right, nullptr, 0, 0, 1);
+	for (int32_t k = 0; k < kMiIterations; k++) {
+		ComputeCostVolume(img_left, img_right, cost_init);
+		CostAggregation();
+		ComputeDisparity();
+		EstimateMutualInformation(img_left, img_right, disp_left_, width_, height_, 1);
+	}
+	seam_ = seam;
+}
 
-		current_row = is_forward ? 0 : height - 1;
-		current_col = j;
-		if (is_forward && current_col == width - 1 && current_row < height - 1) {
-			cost_init_col = cost_init + (current_row + direction) * width * disp_range;
-			cost_aggr_col = cost_aggr + (current_row + direction) * width * disp_range;
-			img_col = img_data + (current_row + direction) * width;
+void SemiGlobalMatching::EstimateMutualInformation(const uint8_t* img_left, const uint8_t* img_right, const float* guide,
+	const int32_t& guide_width, const int32_t& guide_height, const int32_t& scale)
+{
+	const int32_t width = width_;
+	const int32_t height = height_;
+	const int32_t& min_disparity = option_.min_disparity;
+	const int32_t& max_disparity = option_.max_disparity;
+	float* joint = mi_scratch_;
+	float* temp = joint + 256 * 256;
+	float* marginal_left = temp + 256 * 256;
+	float* marginal_right = marginal_left + 256;
+
+	// Joint histogram of the matched intensity pairs.
+	std::fill(joint, joint + 256 * 256, 0.0f);
+	uint32_t random = 1;
+	int64_t count = 0;
+	for (int32_t i = 0; i < height; i++) {
+		const float* guide_row = (guide != nullptr) ? guide + std::min(i / scale, guide_height - 1) * guide_width : nullptr;
+		for (int32_t j = 0; j < width; j++) {
+			int32_t disp;
+			if (guide_row != nullptr) {
+				const float guide_disp = guide_row[std::min(j / scale, guide_width - 1)];
+				if (guide_disp == INVALID_FLOAT) {
+					continue;
+				}
+				disp = static_cast<int32_t>(lround(guide_disp * scale));
+			}
+			else {
+				random = random * 1664525u + 1013904223u;
+				disp = min_disparity + static_cast<int32_t>((random >> 8) % static_cast<uint32_t>(max_disparity - min_disparity));
+			}
+			const int32_t col_right = j - disp;
+			if (col_right < 0 || col_right >= width) {
+				continue;
+			}
+			joint[img_left[i * width + j] * 256 + img_right[i * width + col_right]] += 1.0f;
+			count++;
 		}
-		else if (!is_forward && current_col == 0 && current_row > 0) {
-			cost_init_col = cost_init + (current_row + direction) * width * disp_range + (width - 1) * disp_range;
-			cost_aggr_col = cost_aggr + (current_row + direction) * width * disp_range + (width - 1) * disp_range;
-			img_col = img_data + (current_row + direction) * width + (width - 1);
+	}
+	if (count == 0) {
+		// Nothing matched (or nothing inside the image), start over from random pairs.
+		if (guide != nullptr) {
+			EstimateMutualInformation(img_left, img_right, nullptr, 0, 0, 1);
 		}
 		else {
-			cost_init_col += direction * (width + 1) * disp_range;
-			cost_aggr_col += direction * (width + 1) * disp_range;
-			img_col += direction * (width + 1);
+			std::fill(mi_cost_, mi_cost_ + sgm_kernels::kCostTableSize, 0);
 		}
+		return;
+	}
 
-		uint8_t mincost_last_path = UINT8_MAX;
-		for (auto cost : cost_last_path) {
-			mincost_last_path = std::min(mincost_last_path, cost);
+	std::fill(marginal_left, marginal_left + 512, 0.0f);
+	for (int32_t a = 0; a < 256; a++) {
+		for (int32_t b = 0; b < 256; b++) {
+			marginal_left[a] += joint[a * 256 + b];
+			marginal_right[b] += joint[a * 256 + b];
 		}
+	}
 
-		for (int32_t i = 0; i < height - 1; i++) {
-			gray = *img_col;
-			uint8_t min_cost = UINT8_MAX;
-			for (int32_t d = 0; d < disp_range; d++) {
-				// Lr(p,d) = C(p,d) + min( Lr(p-r,d), Lr(p-r,d-1) + P1, Lr(p-r,d+1) + P1, min(Lr(p-r))+P2 ) - min(Lr(p-r))
-				const uint8_t  cost = cost_init_col[d];
-				const uint16_t l1 = cost_last_path[d + 1];
-				const uint16_t l2 = cost_last_path[d] + P1;
-				const uint16_t l3 = cost_last_path[d + 2] + P1;
-				const uint16_t l4 = mincost_last_path + std::max(P1, P2_Init / (abs(gray - gray_last) + 1));
-
-				const uint8_t cost_s = cost + static_cast<uint8_t>(std::min(std::min(l1, l2), std::min(l3, l4)) - mincost_last_path);
-
-				cost_aggr_col[d] = cost_s;
-				min_cost = std::min(min_cost, cost_s);
-			}
+	// Entropy terms h = G * -log(G * P). An intensity takes at least the probability of a single sample, a pair
+	// a thousandth of it, so that pairs never seen cost more than those of rare intensities.
+	const float inv_count = 1.0f / count;
+	auto entropy = [&](float* data, const int32_t& rows, const float& least) {
+		for (int32_t k = 0; k < rows * 256; k++) {
+			data[k] *= inv_count;
+		}
+		SmoothHistogram(data, temp, rows);
+		for (int32_t k = 0; k < rows * 256; k++) {
+			data[k] = -log(std::max(data[k], least));
+		}
+		SmoothHistogram(data, temp, rows);
+	};
+	entropy(joint, 256, inv_count / 1000);
+	entropy(marginal_left, 1, inv_count);
+	entropy(marginal_right, 1, inv_count);
+
+	// mi = h_left + h_right - h_joint, the cost falls linearly from the least to the most mutual information.
+	float mi_min = std::numeric_limits<float>::max();
+	float mi_max = -std::numeric_limits<float>::max();
+	for (int32_t a = 0; a < 256; a++) {
+		for (int32_t b = 0; b < 256; b++) {
+			float& mi = joint[a * 256 + b];
+			mi = marginal_left[a] + marginal_right[b] - mi;
+			mi_min = std::min(mi_min, mi);
+			mi_max = std::max(mi_max, mi);
+		}
+	}
+	const float cost_scale = (mi_max > mi_min) ? sgm_kernels::kCombinedCostMax / (mi_max - mi_min) : 0.0f;
+	for (int32_t k = 0; k < 256 * 256; k++) {
+		mi_cost_[k] = static_cast<uint8_t>(lround((mi_max - joint[k]) * cost_scale));
+	}
+}
 
-			mincost_last_path = min_cost;
-			memcpy(&cost_last_path[1], cost_aggr_col, disp_range * sizeof(uint8_t));
+void SemiGlobalMatching::ScaleCosts()
+{
+	// Lr(p,d) never exceeds C(p,d) + P2, so 8-bit path costs of in-image disparities stay below the UINT8_MAX of
+	// the out-of-image costs while the largest census cost plus the larger penalty does. Beyond that costs and
+	// penalties shrink by the same factor, rounded down so that the bound still holds.
+	p1_ = option_.p1;
+	p2_init_ = option_.p2_init;
+	cost_scale_.clear();
+	const int32_t limit = UINT8_MAX - 1;
+	const int32_t range = sgm_kernels::MaxMatchingCost(option_.matching_cost, option_.census_type) + std::max(p1_, p2_init_);
+	if (option_.cost_storage == sgm_kernels::CostStorage::Uint16 || range <= limit) {
+		return;
+	}
+	p1_ = (option_.p1 > 0) ? std::max(1, option_.p1 * limit / range) : option_.p1;
+	p2_init_ = option_.p2_init * limit / range;
+	cost_scale_.resize(UINT8_MAX + 1);
+	for (int32_t cost = 0; cost < UINT8_MAX; cost++) {
+		cost_scale_[cost] = static_cast<uint8_t>(cost * limit / range);
+	}
+	cost_scale_[UINT8_MAX] = UINT8_MAX;
+}
 
+template <typename PathCost>
+void SemiGlobalMatching::StorePathCost(const PathCost* cost_path, const size_t& offset, const int32_t& disp_range, PathCost* cost_aggr, uint16_t* cost_sum)
+{
+	if (cost_aggr != nullptr) {
+		memcpy(cost_aggr + offset, cost_path, disp_range * sizeof(PathCost));
+	}
+	if (cost_sum != nullptr) {
+		sgm_kernels::AccumulateCost(cost_sum + offset, cost_path, disp_range);
+	}
+}
 
-			current_row += direction;
-			current_col += direction;
+int32_t SemiGlobalMatching::PathCount(const int32_t& width, const int32_t& height, const int32_t& dr)
+{
+	return (dr == 0) ? height : width * abs(dr);
+}
 
+size_t SemiGlobalMatching::PathBufferSize(const int32_t& width, const int32_t& height, const int32_t& disp_range, const SGMOption& option)
+{
+	const size_t path_cost_bytes = sgm_kernels::PathCostBytes(option.cost_storage);
+	const size_t line = std::max(width, height);
+	// The remap buffer and the Lr before a refresh, three rows of path minima and three rows of whether Lr changed
+	// in a refresh.
+	const size_t compact = (2 * (disp_range + 2) + 3 * line) * path_cost_bytes + 3 * line;
+	if (IsPyramid(width, height, option)) {
+		return compact;
+	}
+	// Packed costs are unpacked behind the path buffers.
+	const size_t unpacked = (option.cost_storage == sgm_kernels::CostStorage::Packed6) ? disp_range : 0;
+	size_t dense = 2 * (disp_range + 2) * path_cost_bytes + unpacked;
+	if (option.is_mgm) {
+		// Lr and its minimum of every pixel of the previous and the current line.
+		dense = 2 * line * (disp_range + 3) * path_cost_bytes + unpacked;
+	}
+	// The temporal mode matches frames either way.
+	return IsTemporal(option) ? std::max(dense, compact) : dense;
+}
 
-			if (is_forward && current_col == width - 1 && current_row < height - 1) {
-				cost_init_col = cost_init + (current_row + direction) * width * disp_range;
-				cost_aggr_col = cost_aggr + (current_row + direction) * width * disp_range;
-				img_col = img_data + (current_row + direction) * width;
-			}
-			else if (!is_forward && current_col == 0 && current_row > 0) {
-				cost_init_col = cost_init + (current_row + direction) * width * disp_range + (width - 1) * disp_range;
-				cost_aggr_col = cost_aggr + (current_row + direction) * width * disp_range + (width - 1) * disp_range;
-				img_col = img_data + (current_row + direction) * width + (width - 1);
-			}
-			else {
-				cost_init_col += direction * (width + 1) * disp_range;
-				cost_aggr_col += direction * (width + 1) * disp_range;
-				img_col += direction * (width + 1);
-			}
+size_t SemiGlobalMatching::PathTaskCount(const int32_t& width, const int32_t& height, const SGMOption& option, const int32_t& num_chunks)
+{
+	const int32_t num_dirs = NumDirections(option);
+	const size_t compact = static_cast<size_t>(num_dirs) * std::min(num_chunks, 64);
+	if (IsPyramid(width, height, option)) {
+		return compact;
+	}
+	const size_t dense = static_cast<size_t>(num_dirs) * (option.is_mgm ? 1 : num_chunks);
+	return IsTemporal(option) ? std::max(dense, compact) : dense;
+}
 
-			gray_last = gray;
-		}
+void SemiGlobalMatching::AggregatePaths(const int32_t& dr, const int32_t& dc, uint8_t* cost_aggr, uint16_t* cost_sum,
+	const int32_t& path_begin, const int32_t& path_end, uint8_t* path_buffer)
+{
+	switch (option_.cost_storage) {
+	case sgm_kernels::CostStorage::Uint16:
+		CostAggregatePaths<sgm_kernels::CostStorage::Uint16>(img_left_, width_, height_, option_.min_disparity, option_.max_disparity, p1_, p2_init_,
+			cost_init_, reinterpret_cast<uint16_t*>(cost_aggr), dr, dc, cost_sum, path_begin, path_end, path_buffer);
+		break;
+	case sgm_kernels::CostStorage::Packed6:
+		CostAggregatePaths<sgm_kernels::CostStorage::Packed6>(img_left_, width_, height_, option_.min_disparity, option_.max_disparity, p1_, p2_init_,
+			cost_init_, cost_aggr, dr, dc, cost_sum, path_begin, path_end, path_buffer);
+		break;
+	default:
+		CostAggregatePaths<sgm_kernels::CostStorage::Uint8>(img_left_, width_, height_, option_.min_disparity, option_.max_disparity, p1_, p2_init_,
+			cost_init_, cost_aggr, dr, dc, cost_sum, path_begin, path_end, path_buffer);
+		break;
 	}
 }
 
-void SemiGlobalMatching::CostAggregateDagonal_2(const uint8_t* img_data, const int32_t& width, const int32_t& height,
-	const int32_t& min_disparity, const int32_t& max_disparity, const int32_t& p1, const int32_t& p2_init,
-	const uint8_t* cost_init, uint8_t* cost_aggr, bool is_forward)
+template <sgm_kernels::CostStorage S>
+void SemiGlobalMatching::CostAggregatePaths(const uint8_t* img_data, const int32_t& width, const int32_t& height, const int32_t& min_disparity, const int32_t& max_disparity,
+	const int32_t& p1, const int32_t& p2_init, const uint8_t* cost_init, typename sgm_kernels::StorageTraits<S>::PathCost* cost_aggr,
+	const int32_t& dr, const int32_t& dc, uint16_t* cost_sum, const int32_t& path_begin, const int32_t& path_end, uint8_t* path_buffer)
 {
+	typedef typename sgm_kernels::StorageTraits<S>::PathCost PathCost;
+	const PathCost max_cost = std::numeric_limits<PathCost>::max();
 	const int32_t disp_range = max_disparity - min_disparity;
-
+	const size_t cost_bytes = sgm_kernels::CostBytes(S, disp_range);
+	const auto aggr_step = sgm_kernels::SelectAggregateStep<PathCost>(option_.is_use_simd);
+	const auto aggr_path = sgm_kernels::SelectAggregatePath<S>(disp_range, option_.is_use_simd);
 
 	const auto& P1 = p1;
 	const auto& P2_Init = p2_init;
 
-
-	const int32_t direction = is_forward ? 1 : -1;
-
-
-	int32_t current_row = 0;
-	int32_t current_col = 0;
-
-	for (int32_t j = 0; j < width; j++) {
-		auto cost_init_col = (is_forward) ? (cost_init + j * disp_range) : (cost_init + (height - 1) * width * disp_range + j * disp_range);
-		auto cost_aggr_col = (is_forward) ? (cost_aggr + j * disp_range) : (cost_aggr + (height - 1) * width * disp_range + j * disp_range);
-		auto img_col = (is_forward) ? (img_data + j) : (img_data + (height - 1) * width + j);
-
-		std::vector<uint8_t> cost_last_path(disp_range + 2, UINT8_MAX);
-
-		memcpy(cost_aggr_col, cost_init_col, disp_range * sizeof(uint8_t));
-		memcpy(&cost_last_path[1], cost_aggr_col, disp_range * sizeof(uint8_t));
-
-		uint8_t gray = *img_col;
-		uint8_t gray_last = *img_col;
-
-		current_row = is_forward ? 0 : height - 1;
-		current_col = j;
-		if (is_forward && current_col == 0 && current_row < height - 1) {
-			cost_init_col = cost_init + (current_row + direction) * width * disp_range + (width - 1) * disp_range;
-			cost_aggr_col = cost_aggr + (current_row + direction) * width * disp_range + (width - 1) * disp_range;
-			img_col = img_data + (current_row + direction) * width + (width - 1);
-		}
-		else if (!is_forward && current_col == width - 1 && current_row > 0) {
-			cost_init_col = cost_init + (current_row + direction) * width * disp_range;
-			cost_aggr_col = cost_aggr + (current_row + direction) * width * disp_range;
-			img_col = img_data + (current_row + direction) * width;
+	// A horizontal path covers one row. Any other path starts on the first (last) row and wraps around the
+	// left/right border into the following rows, i.e. path j visits (t * dr, (j + t * dc) mod width), so
+	// every pixel lies on exactly one path and paths can be aggregated independently.
+	for (int32_t path = path_begin; path < path_end; path++) {
+		int32_t row = 0, col = 0, length = 0, phase = 0;
+		if (dr == 0) {
+			row = path;
+			col = (dc > 0) ? 0 : width - 1;
+			length = width;
 		}
 		else {
-			cost_init_col += direction * (width - 1) * disp_range;
-			cost_aggr_col += direction * (width - 1) * disp_range;
-			img_col += direction * (width - 1);
+			phase = path / width;
+			row = (dr > 0) ? phase : height - 1 - phase;
+			col = path % width;
+			length = (height - phase + abs(dr) - 1) / abs(dr);
 		}
-
-		uint8_t mincost_last_path = UINT8_MAX;
-		for (auto cost : cost_last_path) {
-			mincost_last_path = std::min(mincost_last_path, cost);
+		if (length <= 0) {
+			continue;
 		}
 
-		for (int32_t i = 0; i < height - 1; i++) {
-			gray = *img_col;
-			uint8_t min_cost = UINT8_MAX;
-			for (int32_t d = 0; d < disp_range; d++) {
-				// Lr(p,d) = C(p,d) + min( Lr(p-r,d), Lr(p-r,d-1) + P1, Lr(p-r,d+1) + P1, min(Lr(p-r))+P2 ) - min(Lr(p-r))
-				const uint8_t  cost = cost_init_col[d];
-				const uint16_t l1 = cost_last_path[d + 1];
-				const uint16_t l2 = cost_last_path[d] + P1;
-				const uint16_t l3 = cost_last_path[d + 2] + P1;
-				const uint16_t l4 = mincost_last_path + std::max(P1, P2_Init / (abs(gray - gray_last) + 1));
-
-				const uint8_t cost_s = cost + static_cast<uint8_t>(std::min(std::min(l1, l2), std::min(l3, l4)) - mincost_last_path);
+		// Paths that neither enter nor leave through a strip seam go to the fixed-range kernel.
+		if (aggr_path != nullptr && (seam_ == nullptr || dr == 0)) {
+			sgm_kernels::PathWalk<PathCost> walk;
+			walk.img = img_data;
+			walk.cost_init = cost_init;
+			walk.cost_aggr = cost_aggr;
+			walk.cost_sum = cost_sum;
+			walk.width = width;
+			walk.row = row;
+			walk.col = col;
+			walk.dr = dr;
+			walk.dc = dc;
+			walk.length = length;
+			walk.p1 = P1;
+			walk.p2_init = P2_Init;
+			aggr_path(walk);
+			continue;
+		}
 
-				cost_aggr_col[d] = cost_s;
-				min_cost = std::min(min_cost, cost_s);
+		// Lr(p-r) and Lr(p), both with a max_cost sentinel on each side, swapped after every step.
+		PathCost* cost_last_path = reinterpret_cast<PathCost*>(path_buffer);
+		PathCost* cost_cur_path = cost_last_path + disp_range + 2;
+		uint8_t* unpacked = reinterpret_cast<uint8_t*>(cost_cur_path + disp_range + 2);
+		cost_last_path[0] = cost_last_path[disp_range + 1] = max_cost;
+		cost_cur_path[0] = cost_cur_path[disp_range + 1] = max_cost;
+		PathCost mincost_last_path = max_cost;
+		uint8_t gray_last = 0;
+
+		// In a strip the path continues from the neighbouring strip instead of starting on the border row.
+		const PathCost* seed = nullptr;
+		PathCost* leave = nullptr;
+		int32_t leave_row = -1;
+		if (seam_ != nullptr && dr != 0) {
+			const size_t slot_offset = static_cast<size_t>(SeamSlot(NumDirections(option_), dr, dc)) * width;
+			const PathCost* enter = reinterpret_cast<const PathCost*>((dr > 0) ? seam_->enter_top : seam_->enter_bottom);
+			const uint8_t* enter_gray = (dr > 0) ? seam_->gray_top : seam_->gray_bottom;
+			// The pixel before the first one lies 'back' rows outside the strip, if the image has that row.
+			const int32_t back = abs(dr) - phase;
+			if (enter != nullptr && back <= ((dr > 0) ? seam_->rows_above : seam_->rows_below)) {
+				const int32_t prev_col = (col - dc + width) % width;
+				seed = enter + (slot_offset + static_cast<size_t>(back - 1) * width + prev_col) * disp_range;
+				gray_last = enter_gray[((dr > 0) ? 1 - back : back - 1) * width + prev_col];
 			}
+			leave = reinterpret_cast<PathCost*>((dr > 0) ? seam_->leave_bottom : seam_->leave_top);
+			leave_row = (dr > 0) ? seam_->leave_bottom_row : seam_->leave_top_row;
+			if (leave != nullptr) {
+				leave += slot_offset * disp_range;
+			}
+		}
+		if (seed != nullptr) {
+			memcpy(&cost_last_path[1], seed, disp_range * sizeof(PathCost));
+			for (int32_t d = 0; d < disp_range + 2; d++) {
+				mincost_last_path = std::min(mincost_last_path, cost_last_path[d]);
+			}
+		}
 
-			mincost_last_path = min_cost;
-			memcpy(&cost_last_path[1], cost_aggr_col, disp_range * sizeof(uint8_t));
-
-			current_row += direction;
-			current_col -= direction;
-
-			if (is_forward && current_col == 0 && current_row < height - 1) {
-				cost_init_col = cost_init + (current_row + direction) * width * disp_range + (width - 1) * disp_range;
-				cost_aggr_col = cost_aggr + (current_row + direction) * width * disp_range + (width - 1) * disp_range;
-				img_col = img_data + (current_row + direction) * width + (width - 1);
+		for (int32_t t = 0; t < length; t++) {
+			if (t > 0) {
+				row += dr;
+				col += dc;
+				if (col < 0) {
+					col += width;
+				}
+				else if (col >= width) {
+					col -= width;
+				}
+			}
+			const size_t pixel = static_cast<size_t>(row) * width + col;
+			const uint8_t gray = img_data[pixel];
+			const uint8_t* cost = cost_init + pixel * cost_bytes;
+			if (sgm_kernels::StorageTraits<S>::kIsPacked) {
+				sgm_kernels::UnpackCosts(cost, disp_range, unpacked);
+				cost = unpacked;
 			}
-			else if (!is_forward && current_col == width - 1 && current_row > 0) {
-				cost_init_col = cost_init + (current_row + direction) * width * disp_range;
-				cost_aggr_col = cost_aggr + (current_row + direction) * width * disp_range;
-				img_col = img_data + (current_row + direction) * width;
+
+			PathCost min_cost = max_cost;
+			if (t == 0 && seed == nullptr) {
+				std::copy(cost, cost + disp_range, &cost_cur_path[1]);
+				for (int32_t d = 0; d < disp_range + 2; d++) {
+					min_cost = std::min(min_cost, cost_cur_path[d]);
+				}
 			}
 			else {
-				cost_init_col += direction * (width - 1) * disp_range;
-				cost_aggr_col += direction * (width - 1) * disp_range;
-				img_col += direction * (width - 1);
+				// Lr(p,d) = C(p,d) + min( Lr(p-r,d), Lr(p-r,d-1) + P1, Lr(p-r,d+1) + P1, min(Lr(p-r))+P2 ) - min(Lr(p-r))
+				min_cost = aggr_step(cost, cost_last_path, &cost_cur_path[1], disp_range, P1,
+					std::max(P1, P2_Init / (abs(gray - gray_last) + 1)), mincost_last_path);
+			}
+			StorePathCost(&cost_cur_path[1], pixel * disp_range, disp_range, cost_aggr, cost_sum);
+			// Rows leave_row, leave_row -+ 1, ... go to the seam rows 0, 1, ...
+			const int32_t leave_index = (dr > 0) ? leave_row - row : row - leave_row;
+			if (leave != nullptr && leave_index >= 0 && leave_index < abs(dr)) {
+				memcpy(leave + (static_cast<size_t>(leave_index) * width + col) * disp_range, &cost_cur_path[1], disp_range * sizeof(PathCost));
 			}
 
+			mincost_last_path = min_cost;
+			std::swap(cost_last_path, cost_cur_path);
+
 			gray_last = gray;
 		}
 	}
@@ -523,29 +1328,24 @@ void SemiGlobalMatching::MedianFilter(const float* in, float* out, const int32_t
 	const int32_t wnd_size)
 {
 	const int32_t radius = wnd_size / 2;
-	const int32_t size = wnd_size * wnd_size;
-
-	std::vector<float> wnd_data;
-	wnd_data.reserve(size);
-
-	for (int32_t i = 0; i < height; i++) {
-		for (int32_t j = 0; j < width; j++) {
-			wnd_data.clear();
-
-			for (int32_t r = -radius; r <= radius; r++) {
-				for (int32_t c = -radius; c <= radius; c++) {
-					const int32_t row = i + r;
-					const int32_t col = j + c;
-					if (row >= 0 && row < height && col >= 0 && col < width) {
-						wnd_data.push_back(in[row * width + col]);
-					}
-				}
-			}
+	const int32_t num_chunks = num_path_chunks_;
+	if (radius <= 2) {
+		pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+			sgm_kernels::MedianRowsNetwork(in, out, width, height, radius, height * chunk / num_chunks, height * (chunk + 1) / num_chunks);
+		});
+		return;
+	}
 
-			std::sort(wnd_data.begin(), wnd_data.end());
-			out[i * width + j] = wnd_data[wnd_data.size() / 2];
+	// One band of rows per task, walked in tiles of kMedianTileWidth columns.
+	const size_t scratch_size = sgm_kernels::MedianHistogramSize(kMedianTileWidth, radius, option_.max_disparity - option_.min_disparity);
+	median_scratch_.resize(num_chunks * scratch_size);
+	pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+		uint8_t* scratch = median_scratch_.data() + chunk * scratch_size;
+		for (int32_t col = 0; col < width; col += kMedianTileWidth) {
+			sgm_kernels::MedianTileHistogram(in, out, width, height, radius, option_.min_disparity, option_.max_disparity,
+				height * chunk / num_chunks, height * (chunk + 1) / num_chunks, col, std::min(width, col + kMedianTileWidth), scratch);
 		}
-	}
+	});
 }
 
 void SemiGlobalMatching::RemoveSpeckles(float* disparity_map, const int32_t& width, const int32_t& height,
@@ -556,52 +1356,99 @@ void SemiGlobalMatching::RemoveSpeckles(float* disparity_map, const int32_t& wid
 		return;
 	}
 
-	std::vector<bool> visited(uint32_t(width * height), false);
-	for (int32_t i = 0; i < height; i++) {
-		for (int32_t j = 0; j < width; j++) {
-			if (visited[i * width + j] || disparity_map[i * width + j] == invalid_val) {
-				continue;
+	// Union-find over the valid pixels, 8-connected where the disparities differ by at most diff_insame.
+	// A root holds minus the size of its region, any other pixel the index of a pixel with a smaller
+	// index in the same region.
+	speckle_labels_.resize(static_cast<size_t>(width) * height);
+	int32_t* labels = speckle_labels_.data();
+	auto find = [labels](int32_t p) {
+		while (labels[p] >= 0) {
+			if (labels[labels[p]] >= 0) {
+				labels[p] = labels[labels[p]];
 			}
-
-			std::vector<std::pair<int32_t, int32_t>> vec;
-			vec.emplace_back(i, j);
-			visited[i * width + j] = true;
-			uint32_t cur = 0;
-			uint32_t next = 0;
-			do {
-				next = vec.size();
-				for (uint32_t k = cur; k < next; k++) {
-					const auto& pixel = vec[k];
-					const int32_t row = pixel.first;
-					const int32_t col = pixel.second;
-					const auto& disp_base = disparity_map[row * width + col];
-					for (int r = -1; r <= 1; r++) {
-						for (int c = -1; c <= 1; c++) {
-							if (r == 0 && c == 0) {
-								continue;
-							}
-							int rowr = row + r;
-							int colc = col + c;
-							if (rowr >= 0 && rowr < height && colc >= 0 && colc < width) {
-								if (!visited[rowr * width + colc] && abs(disparity_map[rowr * width + colc] - disp_base) <= diff_insame) {
-									vec.emplace_back(rowr, colc);
-									visited[rowr * width + colc] = true;
-								}
-							}
+			p = labels[p];
+		}
+		return p;
+	};
+	auto unite = [&](const int32_t& p, const int32_t& q) {
+		int32_t a = find(p);
+		int32_t b = find(q);
+		if (a != b) {
+			if (a > b) {
+				std::swap(a, b);
+			}
+			labels[a] += labels[b];
+			labels[b] = a;
+		}
+	};
+	auto is_same = [&](const int32_t& p, const int32_t& q) {
+		return disparity_map[q] != invalid_val && fabs(disparity_map[q] - disparity_map[p]) <= diff_insame;
+	};
+
+	// Each band of rows is labelled on its own, then the bands are joined along their first rows.
+	const int32_t num_chunks = num_path_chunks_;
+	pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+		const int32_t row_begin = height * chunk / num_chunks;
+		const int32_t row_end = height * (chunk + 1) / num_chunks;
+		for (int32_t i = row_begin; i < row_end; i++) {
+			for (int32_t j = 0; j < width; j++) {
+				const int32_t p = i * width + j;
+				if (disparity_map[p] == invalid_val) {
+					continue;
+				}
+				labels[p] = -1;
+				if (j > 0 && is_same(p, p - 1)) {
+					unite(p, p - 1);
+				}
+				if (i > row_begin) {
+					for (int32_t q = p - width - (j > 0 ? 1 : 0); q <= p - width + (j + 1 < width ? 1 : 0); q++) {
+						if (is_same(p, q)) {
+							unite(p, q);
 						}
 					}
 				}
-				cur = next;
-			} while (next < vec.size());
-
-			if (vec.size() < min_speckle_aera) {
-				for (auto& pix : vec) {
-					disparity_map[pix.first * width + pix.second] = invalid_val;
-
+			}
+		}
+		// Point every pixel straight at its band root, parents come first in the scan.
+		for (int32_t p = row_begin * width; p < row_end * width; p++) {
+			if (disparity_map[p] != invalid_val && labels[p] >= 0 && labels[labels[p]] >= 0) {
+				labels[p] = labels[labels[p]];
+			}
+		}
+	});
+	for (int32_t chunk = 1; chunk < num_chunks; chunk++) {
+		const int32_t i = height * chunk / num_chunks;
+		if (i == 0 || i == height * (chunk + 1) / num_chunks) {
+			continue;
+		}
+		for (int32_t j = 0; j < width; j++) {
+			const int32_t p = i * width + j;
+			if (disparity_map[p] == invalid_val) {
+				continue;
+			}
+			for (int32_t q = p - width - (j > 0 ? 1 : 0); q <= p - width + (j + 1 < width ? 1 : 0); q++) {
+				if (is_same(p, q)) {
+					unite(p, q);
 				}
 			}
 		}
 	}
+
+	// The labels are only read from here on, so the bands can look up roots in each other.
+	pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+		for (int32_t p = height * chunk / num_chunks * width; p < height * (chunk + 1) / num_chunks * width; p++) {
+			if (disparity_map[p] == invalid_val) {
+				continue;
+			}
+			int32_t root = p;
+			while (labels[root] >= 0) {
+				root = labels[root];
+			}
+			if (static_cast<uint32_t>(-labels[root]) < min_speckle_aera) {
+				disparity_map[p] = invalid_val;
+			}
+		}
+	});
 }
 
 void SemiGlobalMatching::CostAggregation() 
@@ -611,39 +1458,158 @@ void SemiGlobalMatching::CostAggregation()
 	const auto& max_disparity = option_.max_disparity;
 	assert(max_disparity > min_disparity);
 
-	const int32_t size = width_ * height_ * (max_disparity - min_disparity);
-	if (size <= 0) {
+	const int32_t disp_range = max_disparity - min_disparity;
+	const size_t size = static_cast<size_t>(width_) * height_ * disp_range;
+	if (disp_range <= 0 || size == 0) {
 		return;
 	}
 
-	const auto& P1 = option_.p1;
-	const auto& P2_Int = option_.p2_init;
-
-	if (option_.num_paths == 4 || option_.num_paths == 8) {
-
-		CostAggregateLeftRight(img_left_, width_, height_, min_disparity, max_disparity, P1, P2_Int, cost_init_, cost_aggr_1_, true);
-		CostAggregateLeftRight(img_left_, width_, height_, min_disparity, max_disparity, P1, P2_Int, cost_init_, cost_aggr_2_, false);
-
-		CostAggregateUpDown(img_left_, width_, height_, min_disparity, max_disparity, P1, P2_Int, cost_init_, cost_aggr_3_, true);
-		CostAggregateUpDown(img_left_, width_, height_, min_disparity, max_disparity, P1, P2_Int, cost_init_, cost_aggr_4_, false);
+	const int32_t num_dirs = NumDirections(option_);
+	const int32_t num_chunks = num_path_chunks_;
+	const size_t buffer_size = PathBufferSize(width_, height_, disp_range, option_);
+	// An MGM pass depends on the whole previous line and runs as a single task.
+	const int32_t dir_tasks = option_.is_mgm ? 1 : num_chunks;
+
+	auto aggregate_chunk = [&](const int32_t& k, const int32_t& chunk, uint8_t* cost_aggr, uint16_t* cost_sum) {
+		uint8_t* path_buffer = path_buffer_ + (k * dir_tasks + chunk) * buffer_size;
+		if (option_.is_mgm) {
+			AggregateMgm(k, cost_aggr, cost_sum, path_buffer);
+			return;
+		}
+		const int32_t& dr = kPathDirections[k][0];
+		const int32_t& dc = kPathDirections[k][1];
+		const int32_t count = PathCount(width_, height_, dr);
+		AggregatePaths(dr, dc, cost_aggr, cost_sum, count * chunk / num_chunks, count * (chunk + 1) / num_chunks, path_buffer);
+	};
+
+	if (option_.is_low_memory) {
+		// Every path adds its Lr straight into cost_aggr_. Scanlines of one direction touch disjoint pixels,
+		// but two directions would race on the same sums, so the directions run one after another.
+		memset(cost_aggr_, 0, size * sizeof(uint16_t));
+		for (int32_t k = 0; k < num_dirs; k++) {
+			pool_->ParallelFor(dir_tasks, [&](int32_t chunk) {
+				aggregate_chunk(k, chunk, nullptr, cost_aggr_);
+			});
+		}
+		return;
 	}
 
-	if (option_.num_paths == 8) {
+	// Directions and the scanlines within a direction are independent, each task runs one chunk of one direction.
+	pool_->ParallelFor(num_dirs * dir_tasks, [&](int32_t task) {
+		const int32_t k = task / dir_tasks;
+		aggregate_chunk(k, task % dir_tasks, cost_aggr_paths_[k], nullptr);
+	});
+
+	const bool is_wide = option_.cost_storage == sgm_kernels::CostStorage::Uint16;
+	pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+		const size_t begin = size * chunk / num_chunks;
+		const size_t end = size * (chunk + 1) / num_chunks;
+		if (is_wide) {
+			SumPathCosts(reinterpret_cast<uint16_t* const*>(cost_aggr_paths_), num_dirs, begin, end, cost_aggr_);
+		}
+		else {
+			SumPathCosts(cost_aggr_paths_, num_dirs, begin, end, cost_aggr_);
+		}
+	});
+}
 
-		CostAggregateDagonal_1(img_left_, width_, height_, min_disparity, max_disparity, P1, P2_Int, cost_init_, cost_aggr_5_, true);
-		CostAggregateDagonal_1(img_left_, width_, height_, min_disparity, max_disparity, P1, P2_Int, cost_init_, cost_aggr_6_, false);
+void SemiGlobalMatching::AggregateMgm(const int32_t& pass, uint8_t* cost_aggr, uint16_t* cost_sum, uint8_t* path_buffer)
+{
+	switch (option_.cost_storage) {
+	case sgm_kernels::CostStorage::Uint16:
+		CostAggregateMgm<sgm_kernels::CostStorage::Uint16>(pass, reinterpret_cast<uint16_t*>(cost_aggr), cost_sum, path_buffer);
+		break;
+	case sgm_kernels::CostStorage::Packed6:
+		CostAggregateMgm<sgm_kernels::CostStorage::Packed6>(pass, cost_aggr, cost_sum, path_buffer);
+		break;
+	default:
+		CostAggregateMgm<sgm_kernels::CostStorage::Uint8>(pass, cost_aggr, cost_sum, path_buffer);
+		break;
+	}
+}
 
-		CostAggregateDagonal_2(img_left_, width_, height_, min_disparity, max_disparity, P1, P2_Int, cost_init_, cost_aggr_7_, true);
-		CostAggregateDagonal_2(img_left_, width_, height_, min_disparity, max_disparity, P1, P2_Int, cost_init_, cost_aggr_8_, false);
+template <sgm_kernels::CostStorage S>
+void SemiGlobalMatching::CostAggregateMgm(const int32_t& pass, typename sgm_kernels::StorageTraits<S>::PathCost* cost_aggr,
+	uint16_t* cost_sum, uint8_t* path_buffer)
+{
+	typedef typename sgm_kernels::StorageTraits<S>::PathCost PathCost;
+	const PathCost max_cost = std::numeric_limits<PathCost>::max();
+	const int32_t width = width_;
+	const int32_t height = height_;
+	const int32_t disp_range = option_.max_disparity - option_.min_disparity;
+	const size_t cost_bytes = sgm_kernels::CostBytes(S, disp_range);
+	const auto aggr_step_mgm = sgm_kernels::SelectAggregateStepMgm<PathCost>(option_.is_use_simd);
+	const auto& P1 = p1_;
+	const auto& P2_Init = p2_init_;
+
+	const MgmSweep sweep(kPathDirections[pass][0], kPathDirections[pass][1]);
+	const int32_t num_lines = sweep.is_column ? width : height;
+	const int32_t line_length = sweep.is_column ? height : width;
+	const size_t line_stride = sweep.is_column ? 1 : width;
+	const size_t pos_stride = sweep.is_column ? width : 1;
+
+	// Lr of every pixel of the previous and the current line with a max_cost sentinel on each side, then their minima.
+	const int32_t slot = disp_range + 2;
+	PathCost* lines[2] = { reinterpret_cast<PathCost*>(path_buffer), reinterpret_cast<PathCost*>(path_buffer) + line_length * slot };
+	PathCost* mins[2] = { lines[1] + line_length * slot, lines[1] + line_length * slot + line_length };
+	uint8_t* unpacked = reinterpret_cast<uint8_t*>(mins[1] + line_length);
+	for (int32_t k = 0; k < 2 * line_length; k++) {
+		lines[0][k * slot] = lines[0][k * slot + disp_range + 1] = max_cost;
 	}
 
+	for (int32_t n = 0; n < num_lines; n++) {
+		const int32_t line = (sweep.line_step > 0) ? n : num_lines - 1 - n;
+		PathCost* cur = lines[n & 1];
+		PathCost* mins_cur = mins[n & 1];
+		const PathCost* last = lines[(n + 1) & 1];
+		const PathCost* mins_last = mins[(n + 1) & 1];
+
+		for (int32_t m = 0; m < line_length; m++) {
+			const int32_t pos = (sweep.pos_step > 0) ? m : line_length - 1 - m;
+			const size_t pixel = line * line_stride + pos * pos_stride;
+			const uint8_t gray = img_left_[pixel];
+			const uint8_t* cost = cost_init_ + pixel * cost_bytes;
+			if (sgm_kernels::StorageTraits<S>::kIsPacked) {
+				sgm_kernels::UnpackCosts(cost, disp_range, unpacked);
+				cost = unpacked;
+			}
 
-	for (int32_t i = 0; i < size; i++) {
-		if (option_.num_paths == 4 || option_.num_paths == 8) {
-			cost_aggr_[i] = cost_aggr_1_[i] + cost_aggr_2_[i] + cost_aggr_3_[i] + cost_aggr_4_[i];
-		}
-		if (option_.num_paths == 8) {
-			cost_aggr_[i] += cost_aggr_5_[i] + cost_aggr_6_[i] + cost_aggr_7_[i] + cost_aggr_8_[i];
+			// Lr(p-x) with its sentinels, its minimum and the adapted P2 of predecessor x, false outside the image.
+			auto predecessor = [&](const int32_t& line_x, const int32_t& pos_x, const PathCost*& lr, PathCost& min, int32_t& p2) {
+				const int32_t q = pos - pos_x;
+				if (q < 0 || q >= line_length || (line_x != 0 && n == 0)) {
+					return false;
+				}
+				lr = ((line_x == 0) ? cur : last) + q * slot;
+				min = ((line_x == 0) ? mins_cur : mins_last)[q];
+				const uint8_t gray_last = img_left_[(line - line_x) * line_stride + q * pos_stride];
+				p2 = std::max(P1, P2_Init / (abs(gray - gray_last) + 1));
+				return true;
+			};
+			const PathCost* lr_a = nullptr;
+			const PathCost* lr_b = nullptr;
+			PathCost min_a = 0, min_b = 0;
+			int32_t p2_a = 0, p2_b = 0;
+			const bool has_a = predecessor(sweep.line_a, sweep.pos_a, lr_a, min_a, p2_a);
+			const bool has_b = predecessor(sweep.line_b, sweep.pos_b, lr_b, min_b, p2_b);
+
+			PathCost* lr = cur + pos * slot + 1;
+			PathCost min_cost = max_cost;
+			if (has_a && has_b) {
+				min_cost = aggr_step_mgm(cost, lr_a, lr_b, lr, disp_range, P1, p2_a, p2_b, min_a, min_b);
+			}
+			else if (has_a) {
+				min_cost = aggr_step_mgm(cost, lr_a, lr_a, lr, disp_range, P1, p2_a, p2_a, min_a, min_a);
+			}
+			else if (has_b) {
+				min_cost = aggr_step_mgm(cost, lr_b, lr_b, lr, disp_range, P1, p2_b, p2_b, min_b, min_b);
+			}
+			else {
+				std::copy(cost, cost + disp_range, lr);
+				min_cost = *std::min_element(lr, lr + disp_range);
+			}
+			mins_cur[pos] = min_cost;
+			StorePathCost(lr, pixel * disp_range, disp_range, cost_aggr, cost_sum);
 		}
 	}
 }
@@ -657,302 +1623,1113 @@ void SemiGlobalMatching::ComputeDisparity()
 		return;
 	}
 
-	// ӰӲͼ
-	const auto disparity = disp_left_;
-	// Ӱۺϴ
-	const auto cost_ptr = cost_aggr_;
+	const int32_t width = width_;
+	const int32_t height = height_;
+	// The decimated LR check brings its own right disparities.
+	const bool is_check_lr = option_.is_check_lr && right_ref_ == nullptr;
+	const bool is_confidence = option_.confidence != sgm_kernels::ConfidenceMeasure::None;
+	const bool is_right_view = is_check_lr || option_.confidence == sgm_kernels::ConfidenceMeasure::LeftRightDifference;
+
+	const int32_t num_chunks = num_path_chunks_;
+	pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+		// Right view: cost_right(j, d) = cost_left(j + d, d), taken from the same row while it is still in cache.
+		uint16_t* right_min = right_cost_ + static_cast<size_t>(chunk) * 11 * width;
+		uint16_t* right_sec_min = right_min + width;
+		uint16_t* right_best = right_sec_min + width;
+		uint16_t* scratch = right_best + width;
+		uint16_t* wta_row = is_confidence ? wta_rows_ + static_cast<size_t>(chunk) * 5 * width : nullptr;
+
+		for (int32_t i = height * chunk / num_chunks; i < height * (chunk + 1) / num_chunks; i++) {
+			const uint16_t* cost_row = cost_aggr_ + static_cast<size_t>(i) * width * disp_range;
+			for (int32_t j = 0; j < width; j++) {
+				sgm_kernels::WtaResult wta;
+				wta_(cost_row + static_cast<size_t>(j) * disp_range, disp_range, wta);
+				disp_left_[i * width + j] = SubpixelDisparity(min_disparity + wta.best, wta.min_cost, wta.sec_min_cost,
+					true, wta.cost_prev, true, wta.cost_next);
+				if (is_confidence) {
+					wta_row[j] = wta.min_cost;
+					wta_row[width + j] = wta.sec_min_cost;
+					wta_row[2 * width + j] = static_cast<uint16_t>(wta.best);
+					wta_row[3 * width + j] = wta.cost_prev;
+					wta_row[4 * width + j] = wta.cost_next;
+				}
+			}
+
+			if (is_right_view) {
+				wta_right_(cost_row, width, disp_range, min_disparity, scratch, right_min, right_sec_min, right_best);
+			}
+			if (is_confidence) {
+				ConfidenceRow(i, wta_row, is_right_view ? right_min : nullptr);
+			}
+			if (!is_check_lr) {
+				continue;
+			}
+			for (int32_t j = 0; j < width; j++) {
+				if (right_best[j] == UINT16_MAX) {
+					// No candidate inside the left image.
+					disp_right_[i * width + j] = INVALID_FLOAT;
+					continue;
+				}
+				// The neighbours are costs of the left pixels next to the match, UINT16_MAX outside the image.
+				const int32_t best = right_best[j];
+				const int32_t col_left = j + min_disparity + best;
+				const uint16_t cost_1 = (best > 0 && col_left - 1 >= 0) ? cost_row[static_cast<size_t>(col_left - 1) * disp_range + best - 1] : UINT16_MAX;
+				const uint16_t cost_2 = (best < disp_range - 1 && col_left + 1 < width) ? cost_row[static_cast<size_t>(col_left + 1) * disp_range + best + 1] : UINT16_MAX;
+				disp_right_[i * width + j] = SubpixelDisparity(min_disparity + best, right_min[j], right_sec_min[j], true, cost_1, true, cost_2);
+			}
+		}
+	});
+}
+
+void SemiGlobalMatching::ConfidenceRow(const int32_t& row, const uint16_t* wta_row, const uint16_t* right_min)
+{
+	const int32_t width = width_;
+	const int32_t& min_disparity = option_.min_disparity;
+	const sgm_kernels::ConfidenceMeasure measure = option_.confidence;
+	float* confidence = confidence_ + static_cast<size_t>(row) * width;
+	for (int32_t j = 0; j < width; j++) {
+		const int32_t min_cost = wta_row[j];
+		const int32_t sec_min_cost = wta_row[width + j];
+		const int32_t cost_prev = wta_row[3 * width + j];
+		const int32_t cost_next = wta_row[4 * width + j];
+		float value = 0.0f;
+		if (measure == sgm_kernels::ConfidenceMeasure::PeakRatio) {
+			value = (sec_min_cost > 0) ? static_cast<float>(sec_min_cost - min_cost) / sec_min_cost : 0.0f;
+		}
+		else if (measure == sgm_kernels::ConfidenceMeasure::Curvature) {
+			// No parabola at the ends of the range.
+			if (cost_prev != UINT16_MAX && cost_next != UINT16_MAX && cost_prev + cost_next > 0) {
+				value = static_cast<float>(cost_prev + cost_next - 2 * min_cost) / (cost_prev + cost_next);
+			}
+		}
+		else {
+			const int32_t col_right = j - min_disparity - wta_row[2 * width + j];
+			if (right_min != nullptr && col_right >= 0 && col_right < width && right_min[col_right] != UINT16_MAX) {
+				const int32_t margin = sec_min_cost - min_cost;
+				value = margin / (margin + abs(min_cost - right_min[col_right]) + 1.0f);
+			}
+		}
+		confidence[j] = value;
+	}
+}
 
+void SemiGlobalMatching::LRCheck()
+{
 	const int32_t width = width_;
 	const int32_t height = height_;
-	const bool is_check_unique = option_.is_check_unique;
-	const float uniqueness_ratio = option_.uniqueness_ratio;
+	const size_t stride = (width + 3) / 4;
+	lr_classes_.resize(stride * height);
+
+	std::atomic<int32_t> num_occlusions(0), num_mismatches(0);
+	const int32_t num_chunks = num_path_chunks_;
+	pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+		int32_t occlusions = 0, mismatches = 0;
+		for (int32_t i = height * chunk / num_chunks; i < height * (chunk + 1) / num_chunks; i++) {
+			int32_t row_occlusions, row_mismatches;
+			lr_check_row_(disp_left_ + i * width, disp_right_ + i * width, width, option_.lrcheck_thres,
+				lr_classes_.data() + i * stride, row_occlusions, row_mismatches);
+			occlusions += row_occlusions;
+			mismatches += row_mismatches;
+		}
+		num_occlusions += occlusions;
+		num_mismatches += mismatches;
+	});
+	stats_.num_occlusions = num_occlusions;
+	stats_.num_mismatches = num_mismatches;
+}
 
-	// Ϊ˼ӿȡЧʣѵصдֵ洢ֲ
-	std::vector<uint16_t> cost_local(disp_range);
+void SemiGlobalMatching::FillHolesInDispMap()
+{
+	const int32_t width = width_;
+	const int32_t height = height_;
+	const int32_t num_chunks = num_path_chunks_;
+	const size_t img_size = static_cast<size_t>(width) * height;
+	float* disp_ptr = disp_left_;
 
-	// ---ؼӲ
-	for (int32_t i = 0; i < height; i++) {
-		for (int32_t j = 0; j < width; j++) {
-			uint16_t min_cost = UINT16_MAX;
-			uint16_t sec_min_cost = UINT16_MAX;
-			int32_t best_disparity = 0;
-
-			// ---ӲΧڵдֵСֵӦӲֵ
-			for (int32_t d = min_disparity; d < max_disparity; d++) {
-				const int32_t d_idx = d - min_disparity;
-				const auto& cost = cost_local[d_idx] = cost_ptr[i * width * disp_range + j * disp_range + d_idx];
-				if (min_cost > cost) {
-					min_cost = cost;
-					best_disparity = d;
+	// Nearest valid disparity below each pixel (straight down, down-left, down-right) for the whole image,
+	// then per task two row sets for the directions above (the current row and the next one), the nearest
+	// to the left and right in the current row and its filled values.
+	const size_t task_size = 9 * static_cast<size_t>(width);
+	fill_nearest_.resize(3 * img_size + num_chunks * task_size);
+	float* below = fill_nearest_.data();
+	static const int32_t kFillCols[3] = { 0, -1, 1 };
+
+	for (int32_t k = 0; k < 3; k++) {
+		// Occlusions first (second smallest of the rays), then mismatches and finally whatever is still invalid (median).
+		// The first two passes take their pixels from the LR check.
+		if (k < 2 && !option_.is_check_lr) {
+			continue;
+		}
+		const uint8_t trg_class = (k == 0) ? sgm_kernels::kLrOccluded : sgm_kernels::kLrMismatched;
+
+		for (int32_t n = 0; n < 3; n++) {
+			float* plane = below + n * img_size;
+			std::fill(plane + img_size - width, plane + img_size, INVALID_FLOAT);
+			for (int32_t i = height - 2; i >= 0; i--) {
+				NearestFromRow(disp_ptr + (i + 1) * width, plane + (i + 1) * width, plane + i * width, width, kFillCols[n]);
+			}
+		}
+		// The rays above the first row of every other task, swept through the rows before it in the
+		// buffers of the first task.
+		float* rolling = below + 3 * img_size;
+		float* rolling_next = rolling + 3 * width;
+		std::fill(rolling, rolling + 3 * width, INVALID_FLOAT);
+		for (int32_t chunk = 1, i = 0; chunk < num_chunks; chunk++) {
+			for (; i < height * chunk / num_chunks; i++) {
+				for (int32_t n = 0; n < 3; n++) {
+					NearestFromRow(disp_ptr + i * width, rolling + n * width, rolling_next + n * width, width, -kFillCols[n]);
 				}
+				std::swap(rolling, rolling_next);
 			}
+			memcpy(below + 3 * img_size + chunk * task_size, rolling, 3 * width * sizeof(float));
+		}
 
-			if (is_check_unique) {
-				// ٱһΣСֵ
-				for (int32_t d = min_disparity; d < max_disparity; d++) {
-					if (d == best_disparity) {
-						// Сֵ
-						continue;
-					}
-					const auto& cost = cost_local[d - min_disparity];
-					sec_min_cost = std::min(sec_min_cost, cost);
+		pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+			float* above = below + 3 * img_size + chunk * task_size;
+			float* above_next = above + 3 * width;
+			float* left = above_next + 3 * width;
+			float* right = left + width;
+			float* values = right + width;
+			if (chunk == 0) {
+				std::fill(above, above + 3 * width, INVALID_FLOAT);
+			}
+			const int32_t row_begin = height * chunk / num_chunks;
+			const int32_t row_end = height * (chunk + 1) / num_chunks;
+
+			for (int32_t i = row_begin; i < row_end; i++) {
+				float* disp_row = disp_ptr + i * width;
+				const uint8_t* classes = lr_classes_.data() + static_cast<size_t>(i) * ((width + 3) / 4);
+				auto is_target = [&](const int32_t& j) {
+					return (k < 2) ? sgm_kernels::LrClassAt(classes, j) == trg_class : disp_row[j] == INVALID_FLOAT;
+				};
+				left[0] = right[width - 1] = INVALID_FLOAT;
+				for (int32_t j = 1; j < width; j++) {
+					left[j] = (disp_row[j - 1] != INVALID_FLOAT) ? disp_row[j - 1] : left[j - 1];
+				}
+				for (int32_t j = width - 2; j >= 0; j--) {
+					right[j] = (disp_row[j + 1] != INVALID_FLOAT) ? disp_row[j + 1] : right[j + 1];
 				}
 
-				// жΨһԼ
-				// (min-sec)/min < min*(1-uniquness)ΪЧ
-				if (sec_min_cost - min_cost <= static_cast<uint16_t>(min_cost * (1 - uniqueness_ratio))) {
-					disparity[i * width + j] = INVALID_FLOAT;
-					continue;
+				auto fill = [&](const int32_t& j) {
+					float slots[8];
+					const float rays[8] = { left[j], right[j], above[j], above[width + j], above[2 * width + j],
+						below[i * width + j], below[img_size + i * width + j], below[2 * img_size + i * width + j] };
+					int32_t count = 0;
+					for (auto& ray : rays) {
+						if (ray != INVALID_FLOAT) {
+							slots[count++] = ray;
+						}
+					}
+					if (count == 0) {
+						values[j] = INVALID_FLOAT;
+						return;
+					}
+					const int32_t rank = (k == 0) ? std::min(1, count - 1) : count / 2;
+					std::nth_element(slots, slots + rank, slots + count);
+					values[j] = slots[rank];
+				};
+
+				// The row is filled only after the rays through it moved on, so every pixel of a pass sees the same map.
+				for (int32_t j = 0; j < width; j++) {
+					if (is_target(j)) {
+						fill(j);
+					}
+				}
+				for (int32_t n = 0; n < 3; n++) {
+					NearestFromRow(disp_row, above + n * width, above_next + n * width, width, -kFillCols[n]);
+				}
+				std::swap(above, above_next);
+				for (int32_t j = 0; j < width; j++) {
+					if (is_target(j)) {
+						disp_row[j] = values[j];
+					}
 				}
 			}
+		});
+	}
+}
+bool SemiGlobalMatching::IsTemporal(const SGMOption& option)
+{
+	// The compact volumes have no incremental MGM pass, and a full one is slower than dense MGM.
+	return option.is_temporal && !option.is_mgm;
+}
 
-			// ---
-			if (best_disparity == min_disparity || best_disparity == max_disparity - 1) {
-				disparity[i * width + j] = INVALID_FLOAT;
-				continue;
+bool SemiGlobalMatching::IsPyramid(const int32_t& width, const int32_t& height, const SGMOption& option)
+{
+	// The coarse level still needs room for the census window. MGM stays dense: its passes cannot be split into
+	// chunks, and in the compact layout each of them would remap both predecessors of every pixel.
+	return option.num_pyramid_levels > 1 && !option.is_mgm && width / 2 >= 16 && height / 2 >= 16;
+}
+
+SemiGlobalMatching::SGMOption SemiGlobalMatching::CoarseOption(const SGMOption& option)
+{
+	SGMOption coarse = option;
+	coarse.num_pyramid_levels = option.num_pyramid_levels - 1;
+	// Coarse levels only run for frames without a previous one.
+	coarse.is_temporal = false;
+	coarse.min_disparity = (option.min_disparity >= 0) ? option.min_disparity / 2 : -((1 - option.min_disparity) / 2);
+	coarse.max_disparity = (option.max_disparity >= 0) ? (option.max_disparity + 1) / 2 : -((-option.max_disparity) / 2);
+	if (coarse.max_disparity <= coarse.min_disparity) {
+		coarse.max_disparity = coarse.min_disparity + 1;
+	}
+	return coarse;
+}
+
+bool SemiGlobalMatching::IsDecimatedLr(const int32_t& width, const int32_t& height, const SGMOption& option)
+{
+	return option.is_check_lr && option.is_decimated_lr && width / 2 >= 16 && height / 2 >= 16;
+}
+
+SemiGlobalMatching::SGMOption SemiGlobalMatching::RightReferenceOption(const SGMOption& option)
+{
+	// Right pixel x matching left x + d is the mirrored right pixel x' matching the mirrored left x' - d,
+	// so the disparity range stays and only the resolution halves. Only the raw disparities are needed.
+	SGMOption right = CoarseOption(option);
+	right.num_pyramid_levels = 1;
+	right.is_check_lr = false;
+	right.is_decimated_lr = false;
+	right.is_remove_speckles = false;
+	right.is_fill_holes = false;
+	right.median_window = 0;
+	return right;
+}
+
+void SemiGlobalMatching::MatchRightReference()
+{
+	const int32_t width = width_;
+	const int32_t height = height_;
+	const int32_t ref_width = width / 2;
+	const int32_t ref_height = height / 2;
+
+	Downsample(img_right_, width, height, img_ref_left_);
+	Downsample(img_left_, width, height, img_ref_right_);
+	for (int32_t i = 0; i < ref_height; i++) {
+		std::reverse(img_ref_left_ + i * ref_width, img_ref_left_ + (i + 1) * ref_width);
+		std::reverse(img_ref_right_ + i * ref_width, img_ref_right_ + (i + 1) * ref_width);
+	}
+	if (!right_ref_->Match(img_ref_left_, img_ref_right_, disp_ref_)) {
+		std::fill(disp_right_, disp_right_ + static_cast<size_t>(width) * height, INVALID_FLOAT);
+		return;
+	}
+
+	pool_->ParallelFor(num_path_chunks_, [&](int32_t chunk) {
+		for (int32_t i = height * chunk / num_path_chunks_; i < height * (chunk + 1) / num_path_chunks_; i++) {
+			const float* ref_row = disp_ref_ + std::min(i / 2, ref_height - 1) * ref_width;
+			for (int32_t j = 0; j < width; j++) {
+				const float disp = ref_row[ref_width - 1 - std::min(j / 2, ref_width - 1)];
+				disp_right_[i * width + j] = (disp == INVALID_FLOAT) ? INVALID_FLOAT : 2 * disp;
+			}
+		}
+	});
+}
+
+void SemiGlobalMatching::Downsample(const uint8_t* source, const int32_t& width, const int32_t& height, uint8_t* target)
+{
+	const int32_t target_width = width / 2;
+	const int32_t target_height = height / 2;
+	for (int32_t i = 0; i < target_height; i++) {
+		const uint8_t* row0 = source + static_cast<size_t>(2 * i) * width;
+		const uint8_t* row1 = row0 + width;
+		for (int32_t j = 0; j < target_width; j++) {
+			target[i * target_width + j] = static_cast<uint8_t>((row0[2 * j] + row0[2 * j + 1] + row1[2 * j] + row1[2 * j + 1] + 2) / 4);
+		}
+	}
+}
+
+bool SemiGlobalMatching::MatchPyramid()
+{
+	auto start = std::chrono::steady_clock::now();
+	const int32_t coarse_width = width_ / 2;
+	const int32_t coarse_height = height_ / 2;
+	Downsample(img_left_, width_, height_, img_coarse_left_);
+	Downsample(img_right_, width_, height_, img_coarse_right_);
+	if (!coarse_->Match(img_coarse_left_, img_coarse_right_, disp_coarse_)) {
+		return false;
+	}
+
+	BuildRanges(disp_coarse_, coarse_width, coarse_height, 2, option_.pyramid_margin);
+	if (option_.matching_cost == sgm_kernels::MatchingCost::MutualInformation) {
+		EstimateMutualInformation(img_left_, img_right_, disp_coarse_, coarse_width, coarse_height, 2);
+	}
+	stats_.pyramid_ms = ElapsedMs(start);
+	ComputeCompactCost(nullptr);
+	stats_.cost_ms = ElapsedMs(start);
+	CompactAggregation(nullptr);
+	stats_.aggregation_ms = ElapsedMs(start);
+	ComputeCompactDisparity();
+	stats_.wta_ms = ElapsedMs(start);
+	PostProcessing();
+	return true;
+}
+
+bool SemiGlobalMatching::MatchTemporal(const float* motion)
+{
+	auto start = std::chrono::steady_clock::now();
+	const int32_t width = width_;
+	const int32_t height = height_;
+
+	// disp_right_ is free until the disparity selection and takes the previous disparities moved by the hint.
+	const float* guide = disp_left_;
+	if (motion != nullptr) {
+		for (int32_t i = 0; i < height; i++) {
+			for (int32_t j = 0; j < width; j++) {
+				const size_t pixel = static_cast<size_t>(i) * width + j;
+				const int32_t x = static_cast<int32_t>(floor(j + motion[2 * pixel] + 0.5f));
+				const int32_t y = static_cast<int32_t>(floor(i + motion[2 * pixel + 1] + 0.5f));
+				disp_right_[pixel] = (x >= 0 && x < width && y >= 0 && y < height) ? disp_left_[static_cast<size_t>(y) * width + x] : INVALID_FLOAT;
 			}
-			// ӲǰһӲĴֵcost_1һӲĴֵcost_2
-			const int32_t idx_1 = best_disparity - 1 - min_disparity;
-			const int32_t idx_2 = best_disparity + 1 - min_disparity;
-			const uint16_t cost_1 = cost_local[idx_1];
-			const uint16_t cost_2 = cost_local[idx_2];
-			// һԪ߼ֵ
-			const uint16_t denom = std::max(1, cost_1 + cost_2 - 2 * min_cost);
-			disparity[i * width + j] = static_cast<float>(best_disparity) + static_cast<float>(cost_1 - cost_2) / (denom * 2.0f);
 		}
+		guide = disp_right_;
+	}
+	BuildRanges(guide, width, height, 1, option_.temporal_margin);
+	// The previous disparities are what the hierarchical estimation takes from a coarser level.
+	if (option_.matching_cost == sgm_kernels::MatchingCost::MutualInformation) {
+		EstimateMutualInformation(img_left_, img_right_, guide, width, height, 1);
+	}
+	stats_.pyramid_ms = ElapsedMs(start);
+	ComputeCompactCost(nullptr);
+	stats_.cost_ms = ElapsedMs(start);
+	CompactAggregation(nullptr);
+	stats_.aggregation_ms = ElapsedMs(start);
+
+	// Winners on the border of a narrowed range may lie beyond it: search them again over the full range, or the
+	// whole frame when the scene changed too much for the previous disparities.
+	const size_t limit = static_cast<size_t>(option_.temporal_fallback * width * height);
+	const size_t num_widened = WidenRanges(limit);
+	if (num_widened > limit) {
+		return false;
 	}
+	if (num_widened > 0) {
+		ComputeCompactCost(range_widened_);
+		stats_.cost_ms += ElapsedMs(start);
+		CompactAggregation(range_widened_);
+		stats_.aggregation_ms += ElapsedMs(start);
+	}
+	ComputeCompactDisparity();
+	stats_.wta_ms = ElapsedMs(start);
+	PostProcessing();
+	return true;
 }
 
-void SemiGlobalMatching::ComputeDisparityRight()
+size_t SemiGlobalMatching::WidenRanges(const size_t& limit)
 {
 	const int32_t& min_disparity = option_.min_disparity;
 	const int32_t& max_disparity = option_.max_disparity;
-	const int32_t disp_range = max_disparity - min_disparity;
-	if (disp_range <= 0) {
-		return;
+	const size_t img_size = static_cast<size_t>(width_) * height_;
+	auto is_on_border = [&](const size_t& pixel, const size_t& offset, const size_t& size) {
+		const uint16_t* cost = compact_cost_aggr_ + offset;
+		const size_t best = std::min_element(cost, cost + size) - cost;
+		return (best == 0 && range_begin_[pixel] > min_disparity) ||
+			(best == size - 1 && range_begin_[pixel] + static_cast<int32_t>(size) < max_disparity);
+	};
+
+	const size_t disp_range = max_disparity - min_disparity;
+	size_t count = 0;
+	size_t growth = 0;
+	for (size_t pixel = 0; pixel < img_size && count <= limit; pixel++) {
+		const size_t size = range_offset_[pixel + 1] - range_offset_[pixel];
+		range_widened_[pixel] = is_on_border(pixel, range_offset_[pixel], size) ? 1 : 0;
+		count += range_widened_[pixel];
+		growth += range_widened_[pixel] ? disp_range - size : 0;
+	}
+	if (count == 0 || count > limit) {
+		return count;
 	}
 
-	// ӰӲͼ
-	const auto disparity = disp_right_;
-	// Ӱۺϴ
-	const auto cost_ptr = cost_aggr_;
+	const size_t old_total = range_offset_[img_size];
+	const size_t total = old_total + growth;
+	ReserveCompact(total, old_total);
+
+	// The new offsets are laid out in place from the back, the old ones of a pixel are read before they are
+	// overwritten. Between two widened pixels the costs and Lr all move by the same amount.
+	const int32_t num_dirs = NumDirections(option_);
+	const size_t path_cost_bytes = sgm_kernels::PathCostBytes(option_.cost_storage);
+	auto move_run = [&](const size_t& run_begin, const size_t& run_end, const size_t& shift) {
+		if (shift == 0 || run_begin == run_end) {
+			return;
+		}
+		memmove(compact_cost_init_ + run_begin + shift, compact_cost_init_ + run_begin, run_end - run_begin);
+		for (int32_t k = 0; k < num_dirs; k++) {
+			uint8_t* cost_path = compact_cost_paths_ + k * compact_capacity_ * path_cost_bytes;
+			memmove(cost_path + (run_begin + shift) * path_cost_bytes, cost_path + run_begin * path_cost_bytes,
+				(run_end - run_begin) * path_cost_bytes);
+		}
+	};
+	size_t next = total;
+	size_t old_next = old_total;
+	size_t run_end = old_total;
+	range_offset_[img_size] = total;
+	for (size_t pixel = img_size; pixel-- > 0;) {
+		const size_t old_offset = range_offset_[pixel];
+		size_t size = old_next - old_offset;
+		if (range_widened_[pixel]) {
+			move_run(old_next, run_end, next - old_next);
+			run_end = old_offset;
+			range_begin_[pixel] = min_disparity;
+			size = disp_range;
+		}
+		next -= size;
+		range_offset_[pixel] = next;
+		old_next = old_offset;
+	}
+	return count;
+}
+
+SemiGlobalMatching::SGMOption SemiGlobalMatching::RegionOption(const SGMOption& option)
+{
+	// Only the disparities of a region are returned, and its windows are no video.
+	SGMOption region = option;
+	region.confidence = sgm_kernels::ConfidenceMeasure::None;
+	region.is_temporal = false;
+	return region;
+}
+
+SemiGlobalMatching::Region SemiGlobalMatching::RegionWindow(const Region& region) const
+{
+	// Left pixel x is compared with right pixels x - max_disparity + 1 to x - min_disparity.
+	const int32_t margin = std::max(0, option_.region_margin);
+	const int32_t x_begin = std::max(0, region.x - margin - std::max(0, option_.max_disparity - 1));
+	const int32_t x_end = std::min(width_, region.x + region.width + margin + std::max(0, -option_.min_disparity));
+	const int32_t y_begin = std::max(0, region.y - margin);
+	const int32_t y_end = std::min(height_, region.y + region.height + margin);
+	return Region(x_begin, y_begin, x_end - x_begin, y_end - y_begin);
+}
+
+bool SemiGlobalMatching::MatchWindow(const uint8_t* img_left, const uint8_t* img_right, const Region& window)
+{
+	const size_t size = static_cast<size_t>(window.width) * window.height;
+	if (size > region_capacity_) {
+		SAFE_DELETE(img_region_left_);
+		SAFE_DELETE(img_region_right_);
+		SAFE_DELETE(disp_region_);
+		region_capacity_ = size;
+		img_region_left_ = new uint8_t[region_capacity_]();
+		img_region_right_ = new uint8_t[region_capacity_]();
+		disp_region_ = new float[region_capacity_]();
+	}
+	for (int32_t i = 0; i < window.height; i++) {
+		const size_t offset = static_cast<size_t>(window.y + i) * width_ + window.x;
+		memcpy(img_region_left_ + i * window.width, img_left + offset, window.width);
+		memcpy(img_region_right_ + i * window.width, img_right + offset, window.width);
+	}
+
+	// Reset() keeps the buffers of the largest window so far, repeated queries of one size skip it.
+	if (region_ == nullptr) {
+		region_ = new SemiGlobalMatching();
+		region_->pool_ = pool_;
+		if (!region_->Initialize(window.width, window.height, RegionOption(option_))) {
+			return false;
+		}
+	}
+	else if (!region_->is_initialized_ || region_->width_ != window.width || region_->height_ != window.height) {
+		if (!region_->Reset(window.width, window.height, RegionOption(option_))) {
+			return false;
+		}
+	}
+	if (!region_->Match(img_region_left_, img_region_right_, disp_region_)) {
+		return false;
+	}
+
+	const MatchStats& window_stats = region_->stats_;
+	stats_.cost_ms += window_stats.cost_ms;
+	stats_.aggregation_ms += window_stats.aggregation_ms;
+	stats_.wta_ms += window_stats.wta_ms;
+	stats_.lr_check_ms += window_stats.lr_check_ms;
+	stats_.speckle_ms += window_stats.speckle_ms;
+	stats_.fill_ms += window_stats.fill_ms;
+	stats_.median_ms += window_stats.median_ms;
+	stats_.pyramid_ms += window_stats.pyramid_ms;
+	stats_.num_occlusions += window_stats.num_occlusions;
+	stats_.num_mismatches += window_stats.num_mismatches;
+	return true;
+}
+
+bool SemiGlobalMatching::MatchRegion(const uint8_t* img_left, const uint8_t* img_right, const Region& region, float* disp_region)
+{
+	if (!is_initialized_ || img_left == nullptr || img_right == nullptr || disp_region == nullptr) {
+		return false;
+	}
+	if (region.width <= 0 || region.height <= 0 || region.x < 0 || region.y < 0 ||
+		region.x + region.width > width_ || region.y + region.height > height_) {
+		return false;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	stats_ = MatchStats();
+	const Region window = RegionWindow(region);
+	if (!MatchWindow(img_left, img_right, window)) {
+		return false;
+	}
+	for (int32_t i = 0; i < region.height; i++) {
+		memcpy(disp_region + i * region.width, disp_region_ + (region.y - window.y + i) * window.width + (region.x - window.x),
+			region.width * sizeof(float));
+	}
+	stats_.total_ms = ElapsedMs(start);
+	UpdateMemoryStats();
+	return true;
+}
+
+bool SemiGlobalMatching::MatchPoints(const uint8_t* img_left, const uint8_t* img_right, const Point* points, const int32_t& count,
+	float* disparities)
+{
+	if (!is_initialized_ || img_left == nullptr || img_right == nullptr || count < 0 || (count > 0 && (points == nullptr || disparities == nullptr))) {
+		return false;
+	}
+	for (int32_t k = 0; k < count; k++) {
+		if (points[k].x < 0 || points[k].y < 0 || points[k].x >= width_ || points[k].y >= height_) {
+			return false;
+		}
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	stats_ = MatchStats();
+
+	// Points are taken by rows, and the next one joins the current window as long as the grown window is
+	// no larger than the two windows apart.
+	point_order_.resize(count);
+	point_windows_.clear();
+	point_ends_.clear();
+	for (int32_t k = 0; k < count; k++) {
+		point_order_[k] = k;
+	}
+	std::sort(point_order_.begin(), point_order_.end(), [points](const int32_t& a, const int32_t& b) {
+		return points[a].y < points[b].y || (points[a].y == points[b].y && points[a].x < points[b].x);
+	});
+	auto window_size = [this](const Region& region) {
+		const Region window = RegionWindow(region);
+		return static_cast<size_t>(window.width) * window.height;
+	};
+	size_t total_size = 0;
+	Region all_bounds;
+	int32_t first = 0;
+	while (first < count) {
+		const Point& start_point = points[point_order_[first]];
+		Region bounds(start_point.x, start_point.y, 1, 1);
+		int32_t last = first + 1;
+		for (; last < count; last++) {
+			const Point& point = points[point_order_[last]];
+			const int32_t x_begin = std::min(bounds.x, point.x);
+			const int32_t x_end = std::max(bounds.x + bounds.width, point.x + 1);
+			const Region grown(x_begin, bounds.y, x_end - x_begin, point.y + 1 - bounds.y);
+			if (window_size(grown) > window_size(bounds) + window_size(Region(point.x, point.y, 1, 1))) {
+				break;
+			}
+			bounds = grown;
+		}
+
+		point_windows_.push_back(RegionWindow(bounds));
+		point_ends_.push_back(last);
+		total_size += window_size(bounds);
+		if (first == 0) {
+			all_bounds = bounds;
+		}
+		else {
+			const int32_t x_begin = std::min(all_bounds.x, bounds.x);
+			const int32_t x_end = std::max(all_bounds.x + all_bounds.width, bounds.x + bounds.width);
+			all_bounds = Region(x_begin, all_bounds.y, x_end - x_begin, bounds.y + bounds.height - all_bounds.y);
+		}
+		first = last;
+	}
+
+	// Scattered points would match more than the one window around all of them (at most the frame).
+	if (point_windows_.size() > 1 && total_size >= window_size(all_bounds)) {
+		point_windows_.assign(1, RegionWindow(all_bounds));
+		point_ends_.assign(1, count);
+	}
+	first = 0;
+	for (size_t w = 0; w < point_windows_.size(); w++) {
+		const Region& window = point_windows_[w];
+		if (!MatchWindow(img_left, img_right, window)) {
+			return false;
+		}
+		for (int32_t k = first; k < point_ends_[w]; k++) {
+			const Point& point = points[point_order_[k]];
+			disparities[point_order_[k]] = disp_region_[(point.y - window.y) * window.width + (point.x - window.x)];
+		}
+		first = point_ends_[w];
+	}
+	stats_.total_ms = ElapsedMs(start);
+	UpdateMemoryStats();
+	return true;
+}
 
+void SemiGlobalMatching::BuildRanges(const float* guide, const int32_t& guide_width, const int32_t& guide_height,
+	const int32_t& scale, const int32_t& margin)
+{
+	const int32_t& min_disparity = option_.min_disparity;
+	const int32_t& max_disparity = option_.max_disparity;
 	const int32_t width = width_;
 	const int32_t height = height_;
-	const bool is_check_unique = option_.is_check_unique;
-	const float uniqueness_ratio = option_.uniqueness_ratio;
 
-	// Ϊ˼ӿȡЧʣѵصдֵ洢ֲ
-	std::vector<uint16_t> cost_local(disp_range);
-
-	// ---ؼӲ
-	// ͨӰĴۣȡӰĴ
-	// cost(xr,yr,d) = cost(xr+d,yl,d)
+	size_t offset = 0;
 	for (int32_t i = 0; i < height; i++) {
+		const int32_t gi = std::min(i / scale, guide_height - 1);
 		for (int32_t j = 0; j < width; j++) {
-			uint16_t min_cost = UINT16_MAX;
-			uint16_t sec_min_cost = UINT16_MAX;
-			int32_t best_disparity = 0;
-
-			// ---ͳƺѡӲµĴֵ
-			for (int32_t d = min_disparity; d < max_disparity; d++) {
-				const int32_t d_idx = d - min_disparity;
-				const int32_t col_left = j + d;
-				if (col_left >= 0 && col_left < width) {
-					const auto& cost = cost_local[d_idx] = cost_ptr[i * width * disp_range + col_left * disp_range + d_idx];
-					if (min_cost > cost) {
-						min_cost = cost;
-						best_disparity = d;
+			const int32_t gj = std::min(j / scale, guide_width - 1);
+
+			// Disparities of the 3x3 guide neighbourhood, so a pixel next to an edge may take either side.
+			float lo = std::numeric_limits<float>::max();
+			float hi = -std::numeric_limits<float>::max();
+			for (int32_t r = std::max(0, gi - 1); r <= std::min(guide_height - 1, gi + 1); r++) {
+				for (int32_t c = std::max(0, gj - 1); c <= std::min(guide_width - 1, gj + 1); c++) {
+					const float disp = guide[r * guide_width + c];
+					if (disp != INVALID_FLOAT) {
+						lo = std::min(lo, disp);
+						hi = std::max(hi, disp);
 					}
 				}
-				else {
-					cost_local[d_idx] = UINT16_MAX;
-				}
 			}
 
-			if (is_check_unique) {
-				// ٱһΣСֵ
-				for (int32_t d = min_disparity; d < max_disparity; d++) {
-					if (d == best_disparity) {
-						// Сֵ
-						continue;
-					}
-					const auto& cost = cost_local[d - min_disparity];
-					sec_min_cost = std::min(sec_min_cost, cost);
+			int32_t begin = min_disparity;
+			int32_t end = max_disparity;
+			if (lo <= hi) {
+				begin = std::max(min_disparity, static_cast<int32_t>(floor(lo * scale)) - margin);
+				end = std::min(max_disparity, static_cast<int32_t>(ceil(hi * scale)) + margin + 1);
+				if (end <= begin) {
+					// Guide outside the search range, search everything.
+					begin = min_disparity;
+					end = max_disparity;
 				}
-
-				// жΨһԼ
-				// (min-sec)/min < min*(1-uniquness)ΪЧ
-				if (sec_min_cost - min_cost <= static_cast<uint16_t>(min_cost * (1 - uniqueness_ratio))) {
-					disparity[i * width + j] = INVALID_FLOAT;
-					continue;
-				}
-			}
-
-			// ---
-			if (best_disparity == min_disparity || best_disparity == max_disparity - 1) {
-				disparity[i * width + j] = INVALID_FLOAT;
-				continue;
 			}
 
-			// ӲǰһӲĴֵcost_1һӲĴֵcost_2
-			const int32_t idx_1 = best_disparity - 1 - min_disparity;
-			const int32_t idx_2 = best_disparity + 1 - min_disparity;
-			const uint16_t cost_1 = cost_local[idx_1];
-			const uint16_t cost_2 = cost_local[idx_2];
-			// һԪ߼ֵ
-			const uint16_t denom = std::max(1, cost_1 + cost_2 - 2 * min_cost);
-			disparity[i * width + j] = static_cast<float>(best_disparity) + static_cast<float>(cost_1 - cost_2) / (denom * 2.0f);
+			const size_t pixel = static_cast<size_t>(i) * width + j;
+			range_begin_[pixel] = begin;
+			range_offset_[pixel] = offset;
+			offset += end - begin;
 		}
 	}
+	range_offset_[static_cast<size_t>(width) * height] = offset;
+	ReserveCompact(offset, 0);
 }
 
-void SemiGlobalMatching::LRCheck()
+void SemiGlobalMatching::ReserveCompact(const size_t& size, const size_t& kept)
 {
-	const int width = width_;
-	const int height = height_;
-
-	const float& threshold = option_.lrcheck_thres;
-
-	// ڵغƥ
-	auto& occlusions = occlusions_;
-	auto& mismatches = mismatches_;
-	occlusions.clear();
-	mismatches.clear();
+	// The compact volumes only grow, with some headroom for the next frames and the full lanes CompactStep() reads.
+	if (size + sgm_kernels::kCompactStepLanes > compact_capacity_) {
+		const int32_t num_dirs = NumDirections(option_);
+		const size_t path_cost_bytes = sgm_kernels::PathCostBytes(option_.cost_storage);
+		const size_t capacity = size + size / 4 + sgm_kernels::kCompactStepLanes;
+		uint8_t* cost_init = new uint8_t[capacity]();
+		uint8_t* cost_paths = new uint8_t[num_dirs * capacity * path_cost_bytes]();
+		if (kept > 0) {
+			memcpy(cost_init, compact_cost_init_, kept);
+			for (int32_t k = 0; k < num_dirs; k++) {
+				memcpy(cost_paths + k * capacity * path_cost_bytes, compact_cost_paths_ + k * compact_capacity_ * path_cost_bytes,
+					kept * path_cost_bytes);
+			}
+		}
+		SAFE_DELETE(compact_cost_init_);
+		SAFE_DELETE(compact_cost_aggr_);
+		SAFE_DELETE(compact_cost_paths_);
+		compact_capacity_ = capacity;
+		compact_cost_init_ = cost_init;
+		compact_cost_aggr_ = new uint16_t[compact_capacity_]();
+		compact_cost_paths_ = cost_paths;
+	}
+}
 
-	// ---һԼ
-	for (int i = 0; i < height; i++) {
-		for (int j = 0; j < width; j++) {
+void SemiGlobalMatching::ComputeCompactCost(const uint8_t* widened)
+{
+	if (sgm_kernels::CensusBits(option_.census_type) > 32) {
+		ComputeCompactMatchingCost<uint64_t>(census_row64_, widened);
+	}
+	else {
+		ComputeCompactMatchingCost<uint32_t>(census_row_, widened);
+	}
+}
 
-			// ӰӲֵ
-			auto& disp = disp_left_[i * width + j];
+template <typename Census>
+void SemiGlobalMatching::ComputeCompactMatchingCost(sgm_kernels::CensusRowFunc<Census> census_row, const uint8_t* widened)
+{
+	const int32_t width = width_;
+	const int32_t height = height_;
 
-			if (disp == INVALID_FLOAT) {
-				mismatches.emplace_back(i, j);
+	const sgm_kernels::CensusType census_type = option_.census_type;
+	const bool is_mi = option_.matching_cost == sgm_kernels::MatchingCost::MutualInformation;
+	const bool is_combined = !is_mi && option_.matching_cost != sgm_kernels::MatchingCost::Census;
+	const auto hamming_segment = sgm_kernels::SelectHammingSegment<Census>();
+	const int32_t num_chunks = num_path_chunks_;
+	pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+		Census* census_row_left = reinterpret_cast<Census*>(census_left_ + static_cast<size_t>(chunk) * width);
+		Census* census_row_right = reinterpret_cast<Census*>(census_right_ + static_cast<size_t>(chunk) * width);
+		uint8_t* term_left = cost_terms_ + static_cast<size_t>(chunk) * 2 * width;
+		uint8_t* term_right = term_left + width;
+		for (int32_t i = height * chunk / num_chunks; i < height * (chunk + 1) / num_chunks; i++) {
+			if (widened != nullptr && memchr(widened + static_cast<size_t>(i) * width, 1, width) == nullptr) {
 				continue;
 			}
-
-			// ӲֵҵӰ϶Ӧͬ
-			const auto col_right = static_cast<int32_t>(j - disp + 0.5);
-
-			if (col_right >= 0 && col_right < width) {
-
-				// ӰͬصӲֵ
-				const auto& disp_r = disp_right_[i * width + col_right];
-
-				// жӲֵǷһ£ֵֵڣ
-				if (abs(disp - disp_r) > threshold) {
-					// ڵƥ
-					// ͨӰӲӰƥأȡӲdisp_rl
-					// if(disp_rl > disp) 
-					//		pixel in occlusions
-					// else 
-					//		pixel in mismatches
-					const int32_t col_rl = static_cast<int32_t>(col_right + disp_r + 0.5);
-					if (col_rl > 0 && col_rl < width) {
-						const auto& disp_l = disp_left_[i * width + col_rl];
-						if (disp_l > disp) {
-							occlusions.emplace_back(i, j);
-						}
-						else {
-							mismatches.emplace_back(i, j);
+			if (is_mi) {
+				memcpy(term_left, img_left_ + static_cast<size_t>(i) * width, width);
+				memcpy(term_right, img_right_ + static_cast<size_t>(i) * width, width);
+			}
+			else {
+				census_row(img_left_, width, height, i, census_type, census_row_left);
+				census_row(img_right_, width, height, i, census_type, census_row_right);
+				// Mirrored, so the candidates of consecutive disparities follow each other.
+				std::reverse(census_row_right, census_row_right + width);
+			}
+			if (is_combined) {
+				CostTermRow(img_left_, height, i, term_left);
+				CostTermRow(img_right_, height, i, term_right);
+			}
+			for (int32_t j = 0; j < width; j++) {
+				const size_t pixel = static_cast<size_t>(i) * width + j;
+				if (widened != nullptr && widened[pixel] == 0) {
+					continue;
+				}
+				const int32_t begin = range_begin_[pixel];
+				const int32_t end = begin + static_cast<int32_t>(range_offset_[pixel + 1] - range_offset_[pixel]);
+				uint8_t* cost = compact_cost_init_ + range_offset_[pixel];
+
+				// Disparities [d_lo, d_hi) match inside the image.
+				const int32_t d_lo = std::min(std::max(begin, j - width + 1), end);
+				const int32_t d_hi = std::max(std::min(end, j + 1), d_lo);
+				std::fill(cost, cost + (d_lo - begin), UINT8_MAX);
+				std::fill(cost + (d_hi - begin), cost + (end - begin), UINT8_MAX);
+				if (is_mi) {
+					for (int32_t d = d_lo; d < d_hi; d++) {
+						cost[d - begin] = mi_cost_[term_left[j] * 256 + term_right[j - d]];
+					}
+				}
+				else {
+					hamming_segment(census_row_left[j], census_row_right + (width - 1 - j + d_lo), cost + (d_lo - begin), d_hi - d_lo);
+					if (is_combined) {
+						for (int32_t d = d_lo; d < d_hi; d++) {
+							cost[d - begin] = static_cast<uint8_t>(census_lut_[cost[d - begin]] + term_lut_[std::min(abs(term_left[j] - term_right[j - d]), 63)]);
 						}
 					}
-					else {
-						mismatches.emplace_back(i, j);
+				}
+				if (!cost_scale_.empty()) {
+					for (int32_t k = 0; k < end - begin; k++) {
+						cost[k] = cost_scale_[cost[k]];
 					}
-
-					// ӲֵЧ
-					disp = INVALID_FLOAT;
 				}
 			}
+		}
+	});
+}
+
+void SemiGlobalMatching::CompactAggregation(const uint8_t* widened)
+{
+	const size_t total = range_offset_[static_cast<size_t>(width_) * height_];
+	const int32_t disp_range = option_.max_disparity - option_.min_disparity;
+	const int32_t num_dirs = NumDirections(option_);
+	const int32_t num_chunks = num_path_chunks_;
+	const size_t buffer_size = PathBufferSize(width_, height_, disp_range, option_);
+
+	// Every direction keeps its Lr in its own compact volume and sweeps the image row by row, so the previous
+	// pixel of a path is always in an earlier row (or column) of that volume. The rows of a horizontal
+	// direction are split into chunks, the other directions are one task each. MGM never gets here, see IsTemporal().
+	int32_t num_tasks = 0;
+	int32_t task_dir[kMaxPaths * 64];
+	int32_t task_chunk[kMaxPaths * 64];
+	for (int32_t k = 0; k < num_dirs; k++) {
+		const int32_t count = (kPathDirections[k][0] == 0) ? std::min(num_chunks, 64) : 1;
+		for (int32_t chunk = 0; chunk < count; chunk++) {
+			task_dir[num_tasks] = k;
+			task_chunk[num_tasks] = (count == 1) ? -1 : chunk;
+			num_tasks++;
+		}
+	}
+	// Packed storage only applies to the dense volume, the compact paths are 16-bit for Uint16 and 8-bit otherwise.
+	const bool is_wide = option_.cost_storage == sgm_kernels::CostStorage::Uint16;
+	uint16_t* compact_paths_wide = reinterpret_cast<uint16_t*>(compact_cost_paths_);
+	const int32_t num_row_chunks = std::min(num_chunks, 64);
+	pool_->ParallelFor(num_tasks, [&](int32_t task) {
+		const int32_t k = task_dir[task];
+		const int32_t chunk = task_chunk[task];
+		const int32_t row_begin = (chunk < 0) ? 0 : height_ * chunk / num_row_chunks;
+		const int32_t row_end = (chunk < 0) ? height_ : height_ * (chunk + 1) / num_row_chunks;
+		uint8_t* path_buffer = path_buffer_ + task * buffer_size;
+		if (is_wide) {
+			CompactAggregatePaths(kPathDirections[k][0], kPathDirections[k][1], row_begin, row_end, widened,
+				compact_paths_wide + k * compact_capacity_, path_buffer);
+		}
+		else {
+			CompactAggregatePaths(kPathDirections[k][0], kPathDirections[k][1], row_begin, row_end, widened,
+				compact_cost_paths_ + k * compact_capacity_, path_buffer);
+		}
+	});
+
+	pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+		const size_t begin = total * chunk / num_chunks;
+		const size_t end = total * (chunk + 1) / num_chunks;
+		memset(compact_cost_aggr_ + begin, 0, (end - begin) * sizeof(uint16_t));
+		for (int32_t k = 0; k < num_dirs; k++) {
+			if (is_wide) {
+				sgm_kernels::AccumulateCost(compact_cost_aggr_ + begin, compact_paths_wide + k * compact_capacity_ + begin,
+					static_cast<int32_t>(end - begin));
+			}
 			else {
-				// ͨӲֵӰҲͬأӰΧ
-				disp = INVALID_FLOAT;
-				mismatches.emplace_back(i, j);
+				sgm_kernels::AccumulateCost(compact_cost_aggr_ + begin, compact_cost_paths_ + k * compact_capacity_ + begin,
+					static_cast<int32_t>(end - begin));
 			}
 		}
-	}
+	});
 }
 
-void SemiGlobalMatching::FillHolesInDispMap()
+template <typename PathCost>
+void SemiGlobalMatching::CompactAggregatePaths(const int32_t& dr, const int32_t& dc, const int32_t& row_begin, const int32_t& row_end,
+	const uint8_t* widened, PathCost* cost_path, uint8_t* path_buffer)
 {
 	const int32_t width = width_;
 	const int32_t height = height_;
+	const int32_t disp_range = option_.max_disparity - option_.min_disparity;
+	const auto& P1 = p1_;
+	const auto& P2_Init = p2_init_;
+	const PathCost max_cost = std::numeric_limits<PathCost>::max();
+	const auto aggr_step = sgm_kernels::SelectAggregateStep<PathCost>(option_.is_use_simd);
+	const auto compact_step = sgm_kernels::SelectCompactStep(option_.is_use_simd);
+	const bool is_byte_path = (sizeof(PathCost) == 1);
+	const int32_t* range_begin = range_begin_;
+	const size_t* range_offset = range_offset_;
+	const uint8_t* cost_init = compact_cost_init_;
+	const uint8_t* img_left = img_left_;
+
+	// The adapted P2 for each gray level difference, the steps are too short to divide every time.
+	int32_t p2_lut[256];
+	for (int32_t diff = 0; diff < 256; diff++) {
+		p2_lut[diff] = std::max(P1, P2_Init / (diff + 1));
+	}
 
-	std::vector<float> disp_collects;
+	// Lr(p-r) remapped onto the range of p with a neighbour on each side. Disparities p-r did not search
+	// count as max_cost, like the border sentinels.
+	PathCost* cost_remap = reinterpret_cast<PathCost*>(path_buffer);
+	// Lr(p) before a refresh computes it again.
+	PathCost* cost_before = cost_remap + disp_range + 2;
+	// min(Lr) of the pixels of the last three rows, row n of the sweep at (n % 3) * width, and whether their Lr changed.
+	PathCost* mincost_rows = cost_before + disp_range + 2;
+	uint8_t* changed_rows = reinterpret_cast<uint8_t*>(mincost_rows + 3 * width);
+
+	auto start_path = [&](const size_t& pixel) {
+		const int32_t size = static_cast<int32_t>(range_offset_[pixel + 1] - range_offset_[pixel]);
+		PathCost* cost = cost_path + range_offset_[pixel];
+		const uint8_t* cost_init = compact_cost_init_ + range_offset_[pixel];
+		std::copy(cost_init, cost_init + size, cost);
+		PathCost min_cost = max_cost;
+		for (int32_t k = 0; k < size; k++) {
+			min_cost = std::min(min_cost, cost[k]);
+		}
+		return min_cost;
+	};
+	auto step_path = [&](const size_t& pixel, const size_t& pixel_last, const PathCost& mincost_last_path) {
+		const size_t offset = range_offset[pixel];
+		const size_t last_offset = range_offset[pixel_last];
+		const int32_t begin = range_begin[pixel];
+		const int32_t size = static_cast<int32_t>(range_offset[pixel + 1] - offset);
+		const int32_t last_begin = range_begin[pixel_last];
+		const int32_t last_size = static_cast<int32_t>(range_offset[pixel_last + 1] - last_offset);
+		const int32_t p2 = p2_lut[abs(img_left[pixel] - img_left[pixel_last])];
+
+		// Short ranges of 8-bit costs (temporal mode) skip the remap. The volumes are padded for the full lanes, which
+		// must not reach into the next row: another task may sweep it.
+		if (is_byte_path && size <= sgm_kernels::kCompactStepLanes && last_size <= sgm_kernels::kCompactStepLanes &&
+			offset + sgm_kernels::kCompactStepLanes <= range_offset[(pixel / width + 1) * width]) {
+			return static_cast<PathCost>(compact_step(cost_init + offset, reinterpret_cast<const uint8_t*>(cost_path + last_offset),
+				begin - last_begin, last_size, reinterpret_cast<uint8_t*>(cost_path + offset), size, P1, p2,
+				static_cast<uint8_t>(mincost_last_path)));
+		}
 
-	// 8
-	float pi = 3.1415926;
-	float angle1[8] = { pi, 3 * pi / 4, pi / 2, pi / 4, 0, 7 * pi / 4, 3 * pi / 2, 5 * pi / 4 };
-	float angle2[8] = { pi, 5 * pi / 4, 3 * pi / 2, 7 * pi / 4, 0, pi / 4, pi / 2, 3 * pi / 4 };
-	float* angle = angle1;
+		RemapPathCost(cost_path + last_offset, last_begin, last_size, begin, size, cost_remap);
+		return aggr_step(cost_init + offset, cost_remap, cost_path + offset, size, P1, p2, mincost_last_path);
+	};
+
+	// A refresh after WidenRanges() computes Lr(p) again only when p was widened or Lr(p-r) changed, every other Lr
+	// is still in place. Both return whether Lr(p) was computed (and may differ), mincost is only set then; the
+	// min(Lr) of an unchanged pixel is looked up when its successor needs it.
+	const bool is_refresh = (widened != nullptr);
+	auto refresh_start = [&](const size_t& pixel, PathCost& mincost) {
+		if (is_refresh && widened[pixel] == 0) {
+			return false;
+		}
+		mincost = start_path(pixel);
+		return true;
+	};
+	auto refresh_step = [&](const size_t& pixel, const size_t& pixel_last, const bool& is_changed_last, const PathCost& mincost_last,
+		PathCost& mincost) {
+		if (!is_refresh) {
+			mincost = step_path(pixel, pixel_last, mincost_last);
+			return true;
+		}
+		const bool is_widened = (widened[pixel] != 0);
+		if (!is_widened && !is_changed_last) {
+			return false;
+		}
+		PathCost min_last = mincost_last;
+		if (!is_changed_last) {
+			const PathCost* cost_last = cost_path + range_offset[pixel_last];
+			min_last = *std::min_element(cost_last, cost_last + (range_offset[pixel_last + 1] - range_offset[pixel_last]));
+		}
+		PathCost* cost = cost_path + range_offset[pixel];
+		const size_t size = range_offset[pixel + 1] - range_offset[pixel];
+		if (!is_widened) {
+			std::copy(cost, cost + size, cost_before);
+		}
+		mincost = step_path(pixel, pixel_last, min_last);
+		return is_widened || !std::equal(cost, cost + size, cost_before);
+	};
+
+	if (dr == 0) {
+		for (int32_t i = row_begin; i < row_end; i++) {
+			const size_t row = static_cast<size_t>(i) * width;
+			const int32_t col_begin = (dc > 0) ? 0 : width - 1;
+			PathCost mincost_last_path = max_cost;
+			bool is_changed_last = refresh_start(row + col_begin, mincost_last_path);
+			for (int32_t j = col_begin + dc; j >= 0 && j < width; j += dc) {
+				is_changed_last = refresh_step(row + j, row + j - dc, is_changed_last, mincost_last_path, mincost_last_path);
+			}
+		}
+		return;
+	}
 
-	float* disp_ptr = disp_left_;
-	for (int k = 0; k < 3; k++) {
-		// һѭڵڶѭƥ
-		auto& trg_pixels = (k == 0) ? occlusions_ : mismatches_;
-
-		std::vector<std::pair<int, int>> inv_pixels;
-		if (k == 2) {
-			//  ѭǰûдɾ
-			for (int i = 0; i < height; i++) {
-				for (int j = 0; j < width; j++) {
-					if (disp_ptr[i * width + j] == INVALID_FLOAT) {
-						inv_pixels.emplace_back(i, j);
-					}
-				}
+	// Vertical, diagonal and knight-move paths continue |dr| rows back, wrapping around the left/right border
+	// like CostAggregatePaths(). The first |dr| rows start paths.
+	const int32_t first_row = (dr > 0) ? 0 : height - 1;
+	const int32_t back = abs(dr);
+	for (int32_t n = 0; n < height; n++) {
+		const int32_t i = first_row + ((dr > 0) ? n : -n);
+		const size_t row = static_cast<size_t>(i) * width;
+		PathCost* mincost_cur_row = mincost_rows + (n % 3) * width;
+		uint8_t* changed_cur_row = changed_rows + (n % 3) * width;
+		if (n < back) {
+			for (int32_t j = 0; j < width; j++) {
+				changed_cur_row[j] = refresh_start(row + j, mincost_cur_row[j]) ? 1 : 0;
 			}
-			trg_pixels = inv_pixels;
+			continue;
 		}
+		const size_t row_last = static_cast<size_t>(i - dr) * width;
+		const PathCost* mincost_last_row = mincost_rows + ((n - back) % 3) * width;
+		const uint8_t* changed_last_row = changed_rows + ((n - back) % 3) * width;
+		for (int32_t j = 0; j < width; j++) {
+			int32_t j_last = j - dc;
+			if (j_last < 0) {
+				j_last += width;
+			}
+			else if (j_last >= width) {
+				j_last -= width;
+			}
+			changed_cur_row[j] = refresh_step(row + j, row_last + j_last, changed_last_row[j_last] != 0, mincost_last_row[j_last],
+				mincost_cur_row[j]) ? 1 : 0;
+		}
+	}
+}
 
-		// 
-		for (auto& pix : trg_pixels) {
-			int y = pix.first;
-			int x = pix.second;
+bool SemiGlobalMatching::CompactCost(const size_t& pixel, const int32_t& disparity, uint16_t& cost) const
+{
+	const int32_t index = disparity - range_begin_[pixel];
+	if (index < 0 || static_cast<size_t>(index) >= range_offset_[pixel + 1] - range_offset_[pixel]) {
+		return false;
+	}
+	cost = compact_cost_aggr_[range_offset_[pixel] + index];
+	return true;
+}
 
-			if (y == height / 2) {
-				angle = angle2;
+void SemiGlobalMatching::ComputeCompactDisparity()
+{
+	const int32_t& min_disparity = option_.min_disparity;
+	const int32_t width = width_;
+	const int32_t height = height_;
+	const bool is_check_lr = option_.is_check_lr && right_ref_ == nullptr;
+	const bool is_confidence = option_.confidence != sgm_kernels::ConfidenceMeasure::None;
+	const bool is_right_view = is_check_lr || option_.confidence == sgm_kernels::ConfidenceMeasure::LeftRightDifference;
+	const bool is_sec_min = option_.is_check_unique || option_.confidence == sgm_kernels::ConfidenceMeasure::PeakRatio ||
+		option_.confidence == sgm_kernels::ConfidenceMeasure::LeftRightDifference;
+
+	const int32_t num_chunks = num_path_chunks_;
+	pool_->ParallelFor(num_chunks, [&](int32_t chunk) {
+		// Right view: every left candidate (j, d) is the right candidate (j - d, d), scattered into per-row minima.
+		uint16_t* right_min = right_cost_ + static_cast<size_t>(chunk) * 2 * width;
+		uint16_t* right_sec_min = right_min + width;
+		int32_t* right_best = right_best_ + static_cast<size_t>(chunk) * width;
+		uint16_t* wta_row = is_confidence ? wta_rows_ + static_cast<size_t>(chunk) * 5 * width : nullptr;
+
+		for (int32_t i = height * chunk / num_chunks; i < height * (chunk + 1) / num_chunks; i++) {
+			if (is_right_view) {
+				std::fill(right_min, right_min + 2 * width, UINT16_MAX);
+				std::fill(right_best, right_best + width, min_disparity - 1);
 			}
 
-			// ռ8׸ЧӲֵ
-			disp_collects.clear();
-			for (int32_t n = 0; n < 8; n++) {
-				const float ang = angle[n];
-				const float sina = sin(ang);
-				const float cosa = cos(ang);
-				for (int32_t n = 1; ; n++) {
-					const int32_t yy = y + n * sina;
-					const int32_t xx = x + n * cosa;
-					if (yy < 0 || yy >= height || xx < 0 || xx >= width) {
-						break;
+			for (int32_t j = 0; j < width; j++) {
+				const size_t pixel = static_cast<size_t>(i) * width + j;
+				const int32_t begin = range_begin_[pixel];
+				const int32_t size = static_cast<int32_t>(range_offset_[pixel + 1] - range_offset_[pixel]);
+				const uint16_t* cost = compact_cost_aggr_ + range_offset_[pixel];
+
+				uint16_t min_cost = UINT16_MAX;
+				uint16_t sec_min_cost = UINT16_MAX;
+				int32_t best = 0;
+				for (int32_t k = 0; k < size; k++) {
+					if (min_cost > cost[k]) {
+						min_cost = cost[k];
+						best = k;
 					}
-					auto& disp = *(disp_ptr + yy * width + xx);
-					if (disp != INVALID_FLOAT) {
-						disp_collects.push_back(disp);
-						break;
+					if (is_right_view) {
+						const int32_t col_right = j - begin - k;
+						if (col_right >= 0 && col_right < width) {
+							if (cost[k] < right_min[col_right]) {
+								right_sec_min[col_right] = right_min[col_right];
+								right_min[col_right] = cost[k];
+								right_best[col_right] = begin + k;
+							}
+							else {
+								right_sec_min[col_right] = std::min(right_sec_min[col_right], cost[k]);
+							}
+						}
 					}
 				}
+				if (is_sec_min) {
+					for (int32_t k = 0; k < size; k++) {
+						if (k != best) {
+							sec_min_cost = std::min(sec_min_cost, cost[k]);
+						}
+					}
+				}
+				disp_left_[pixel] = SubpixelDisparity(begin + best, min_cost, sec_min_cost,
+					best > 0, cost[std::max(best - 1, 0)], best < size - 1, cost[std::min(best + 1, size - 1)]);
+				if (is_confidence) {
+					wta_row[j] = min_cost;
+					wta_row[width + j] = sec_min_cost;
+					wta_row[2 * width + j] = static_cast<uint16_t>(begin + best - min_disparity);
+					wta_row[3 * width + j] = (best > 0) ? cost[best - 1] : UINT16_MAX;
+					wta_row[4 * width + j] = (best < size - 1) ? cost[best + 1] : UINT16_MAX;
+				}
 			}
-			if (disp_collects.empty()) {
+
+			if (is_confidence) {
+				ConfidenceRow(i, wta_row, is_right_view ? right_min : nullptr);
+			}
+			if (!is_check_lr) {
 				continue;
 			}
-
-			std::sort(disp_collects.begin(), disp_collects.end());
-
-			// ڵѡڶСӲֵ
-			// ƥѡֵ
-			if (k == 0) {
-				if (disp_collects.size() > 1) {
-					disp_ptr[y * width + x] = disp_collects[1];
-				}
-				else {
-					disp_ptr[y * width + x] = disp_collects[0];
+			for (int32_t j = 0; j < width; j++) {
+				const int32_t best_disparity = right_best[j];
+				if (best_disparity < min_disparity) {
+					disp_right_[i * width + j] = INVALID_FLOAT;
+					continue;
 				}
-			}
-			else {
-				disp_ptr[y * width + x] = disp_collects[disp_collects.size() / 2];
+				uint16_t cost_1 = 0, cost_2 = 0;
+				const size_t pixel = static_cast<size_t>(i) * width + j + best_disparity;
+				const bool has_1 = j + best_disparity - 1 >= 0 && CompactCost(pixel - 1, best_disparity - 1, cost_1);
+				const bool has_2 = j + best_disparity + 1 < width && CompactCost(pixel + 1, best_disparity + 1, cost_2);
+				disp_right_[i * width + j] = SubpixelDisparity(best_disparity, right_min[j], right_sec_min[j], has_1, cost_1, has_2, cost_2);
 			}
 		}
+	});
+}
+
+float SemiGlobalMatching::SubpixelDisparity(const int32_t& best_disparity, const uint16_t& min_cost, const uint16_t& sec_min_cost,
+	const bool& has_cost_1, const uint16_t& cost_1, const bool& has_cost_2, const uint16_t& cost_2) const
+{
+	if (option_.is_check_unique) {
+		if (sec_min_cost - min_cost <= static_cast<uint16_t>(min_cost * (1 - option_.uniqueness_ratio))) {
+			return INVALID_FLOAT;
+		}
 	}
-}
\ No newline at end of file
+
+	// No neighbour on one side: the search range ends there.
+	if (best_disparity == option_.min_disparity || best_disparity == option_.max_disparity - 1 || !has_cost_1 || !has_cost_2) {
+		return INVALID_FLOAT;
+	}
+	const uint16_t denom = std::max(1, cost_1 + cost_2 - 2 * min_cost);
+	return static_cast<float>(best_disparity) + static_cast<float>(cost_1 - cost_2) / (denom * 2.0f);
+}
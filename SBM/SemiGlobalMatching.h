@@ -1,7 +1,12 @@
 #pragma once
+#include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <limits>
 #include <vector>
+#include "SGMKernels.h"
+
+class ThreadPool;
 
 #ifndef INVALID_FLOAT
 #define INVALID_FLOAT std::numeric_limits<float>::infinity()
@@ -16,7 +21,8 @@ public:
 
 
 	struct SGMOption {
-		uint8_t	num_paths;			
+		uint8_t	num_paths;			// 4, 8 or 16 (knight moves added), other counts fail Initialize()
+		bool	is_mgm;				// More-Global Matching: num_paths (4 or 8) passes that each join two predecessors
 		int32_t  min_disparity;		
 		int32_t	max_disparity;		
 
@@ -25,21 +31,44 @@ public:
 
 		bool	is_check_lr;		
 		float	lrcheck_thres;		
+		bool	is_decimated_lr;	// check against a right-reference match at half resolution instead of the right WTA of the left costs
 
 		bool	is_remove_speckles;	
 		int		min_speckle_aera;	
 
 		bool	is_fill_holes;		
+		int32_t	median_window;		// window size of the final median filter, < 3 = off
+
+		bool	is_use_simd;		// SSE4.1/AVX2 aggregation kernels when the CPU supports them
+		int32_t	num_threads;		// worker threads including the caller, 0 = one per hardware thread
+		bool	is_low_memory;		// add each path straight into cost_aggr_ instead of keeping 8 path volumes
+		sgm_kernels::CostStorage cost_storage;	// element types of the matching and path cost volumes
+		sgm_kernels::CensusType census_type;	// census window of the matching costs
+		sgm_kernels::MatchingCost matching_cost;	// cost function, see sgm_kernels::MatchingCost
+		sgm_kernels::ConfidenceMeasure confidence;	// per-pixel confidence computed with the disparities, None = off
+
+		int32_t	num_pyramid_levels;	// > 1: match at half resolution first and search only around that result, ignored by MGM
+		int32_t	pyramid_margin;		// disparities searched beyond the upsampled coarse neighbourhood
+		int32_t	region_margin;		// support rows and columns matched around the areas of MatchRegion() and MatchPoints()
+
+		bool	is_temporal;		// video: search each pixel only around the disparities of the previous match, see SetMotionHint(). Ignored by MGM
+		int32_t	temporal_margin;	// disparities searched beyond the previous 3x3 neighbourhood
+		float	temporal_fallback;	// fraction of pixels whose winner may fall on the border of its narrowed range before the frame is matched over the full range
 
 
 		int32_t  p1;				
 		int32_t  p2_init;		
 
-		SGMOption() : num_paths(8), min_disparity(0), max_disparity(640),
+		SGMOption() : num_paths(8), is_mgm(false), min_disparity(0), max_disparity(640),
 			is_check_unique(true), uniqueness_ratio(0.95f),
-			is_check_lr(true), lrcheck_thres(1.0f),
+			is_check_lr(true), lrcheck_thres(1.0f), is_decimated_lr(false),
 			is_remove_speckles(true), min_speckle_aera(20),
-			is_fill_holes(true),
+			is_fill_holes(true), median_window(3),
+			is_use_simd(true), num_threads(1), is_low_memory(false), cost_storage(sgm_kernels::CostStorage::Uint8),
+			census_type(sgm_kernels::CensusType::Census5x5), matching_cost(sgm_kernels::MatchingCost::Census),
+			confidence(sgm_kernels::ConfidenceMeasure::None),
+			num_pyramid_levels(1), pyramid_margin(3), region_margin(32),
+			is_temporal(false), temporal_margin(2), temporal_fallback(0.1f),
 			p1(10), p2_init(150)
 		{
 		}
@@ -50,60 +79,317 @@ public:
 
 	bool Match(const uint8_t* img_left, const uint8_t* img_right, float* disp_left);
 
+	// Match() that also copies the confidence map of option.confidence, which must not be None.
+	bool Match(const uint8_t* img_left, const uint8_t* img_right, float* disp_left, float* confidence);
+
+	// One rectified pair of a stream, both images of the size passed to Initialize().
+	struct StereoFrame {
+		const uint8_t* img_left;
+		const uint8_t* img_right;
+		const float* motion;		// temporal mode: motion since the previous frame, see SetMotionHint()
+		StereoFrame() : img_left(nullptr), img_right(nullptr), motion(nullptr) {}
+	};
+	// Fills in the next frame, returns false at the end of the stream.
+	typedef std::function<bool(StereoFrame& frame)> FrameSource;
+	// Receives the disparity map of frame 'index', valid until the sink returns.
+	typedef std::function<void(const int64_t& index, const float* disp_left)> FrameSink;
+
+	// Matches frames until the source runs dry. Buffers stay allocated between frames and the cost
+	// volume of frame N+1 is computed while frame N aggregates, so frame N+1 is requested before frame N
+	// is delivered: its images must stay valid until its own disparity map reached the sink.
+	bool MatchStream(const FrameSource& source, const FrameSink& sink);
+
+	// Temporal mode: motion of the next match, width * height (dx, dy) pairs saying that left pixel (x, y) was at
+	// (x + dx, y + dy) in the previous frame. Used by one match and read there, nullptr = static camera.
+	void SetMotionHint(const float* motion) { motion_ = motion; }
+
+	// Temporal mode: the next match has no previous frame and searches the full range, e.g. after a cut.
+	void ClearHistory() { has_history_ = false; }
+
+	// Reuses the existing buffers when the new size fits into them.
 	bool Reset(const uint32_t& width, const uint32_t& height, const SGMOption& option);
 
-private:
-	static inline uint8_t Hamming32(const uint32_t& x, const uint32_t& y)
-	{
-		uint32_t dist = 0, val = x ^ y;
-
-		// Count the number of set bits
-		while (val) {
-			++dist;
-			val &= val - 1;
+	// Path costs carried across the top and bottom border when a taller image is matched in horizontal strips.
+	// Downward paths enter from the row above the image and upward paths from the row below, the cost buffers
+	// hold SeamPathCount() rows of width * disp_range path costs (sgm_kernels::PathCostBytes() each): |dr| rows
+	// for every non-horizontal direction of that side, the row next to the strip first. MGM passes are not
+	// carried, their strips rely on the overlap alone.
+	struct PathSeam {
+		const uint8_t* enter_top;		// Lr of the downward paths on the row above, nullptr = image border
+		const uint8_t* gray_top;		// left image row above
+		const uint8_t* enter_bottom;	// Lr of the upward paths on the row below, nullptr = image border
+		const uint8_t* gray_bottom;		// left image row below
+		int32_t leave_top_row;			// row whose upward Lr is stored into leave_top (with the rows below it for |dr| > 1)
+		uint8_t* leave_top;
+		int32_t leave_bottom_row;		// row whose downward Lr is stored into leave_bottom (with the rows above it for |dr| > 1)
+		uint8_t* leave_bottom;
+		int32_t rows_above;				// image rows readable before / after the strip, for the census window
+		int32_t rows_below;
+
+		PathSeam() : enter_top(nullptr), gray_top(nullptr), enter_bottom(nullptr), gray_bottom(nullptr),
+			leave_top_row(-1), leave_top(nullptr), leave_bottom_row(-1), leave_bottom(nullptr), rows_above(0), rows_below(0)
+		{
+		}
+	};
+
+	// Path rows per seam, 0 when the paths of the option are not carried.
+	static int32_t SeamPathCount(const SGMOption& option);
+
+	// Match() with the paths continued from / handed on to the neighbouring strips.
+	bool MatchStrip(const uint8_t* img_left, const uint8_t* img_right, float* disp_left, const PathSeam& seam);
+
+	// Only the cost volume and the upward paths, to fill seam.leave_top for the strip above.
+	bool AggregateUpward(const uint8_t* img_left, const uint8_t* img_right, const PathSeam& seam);
+
+	// Rectangle of image pixels.
+	struct Region {
+		int32_t x;
+		int32_t y;
+		int32_t width;
+		int32_t height;
+		Region() : x(0), y(0), width(0), height(0) {}
+		Region(const int32_t& x, const int32_t& y, const int32_t& width, const int32_t& height) : x(x), y(y), width(width), height(height) {}
+	};
+
+	struct Point {
+		int32_t x;
+		int32_t y;
+	};
+
+	// Disparities of one region of the pair, region.width * region.height values into disp_region. Only a window
+	// is matched: the region widened by option.region_margin on every side and by the columns its disparity range
+	// reads from the right image, so the time follows the region instead of the image. The paths start at the
+	// window border, pixels closer to it than they reach may differ from Match(). Stats() cover the window,
+	// the disparity and confidence maps of the last Match() stay as they are.
+	bool MatchRegion(const uint8_t* img_left, const uint8_t* img_right, const Region& region, float* disp_region);
+
+	// Disparities at 'count' points, see MatchRegion(). Points close enough share one window, and points scattered so
+	// widely that their windows would cover more than one window around all of them are matched in that one.
+	bool MatchPoints(const uint8_t* img_left, const uint8_t* img_right, const Point* points, const int32_t& count, float* disparities);
+
+	// Bytes Initialize() allocates for this size and option (without the MatchStream() back buffer and the region matcher).
+	static size_t RequiredMemory(const int32_t& width, const int32_t& height, const SGMOption& option);
+
+	// Wall time per stage of the last match (for streams: of the frame last handed to the sink), the memory
+	// held and the pixels the LR check invalidated. Census and matching costs are computed row by row
+	// together and timed as one stage. Disabled stages report zero.
+	struct MatchStats {
+		double	cost_ms;			// census transform and matching costs
+		double	aggregation_ms;
+		double	wta_ms;				// left and right disparity selection
+		double	lr_check_ms;
+		double	speckle_ms;
+		double	fill_ms;
+		double	median_ms;
+		double	pyramid_ms;			// hierarchical mode: coarser levels and search ranges
+		double	total_ms;
+
+		size_t	cost_init_bytes;	// matching cost volumes
+		size_t	cost_aggr_bytes;	// summed aggregated costs
+		size_t	path_bytes;			// per-direction Lr volumes and path buffers
+		size_t	buffer_bytes;		// disparity maps, census rows, right-view rows and scratch
+		size_t	total_bytes;		// all of the above, coarser levels included
+
+		int32_t	num_occlusions;
+		int32_t	num_mismatches;
+		int32_t	num_full_range;		// temporal mode: pixels searched over the full range, all of them without history or after a fallback
+
+		MatchStats() : cost_ms(0), aggregation_ms(0), wta_ms(0), lr_check_ms(0), speckle_ms(0), fill_ms(0), median_ms(0),
+			pyramid_ms(0), total_ms(0), cost_init_bytes(0), cost_aggr_bytes(0), path_bytes(0), buffer_bytes(0), total_bytes(0),
+			num_occlusions(0), num_mismatches(0), num_full_range(0)
+		{
 		}
+	};
+
+	const MatchStats& Stats() const { return stats_; }
+
+	// Confidence map of the last match (for streams: of the frame at the sink), nullptr when option.confidence is None.
+	const float* Confidence() const { return (option_.confidence != sgm_kernels::ConfidenceMeasure::None) ? confidence_ : nullptr; }
+
+	// Summed aggregated costs of image rows [row, row + rows) of the last match, width * disp_range per row in the
+	// order of the cost volume. The hierarchical mode fills the disparities it did not search with UINT16_MAX.
+	bool CostSlice(const int32_t& row, const int32_t& rows, uint16_t* costs) const;
+
+private:
+	// Aggregation directions (MGM: passes) of the option, 0 for an unsupported path count.
+	static int32_t NumDirections(const SGMOption& option);
+
+	static int32_t PathCount(const int32_t& width, const int32_t& height, const int32_t& dr);
+
+	// First seam row of direction (dr, dc) among the num_dirs directions.
+	static int32_t SeamSlot(const int32_t& num_dirs, const int32_t& dr, const int32_t& dc);
+
+	// Bytes of path_buffer_ per aggregation task and the number of tasks, for the dense or the hierarchical mode.
+	static size_t PathBufferSize(const int32_t& width, const int32_t& height, const int32_t& disp_range, const SGMOption& option);
+	static size_t PathTaskCount(const int32_t& width, const int32_t& height, const SGMOption& option, const int32_t& num_chunks);
+
+	template <sgm_kernels::CostStorage S>
+	void CostAggregatePaths(const uint8_t* img_data, const int32_t& width, const int32_t& height, const int32_t& min_disparity, const int32_t& max_disparity,
+		const int32_t& p1, const int32_t& p2_init, const uint8_t* cost_init, typename sgm_kernels::StorageTraits<S>::PathCost* cost_aggr,
+		const int32_t& dr, const int32_t& dc, uint16_t* cost_sum, const int32_t& path_begin, const int32_t& path_end, uint8_t* path_buffer);
+
+	// Paths [path_begin, path_end) of direction (dr, dc) with the kernels of option_.cost_storage, cost_aggr
+	// holds path costs of that type.
+	void AggregatePaths(const int32_t& dr, const int32_t& dc, uint8_t* cost_aggr, uint16_t* cost_sum,
+		const int32_t& path_begin, const int32_t& path_end, uint8_t* path_buffer);
 
-		return static_cast<uint8_t>(dist);
-	}
+	// MGM pass 'pass' over the whole image, predecessors p - a and p - b with a = kPathDirections[pass] and b the
+	// same turned by 90 degrees. Missing predecessors at the border leave a single path or the plain matching cost.
+	template <sgm_kernels::CostStorage S>
+	void CostAggregateMgm(const int32_t& pass, typename sgm_kernels::StorageTraits<S>::PathCost* cost_aggr, uint16_t* cost_sum, uint8_t* path_buffer);
 
-	void CostAggregateLeftRight(const uint8_t* img_data, const int32_t& width, const int32_t& height, const int32_t& min_disparity, const int32_t& max_disparity,
-		const int32_t& p1, const int32_t& p2_init, const uint8_t* cost_init, uint8_t* cost_aggr, bool is_forward);
-	
-	void CostAggregateUpDown(const uint8_t* img_data, const int32_t& width, const int32_t& height, const int32_t& min_disparity, const int32_t& max_disparity,
-		const int32_t& p1, const int32_t& p2_init, const uint8_t* cost_init, uint8_t* cost_aggr, bool is_forward = true);
+	void AggregateMgm(const int32_t& pass, uint8_t* cost_aggr, uint16_t* cost_sum, uint8_t* path_buffer);
 
-	void CostAggregateDagonal_1(const uint8_t* img_data, const int32_t& width, const int32_t& height, const int32_t& min_disparity, const int32_t& max_disparity,
-		const int32_t& p1, const int32_t& p2_init, const uint8_t* cost_init, uint8_t* cost_aggr, bool is_forward = true);
+	template <typename PathCost>
+	static void StorePathCost(const PathCost* cost_path, const size_t& offset, const int32_t& disp_range, PathCost* cost_aggr, uint16_t* cost_sum);
 
-	void CostAggregateDagonal_2(const uint8_t* img_data, const int32_t& width, const int32_t& height, const int32_t& min_disparity, const int32_t& max_disparity,
-		const int32_t& p1, const int32_t& p2_init, const uint8_t* cost_init, uint8_t* cost_aggr, bool is_forward = true);
+	// Penalties of the aggregation and the matching cost rescaling that keeps 8-bit path costs from overflowing.
+	void ScaleCosts();
 
-	void census_transform_5x5(const uint8_t* source, uint32_t* census, const int32_t& width, const int32_t& height);
+	// Tables of the two terms of a combined matching cost.
+	void BuildCostTables();
 
+	// in and out must not alias. 3x3 and 5x5 go through sorting networks, larger windows through a
+	// constant-time histogram median on disparities quantized to 1/16 pixel.
 	void MedianFilter(const float* in, float* out, const int32_t& width, const int32_t& height, const int32_t wnd_size);
 
 	void RemoveSpeckles(float* disparity_map, const int32_t& width, const int32_t& height, const int32_t& diff_insame, const uint32_t& min_speckle_aera, const float& invalid_val);
 
-	void CensusTransform();
+	// Mutual information is estimated first, then the cost volume is computed.
+	void ComputeCost(const uint8_t* img_left, const uint8_t* img_right, uint8_t* cost_init);
 
-	void ComputeCost();
+	void ComputeCostVolume(const uint8_t* img_left, const uint8_t* img_right, uint8_t* cost_init);
+
+	// ComputeCostVolume() for the census word of option_.census_type, uint32_t or uint64_t.
+	template <typename Census>
+	void ComputeMatchingCost(const uint8_t* img_left, const uint8_t* img_right, uint8_t* cost_init,
+		sgm_kernels::CensusRowFunc<Census> census_row, sgm_kernels::CensusCostRowFunc<Census> cost_row_func);
+
+	// Values the second term of a combined cost compares for image row 'row': intensities or gradients.
+	void CostTermRow(const uint8_t* source, const int32_t& height, const int32_t& row, uint8_t* term) const;
+
+	// Mutual information: the half resolution match (coarse_) whose disparities the MI table of a match is
+	// estimated from. The coarsest level starts from random disparities and refines the table by matching itself.
+	static bool HasMiGuide(const int32_t& width, const int32_t& height, const SGMOption& option);
+
+	static SGMOption MiGuideOption(const SGMOption& option);
+
+	// MI table of the pair from the guide level, or iterated at this level.
+	void UpdateMutualInformation(const uint8_t* img_left, const uint8_t* img_right, uint8_t* cost_init);
+
+	// mi_cost_ from the joint histogram of the pixel pairs a (coarser) disparity map matches, scaled up by
+	// 'scale', or of random pairs for guide == nullptr.
+	void EstimateMutualInformation(const uint8_t* img_left, const uint8_t* img_right, const float* guide,
+		const int32_t& guide_width, const int32_t& guide_height, const int32_t& scale);
+
+	// One match of img_left_ and img_right_ into disp_left_ in the mode of the option, with its stats.
+	bool MatchFrame();
+
+	// Everything after the cost volume: aggregation, disparity selection and post-processing into disp_left_.
+	void MatchCost();
+
+	// LR check, speckle removal, hole filling and median filter of disp_left_.
+	void PostProcessing();
+
+	static bool IsPyramid(const int32_t& width, const int32_t& height, const SGMOption& option);
+
+	// Whether frames with a previous one are matched through the compact volumes.
+	static bool IsTemporal(const SGMOption& option);
+
+	static SGMOption CoarseOption(const SGMOption& option);
+
+	static bool IsDecimatedLr(const int32_t& width, const int32_t& height, const SGMOption& option);
+
+	// Half resolution matching of the mirrored pair, which makes the right image the reference.
+	static SGMOption RightReferenceOption(const SGMOption& option);
+
+	// disp_right_ from the right-reference match, upsampled to full resolution.
+	void MatchRightReference();
+
+	// 2x2 box filter into a (width / 2) x (height / 2) image.
+	static void Downsample(const uint8_t* source, const int32_t& width, const int32_t& height, uint8_t* target);
+
+	bool MatchPyramid();
+
+	// Temporal mode: the compact volumes over ranges around the previous disp_left_ (moved by the motion hint), and again
+	// with the full range for the pixels whose winner fell on the border of their range. False without a result
+	// when more than option.temporal_fallback of them did.
+	bool MatchTemporal(const float* motion);
+
+	// Widens the range of every pixel whose aggregated costs are lowest on a border of its narrowed range to the
+	// full range, unless more than 'limit' pixels are. Returns their number and flags them in range_widened_, the
+	// matching costs and Lr of the other pixels move along with the new layout.
+	size_t WidenRanges(const size_t& limit);
+
+	// Grows the compact volumes to hold 'size' costs, keeping the first 'kept' matching costs and Lr.
+	void ReserveCompact(const size_t& size, const size_t& kept);
+
+	static SGMOption RegionOption(const SGMOption& option);
+
+	// Region queries: the window a region is matched in, clipped to the image.
+	Region RegionWindow(const Region& region) const;
+
+	// Crops the window out of both images and matches it with region_ into disp_region_.
+	bool MatchWindow(const uint8_t* img_left, const uint8_t* img_right, const Region& window);
+
+	// Per-pixel search ranges from a coarser or the previous disparity map: the 3x3 guide neighbourhood scaled by
+	// 'scale' and widened by 'margin', the full range where the guide has no valid disparity. Lays out the compact volumes.
+	void BuildRanges(const float* guide, const int32_t& guide_width, const int32_t& guide_height, const int32_t& scale, const int32_t& margin);
+
+	// Matching costs of all pixels, or only of those flagged in 'widened'.
+	void ComputeCompactCost(const uint8_t* widened);
+
+	template <typename Census>
+	void ComputeCompactMatchingCost(sgm_kernels::CensusRowFunc<Census> census_row, const uint8_t* widened);
+
+	// With 'widened' only the Lr that the widened pixels change are computed again.
+	void CompactAggregation(const uint8_t* widened);
+
+	// Lr of direction (dr, dc) for rows [row_begin, row_end) (horizontal) or the whole image into cost_path.
+	template <typename PathCost>
+	void CompactAggregatePaths(const int32_t& dr, const int32_t& dc, const int32_t& row_begin, const int32_t& row_end,
+		const uint8_t* widened, PathCost* cost_path, uint8_t* path_buffer);
+
+	// Aggregated cost of a disparity of a pixel, false when outside the pixel's range.
+	bool CompactCost(const size_t& pixel, const int32_t& disparity, uint16_t& cost) const;
+
+	// Left and (for the LR check) right disparity maps from the compact volume.
+	void ComputeCompactDisparity();
+
+	// Uniqueness check and parabola fit of one winner, INVALID_FLOAT when it fails or a neighbour is missing.
+	float SubpixelDisparity(const int32_t& best_disparity, const uint16_t& min_cost, const uint16_t& sec_min_cost,
+		const bool& has_cost_1, const uint16_t& cost_1, const bool& has_cost_2, const uint16_t& cost_2) const;
 
 	void CostAggregation();
 
+	// Left disparities and, with the LR check, the right ones in the same sweep over cost_aggr_.
 	void ComputeDisparity();
 
-	void ComputeDisparityRight();
+	// Confidence of image row 'row' from its wta_rows_ row, right_min (nullptr without a right view) holds the
+	// right-view minima of the row.
+	void ConfidenceRow(const int32_t& row, const uint16_t* wta_row, const uint16_t* right_min);
 
 	void LRCheck();
 
+	// Fills the invalid pixels from the first valid disparity along 8 rays, with the rays of a whole pass
+	// swept once over the map instead of walked per pixel.
 	void FillHolesInDispMap();
 
 	void Release();
 
+	// Memory part of stats_, from the allocated capacities.
+	void UpdateMemoryStats();
+
 private:
 
 	SGMOption option_;
 
+	// Penalties the paths are aggregated with and, for 8-bit path costs with large penalties, the rescaling
+	// of the matching costs (empty when none is needed). See ScaleCosts().
+	int32_t p1_;
+	int32_t p2_init_;
+	std::vector<uint8_t> cost_scale_;
+
 
 	int32_t width_;
 	int32_t height_;
@@ -112,29 +398,130 @@ private:
 	const uint8_t* img_right_;
 
 
-	uint32_t* census_left_;
-	uint32_t* census_right_;
+	// Census rows of the images, one row per cost task (num_path_chunks_ rows each). Census types of up
+	// to 32 bits use them as uint32_t rows.
+	uint64_t* census_left_;
+	uint64_t* census_right_;
 
 
+	// sgm_kernels::CostBytes() per pixel, cost_capacity_ bytes each.
 	uint8_t* cost_init_;
+	// Back buffer of cost_init_ for MatchStream().
+	uint8_t* cost_init_next_;
+	size_t cost_capacity_;
+	// Packed6: the unpacked cost row of each cost task.
+	uint8_t* cost_rows_;
+	// Left and mirrored right row of the second cost term (MI: of the intensities) per cost task.
+	uint8_t* cost_terms_;
+	uint8_t census_lut_[64];
+	uint8_t term_lut_[64];
+	// Mutual information: the cost table (sgm_kernels::kCostTableSize bytes) and the scratch of its estimation.
+	uint8_t* mi_cost_;
+	float* mi_scratch_;
 
 
 	uint16_t* cost_aggr_;
 
-	uint8_t* cost_aggr_1_;
-	uint8_t* cost_aggr_2_;
-	uint8_t* cost_aggr_3_;
-	uint8_t* cost_aggr_4_;
-	uint8_t* cost_aggr_5_;
-	uint8_t* cost_aggr_6_;
-	uint8_t* cost_aggr_7_;
-	uint8_t* cost_aggr_8_;
+	// Lr of each direction, of the path cost type of option_.cost_storage. Only the NumDirections() first are allocated.
+	static const int32_t kMaxPaths = 16;
+	uint8_t* cost_aggr_paths_[kMaxPaths];
 
 	float* disp_left_;
 	float* disp_right_;
 
 	bool is_initialized_;
 
-	std::vector<std::pair<int, int>> occlusions_;
-	std::vector<std::pair<int, int>> mismatches_;
+	// The aggregation kernels depend on the cost storage and are selected by the templates that run them.
+	sgm_kernels::CensusRowFunc<uint32_t> census_row_;
+	sgm_kernels::CensusRowFunc<uint64_t> census_row64_;
+	sgm_kernels::CensusCostRowFunc<uint32_t> cost_row_;
+	sgm_kernels::CensusCostRowFunc<uint64_t> cost_row64_;
+	sgm_kernels::CombineCostRowFunc combine_cost_row_;
+	sgm_kernels::TableCostRowFunc table_cost_row_;
+	sgm_kernels::PackCostsFunc pack_costs_;
+	// Kernel specialized for the disparity range.
+	sgm_kernels::WtaFunc wta_;
+	sgm_kernels::WtaRightRowFunc wta_right_;
+	sgm_kernels::LrCheckRowFunc lr_check_row_;
+
+	ThreadPool* pool_;
+	bool owns_pool_;
+	// PathTaskCount() buffers of PathBufferSize() bytes: two (disp_range + 2) path buffers per task and num_path_chunks_
+	// tasks per direction, for MGM two lines of them per pass (hierarchical mode: remap buffers and rows of path minima).
+	uint8_t* path_buffer_;
+	size_t path_buffer_capacity_;
+	int32_t num_path_chunks_;
+
+	// Strip borders of MatchStrip()/AggregateUpward(), nullptr for a whole image.
+	const PathSeam* seam_;
+
+	// Sizes the buffers were allocated for: pixels, row width, disparities and cost volume elements.
+	size_t img_capacity_;
+	int32_t row_capacity_;
+	int32_t disp_capacity_;
+	size_t volume_capacity_;
+
+	// Hierarchical mode or MI guide: the half resolution level, its images and result.
+	bool is_pyramid_;
+	SemiGlobalMatching* coarse_;
+	uint8_t* img_coarse_left_;
+	uint8_t* img_coarse_right_;
+	float* disp_coarse_;
+	size_t coarse_capacity_;
+
+	// Decimated LR check: the right-reference matcher, its mirrored half resolution images and result.
+	SemiGlobalMatching* right_ref_;
+	uint8_t* img_ref_left_;
+	uint8_t* img_ref_right_;
+	float* disp_ref_;
+	size_t ref_capacity_;
+
+	// Region queries: the matcher of the windows (no confidence), the cropped images and their result.
+	SemiGlobalMatching* region_;
+	uint8_t* img_region_left_;
+	uint8_t* img_region_right_;
+	float* disp_region_;
+	size_t region_capacity_;
+
+	// Temporal mode: whether disp_left_ holds the previous frame, and the motion hint of the next match.
+	bool has_history_;
+	const float* motion_;
+	// The last match went through the compact volumes (hierarchical mode, temporal frames with history).
+	bool is_compact_match_;
+
+	// Disparities [range_begin_[p], range_begin_[p] + range_offset_[p + 1] - range_offset_[p]) of pixel p are
+	// stored from range_offset_[p] on in the compact cost volumes.
+	int32_t* range_begin_;
+	size_t* range_offset_;
+	// Temporal mode: 1 for the pixels the last WidenRanges() gave the full range.
+	uint8_t* range_widened_;
+	uint8_t* compact_cost_init_;
+	uint16_t* compact_cost_aggr_;
+	// Lr of each direction, compact_capacity_ path costs apart. The compact matching costs are never packed.
+	uint8_t* compact_cost_paths_;
+	size_t compact_capacity_;
+
+	// Right view minima (min and second min) and winners, one row per task. The dense mode keeps the
+	// winners as a third uint16_t row, followed by the 8 rows of WtaRightRow() scratch.
+	uint16_t* right_cost_;
+	int32_t* right_best_;
+
+	// Confidence map, and per task the row of left WTA results it is computed from: minimum, second minimum,
+	// winner (offset from min_disparity) and the costs before and after the winner, width values each.
+	float* confidence_;
+	uint16_t* wta_rows_;
+
+	MatchStats stats_;
+
+	// LR check class of every pixel (sgm_kernels::LrClass), 2 bits each with rows of (width_ + 3) / 4 bytes.
+	std::vector<uint8_t> lr_classes_;
+
+	// Scratch of the disparity and post-processing stages, kept so repeated matches do not allocate.
+	std::vector<uint8_t> median_scratch_;
+	std::vector<int32_t> speckle_labels_;
+	std::vector<float> fill_nearest_;
+	std::vector<int32_t> point_order_;
+	// MatchPoints(): the windows, and where the points of each end in point_order_.
+	std::vector<Region> point_windows_;
+	std::vector<int32_t> point_ends_;
 };
\ No newline at end of file
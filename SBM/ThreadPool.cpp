@@ -0,0 +1,90 @@
+#include "ThreadPool.h"
+#include <algorithm>
+
+ThreadPool::ThreadPool(const int32_t& num_threads) : head_(nullptr), tail_(nullptr), stop_(false)
+{
+	int32_t size = num_threads;
+	if (size <= 0) {
+		size = std::max(1, static_cast<int32_t>(std::thread::hardware_concurrency()));
+	}
+	for (int32_t i = 1; i < size; i++) {
+		workers_.emplace_back(&ThreadPool::WorkerLoop, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	work_cond_.notify_all();
+	for (auto& worker : workers_) {
+		worker.join();
+	}
+}
+
+void ThreadPool::Run(Batch& batch)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	batch.next = 0;
+	batch.pending = batch.count;
+	batch.next_batch = nullptr;
+	if (tail_) {
+		tail_->next_batch = &batch;
+	}
+	else {
+		head_ = &batch;
+	}
+	tail_ = &batch;
+	work_cond_.notify_all();
+
+	// The caller works on its own batch until every index is claimed, then waits for the stragglers.
+	while (batch.next < batch.count) {
+		const int32_t index = batch.next++;
+		if (batch.next == batch.count) {
+			// Fully claimed, unlink so the workers skip it.
+			Batch** link = &head_;
+			Batch* prev = nullptr;
+			while (*link != &batch) {
+				prev = *link;
+				link = &(*link)->next_batch;
+			}
+			*link = batch.next_batch;
+			if (tail_ == &batch) {
+				tail_ = prev;
+			}
+		}
+		lock.unlock();
+		batch.run(batch.context, index);
+		lock.lock();
+		batch.pending--;
+	}
+	done_cond_.wait(lock, [&batch]() { return batch.pending == 0; });
+}
+
+void ThreadPool::WorkerLoop()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true) {
+		work_cond_.wait(lock, [this]() { return stop_ || head_ != nullptr; });
+		if (stop_) {
+			return;
+		}
+
+		Batch* batch = head_;
+		const int32_t index = batch->next++;
+		if (batch->next == batch->count) {
+			head_ = batch->next_batch;
+			if (head_ == nullptr) {
+				tail_ = nullptr;
+			}
+		}
+		lock.unlock();
+		batch->run(batch->context, index);
+		lock.lock();
+		if (--batch->pending == 0) {
+			done_cond_.notify_all();
+		}
+	}
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class ThreadPool
+{
+public:
+	// num_threads counts the calling thread, 0 means one per hardware thread.
+	explicit ThreadPool(const int32_t& num_threads);
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	int32_t Size() const { return static_cast<int32_t>(workers_.size()) + 1; }
+
+	// Runs task(0) ... task(count - 1) on the workers and the calling thread and returns once all of them
+	// finished. Several threads may run batches at the same time; nothing is allocated per call.
+	template <typename Task>
+	void ParallelFor(const int32_t& count, Task&& task)
+	{
+		typedef typename std::remove_reference<Task>::type TaskType;
+		if (count <= 0) {
+			return;
+		}
+		if (workers_.empty() || count == 1) {
+			for (int32_t i = 0; i < count; i++) {
+				task(i);
+			}
+			return;
+		}
+
+		Batch batch;
+		batch.run = [](void* context, int32_t index) { (*static_cast<TaskType*>(context))(index); };
+		batch.context = const_cast<void*>(static_cast<const void*>(std::addressof(task)));
+		batch.count = count;
+		Run(batch);
+	}
+
+private:
+	struct Batch {
+		void (*run)(void*, int32_t);
+		void* context;
+		int32_t count;
+		int32_t next;
+		int32_t pending;
+		Batch* next_batch;
+	};
+
+	void Run(Batch& batch);
+
+	void WorkerLoop();
+
+	std::vector<std::thread> workers_;
+
+	std::mutex mutex_;
+	std::condition_variable work_cond_;
+	std::condition_variable done_cond_;
+
+	// Batches that still have unclaimed indices, oldest first.
+	Batch* head_;
+	Batch* tail_;
+	bool stop_;
+};
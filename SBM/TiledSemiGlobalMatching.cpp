@@ -0,0 +1,195 @@
+#include "TiledSemiGlobalMatching.h"
+#include <algorithm>
+#include <cstring>
+
+#ifndef SAFE_DELETE
+#define SAFE_DELETE(P) {if(P) delete[](P);(P)=nullptr;}
+#endif
+
+TiledSemiGlobalMatching::TiledSemiGlobalMatching() : width_(0), height_(0), strip_rows_(0), overlap_(0), num_strips_(0),
+strip_disp_(nullptr), seam_size_(0), seam_up_(nullptr), seam_down_(nullptr), seam_down_next_(nullptr),
+is_initialized_(false)
+{
+}
+
+TiledSemiGlobalMatching::~TiledSemiGlobalMatching()
+{
+	Release();
+}
+
+size_t TiledSemiGlobalMatching::StripMemory(const int32_t& strip_rows, const int32_t& overlap) const
+{
+	const int32_t rows = std::min(height_, strip_rows + 2 * overlap);
+	size_t bytes = SemiGlobalMatching::RequiredMemory(width_, rows, option_) + static_cast<size_t>(width_) * rows * sizeof(float);
+	const int32_t num_strips = (height_ + strip_rows - 1) / strip_rows;
+	if (tile_option_.is_carry_paths && num_strips > 1 && seam_size_ > 0) {
+		bytes += (num_strips + 2) * seam_size_;
+	}
+	return bytes;
+}
+
+bool TiledSemiGlobalMatching::Initialize(const int32_t& width, const int32_t& height, const SemiGlobalMatching::SGMOption& option,
+	const TileOption& tile_option)
+{
+	Release();
+
+	width_ = width;
+	height_ = height;
+	option_ = option;
+	tile_option_ = tile_option;
+
+	if (width <= 0 || height <= 0 || tile_option.overlap < 0) {
+		return false;
+	}
+	if (SemiGlobalMatching::RequiredMemory(width, 1, option) == 0) {
+		return false;
+	}
+	const int32_t disp_range = option.max_disparity - option.min_disparity;
+	seam_size_ = static_cast<size_t>(SemiGlobalMatching::SeamPathCount(option)) * width * disp_range *
+		sgm_kernels::PathCostBytes(option.cost_storage);
+
+	if (tile_option.memory_budget == 0 || StripMemory(height, 0) <= tile_option.memory_budget) {
+		// Fits as a whole, no strips and no overlap.
+		strip_rows_ = height;
+		overlap_ = 0;
+	}
+	else {
+		// Tallest strip within the budget. With carried paths fewer strips also need fewer seams,
+		// so the memory is not monotonic in the strip height and every height is tried. Carried
+		// knight-move paths leave two rows of each strip and need at least two rows per strip.
+		overlap_ = tile_option.overlap;
+		strip_rows_ = 0;
+		const int32_t min_rows = (tile_option.is_carry_paths && option.num_paths == 16) ? 2 : 1;
+		for (int32_t rows = height - 1; rows >= min_rows; rows--) {
+			if (StripMemory(rows, overlap_) <= tile_option.memory_budget) {
+				strip_rows_ = rows;
+				break;
+			}
+		}
+		if (strip_rows_ <= 0) {
+			return false;
+		}
+	}
+	num_strips_ = (height + strip_rows_ - 1) / strip_rows_;
+
+	const int32_t total_rows = std::min(height, strip_rows_ + 2 * overlap_);
+	if (!matcher_.Reset(width, total_rows, option)) {
+		return false;
+	}
+	strip_disp_ = new float[static_cast<size_t>(width) * total_rows]();
+	if (tile_option.is_carry_paths && num_strips_ > 1 && seam_size_ > 0) {
+		seam_up_ = new uint8_t[num_strips_ * seam_size_]();
+		seam_down_ = new uint8_t[seam_size_]();
+		seam_down_next_ = new uint8_t[seam_size_]();
+	}
+
+	is_initialized_ = true;
+	return is_initialized_;
+}
+
+bool TiledSemiGlobalMatching::Match(const uint8_t* img_left, const uint8_t* img_right, float* disp_left)
+{
+	if (disp_left == nullptr) {
+		return false;
+	}
+
+	const int32_t width = width_;
+	return MatchStrips(img_left, img_right, [disp_left, width](const int32_t& row, const int32_t& rows, const float* disp) {
+		memcpy(disp_left + static_cast<size_t>(row) * width, disp, static_cast<size_t>(rows) * width * sizeof(float));
+	});
+}
+
+bool TiledSemiGlobalMatching::MatchStrips(const uint8_t* img_left, const uint8_t* img_right, const StripSink& sink)
+{
+	if (!is_initialized_) {
+		return false;
+	}
+	if (img_left == nullptr || img_right == nullptr) {
+		return false;
+	}
+
+	const int32_t width = width_;
+	const int32_t height = height_;
+	const bool is_carry = seam_up_ != nullptr;
+
+	// Rows [begin, end) matched for strip k, its core rows start at k * strip_rows_.
+	auto strip_begin = [&](const int32_t& k) { return std::max(0, k * strip_rows_ - overlap_); };
+	auto strip_end = [&](const int32_t& k) { return std::min(height, (k + 1) * strip_rows_ + overlap_); };
+	auto row_ptr = [width](const uint8_t* img, const int32_t& row) { return img + static_cast<size_t>(row) * width; };
+
+	// Bottom-up pass: the upward paths of strip k + 1 leave on the first row below strip k,
+	// which is inside strip k + 1 thanks to the overlap.
+	if (is_carry) {
+		for (int32_t k = num_strips_ - 1; k > 0; k--) {
+			if (strip_end(k - 1) >= height) {
+				continue;
+			}
+			const int32_t begin = strip_begin(k);
+			const int32_t end = strip_end(k);
+			SemiGlobalMatching::PathSeam seam;
+			if (end < height) {
+				seam.enter_bottom = seam_up_ + k * seam_size_;
+				seam.gray_bottom = row_ptr(img_left, end);
+			}
+			seam.leave_top_row = strip_end(k - 1) - begin;
+			seam.rows_above = begin;
+			seam.rows_below = height - end;
+			seam.leave_top = seam_up_ + (k - 1) * seam_size_;
+
+			if (!matcher_.Reset(width, end - begin, option_)) {
+				return false;
+			}
+			if (!matcher_.AggregateUpward(row_ptr(img_left, begin), row_ptr(img_right, begin), seam)) {
+				return false;
+			}
+		}
+	}
+
+	// Top-down pass: every strip continues the downward paths of the one above and the upward ones collected before.
+	for (int32_t k = 0; k < num_strips_; k++) {
+		const int32_t row = k * strip_rows_;
+		const int32_t row_end = std::min(height, row + strip_rows_);
+		const int32_t begin = strip_begin(k);
+		const int32_t end = strip_end(k);
+
+		SemiGlobalMatching::PathSeam seam;
+		seam.rows_above = begin;
+		seam.rows_below = height - end;
+		if (is_carry) {
+			if (begin > 0) {
+				seam.enter_top = seam_down_;
+				seam.gray_top = row_ptr(img_left, begin - 1);
+			}
+			if (end < height) {
+				seam.enter_bottom = seam_up_ + k * seam_size_;
+				seam.gray_bottom = row_ptr(img_left, end);
+			}
+			if (k + 1 < num_strips_ && strip_begin(k + 1) > 0) {
+				seam.leave_bottom_row = strip_begin(k + 1) - 1 - begin;
+				seam.leave_bottom = seam_down_next_;
+			}
+		}
+
+		// Strips at the image border are shorter, the matcher keeps its buffers for them.
+		if (!matcher_.Reset(width, end - begin, option_)) {
+			return false;
+		}
+		if (!matcher_.MatchStrip(row_ptr(img_left, begin), row_ptr(img_right, begin), strip_disp_, seam)) {
+			return false;
+		}
+		sink(row, row_end - row, strip_disp_ + static_cast<size_t>(row - begin) * width);
+
+		std::swap(seam_down_, seam_down_next_);
+	}
+
+	return true;
+}
+
+void TiledSemiGlobalMatching::Release()
+{
+	SAFE_DELETE(strip_disp_);
+	SAFE_DELETE(seam_up_);
+	SAFE_DELETE(seam_down_);
+	SAFE_DELETE(seam_down_next_);
+	is_initialized_ = false;
+}
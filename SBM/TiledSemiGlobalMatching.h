@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include "SemiGlobalMatching.h"
+
+// Matches images that are too large for the full W*H*D volumes of SemiGlobalMatching by splitting them
+// into horizontal strips. The vertical and diagonal path costs are carried across the strip borders (a
+// bottom-up pass collects the upward paths first), so the aggregated costs are those of the whole image.
+// Each strip is matched with 'overlap' extra rows above and below for the post-processing, and only its
+// core rows are kept.
+class TiledSemiGlobalMatching
+{
+public:
+	TiledSemiGlobalMatching();
+	~TiledSemiGlobalMatching();
+
+	TiledSemiGlobalMatching(const TiledSemiGlobalMatching&) = delete;
+	TiledSemiGlobalMatching& operator=(const TiledSemiGlobalMatching&) = delete;
+
+	struct TileOption {
+		size_t	memory_budget;		// bytes for the strip matcher, seams and strip disparity, 0 = whole image in one strip
+		int32_t	overlap;			// support rows matched above and below each strip and then dropped
+		bool	is_carry_paths;		// carry path costs across strips (not MGM passes), otherwise the overlap alone supports the paths
+
+		TileOption() : memory_budget(0), overlap(32), is_carry_paths(true)
+		{
+		}
+	};
+
+	// Receives 'rows' finished disparity rows starting at image row 'row', valid until the sink returns.
+	typedef std::function<void(const int32_t& row, const int32_t& rows, const float* disp_left)> StripSink;
+
+	bool Initialize(const int32_t& width, const int32_t& height, const SemiGlobalMatching::SGMOption& option,
+		const TileOption& tile_option);
+
+	// The images are only read strip by strip, so they may be memory-mapped files larger than RAM.
+	bool Match(const uint8_t* img_left, const uint8_t* img_right, float* disp_left);
+
+	bool MatchStrips(const uint8_t* img_left, const uint8_t* img_right, const StripSink& sink);
+
+	// Core rows per strip chosen to fit the memory budget.
+	int32_t StripRows() const { return strip_rows_; }
+
+private:
+	// Bytes needed for strips of 'strip_rows' core rows.
+	size_t StripMemory(const int32_t& strip_rows, const int32_t& overlap) const;
+
+	void Release();
+
+	SemiGlobalMatching::SGMOption option_;
+	TileOption tile_option_;
+
+	int32_t width_;
+	int32_t height_;
+
+	int32_t strip_rows_;
+	int32_t overlap_;
+	int32_t num_strips_;
+
+	SemiGlobalMatching matcher_;
+	float* strip_disp_;
+
+	// Upward path costs entering each strip from below (one seam per strip), and the downward
+	// path costs entering / leaving the current strip.
+	size_t seam_size_;
+	uint8_t* seam_up_;
+	uint8_t* seam_down_;
+	uint8_t* seam_down_next_;
+
+	bool is_initialized_;
+};
@@ -0,0 +1,519 @@
+// Headless benchmark of SemiGlobalMatching on synthetic rectified pairs.
+//
+//   benchmark [--size=640x480] [--disparities=64,128,256] [--min-disparity=0] [--paths=4,8] [--mgm=0]
+//             [--post=none,lr,full] [--reps=5] [--threads=1] [--simd=1] [--low-memory=0] [--median=3] [--decimated-lr=0]
+//             [--storage=u8|u16|packed6] [--census=5x5|7x9|cs7x9] [--cost=census|ad-census|gradient-census|mi]
+//             [--p2=150] [--seed=1] [--region=WxH] [--points=0] [--temporal=0]
+//
+// Every combination of disparity count, path count, post-processing mode and point count is matched 'reps'
+// times after one warm-up run, and one CSV line per combination goes to stdout: every option of the run, the
+// median run's wall time, throughput in megapixel-disparities per second, per-stage times, allocated and peak
+// resident memory, and the accuracy against the known disparities. The same arguments always produce the same
+// images. With --region only a centered region is matched (MatchRegion()), and throughput and accuracy refer to
+// that region. A point count above 0 matches that many random points of the region with MatchPoints() instead,
+// and throughput and accuracy refer to the points. With --temporal=1 every run starts from the disparities of
+// the one before, like a still camera.
+
+#include "SemiGlobalMatching.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <psapi.h>
+#elif defined(__linux__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+struct BenchOption {
+	int32_t width;
+	int32_t height;
+	std::vector<int32_t> disparities;
+	int32_t min_disparity;
+	std::vector<int32_t> paths;
+	bool is_mgm;
+	std::vector<std::string> posts;
+	int32_t reps;
+	int32_t num_threads;
+	bool is_use_simd;
+	bool is_low_memory;
+	int32_t median_window;
+	bool is_decimated_lr;
+	sgm_kernels::CostStorage cost_storage;
+	sgm_kernels::CensusType census_type;
+	sgm_kernels::MatchingCost matching_cost;
+	int32_t p2_init;
+	uint32_t seed;
+	int32_t region_width;		// centered region, 0 = whole image
+	int32_t region_height;
+	bool is_temporal;
+	std::vector<int32_t> points;	// point counts matched with MatchPoints() inside the region, 0 = the region itself
+
+	BenchOption() : width(640), height(480), disparities{ 64, 128, 256 }, min_disparity(0), paths{ 4, 8 }, is_mgm(false),
+		posts{ "none", "lr", "full" }, reps(5), num_threads(1), is_use_simd(true), is_low_memory(false), median_window(3), is_decimated_lr(false),
+		cost_storage(sgm_kernels::CostStorage::Uint8), census_type(sgm_kernels::CensusType::Census5x5),
+		matching_cost(sgm_kernels::MatchingCost::Census), p2_init(150), seed(1),
+		region_width(0), region_height(0), is_temporal(false), points{ 0 }
+	{
+	}
+};
+
+static std::vector<std::string> Split(const std::string& text)
+{
+	std::vector<std::string> items;
+	size_t begin = 0;
+	while (begin <= text.size()) {
+		const size_t end = std::min(text.find(',', begin), text.size());
+		if (end > begin) {
+			items.push_back(text.substr(begin, end - begin));
+		}
+		begin = end + 1;
+	}
+	return items;
+}
+
+static bool ParseIntList(const std::string& text, std::vector<int32_t>& values)
+{
+	values.clear();
+	for (auto& item : Split(text)) {
+		char* end = nullptr;
+		const long value = strtol(item.c_str(), &end, 10);
+		if (*end != '\0') {
+			return false;
+		}
+		values.push_back(static_cast<int32_t>(value));
+	}
+	return !values.empty();
+}
+
+static bool ParseArguments(const int& argc, char** argv, BenchOption& option)
+{
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		const size_t eq = arg.find('=');
+		if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+			return false;
+		}
+		const std::string key = arg.substr(2, eq - 2);
+		const std::string value = arg.substr(eq + 1);
+		std::vector<int32_t> values;
+		if (key == "size") {
+			if (sscanf(value.c_str(), "%dx%d", &option.width, &option.height) != 2) {
+				return false;
+			}
+		}
+		else if (key == "region") {
+			if (sscanf(value.c_str(), "%dx%d", &option.region_width, &option.region_height) != 2 ||
+				option.region_width <= 0 || option.region_height <= 0) {
+				return false;
+			}
+		}
+		else if (key == "disparities") {
+			if (!ParseIntList(value, option.disparities)) {
+				return false;
+			}
+		}
+		else if (key == "points") {
+			if (!ParseIntList(value, option.points)) {
+				return false;
+			}
+		}
+		else if (key == "paths") {
+			if (!ParseIntList(value, option.paths)) {
+				return false;
+			}
+		}
+		else if (key == "post") {
+			option.posts = Split(value);
+			for (auto& post : option.posts) {
+				if (post != "none" && post != "lr" && post != "full") {
+					return false;
+				}
+			}
+		}
+		else if (key == "storage") {
+			if (value == "u8") {
+				option.cost_storage = sgm_kernels::CostStorage::Uint8;
+			}
+			else if (value == "u16") {
+				option.cost_storage = sgm_kernels::CostStorage::Uint16;
+			}
+			else if (value == "packed6") {
+				option.cost_storage = sgm_kernels::CostStorage::Packed6;
+			}
+			else {
+				return false;
+			}
+		}
+		else if (key == "census") {
+			if (value == "5x5") {
+				option.census_type = sgm_kernels::CensusType::Census5x5;
+			}
+			else if (value == "7x9") {
+				option.census_type = sgm_kernels::CensusType::Census7x9;
+			}
+			else if (value == "cs7x9") {
+				option.census_type = sgm_kernels::CensusType::CenterSymmetric7x9;
+			}
+			else {
+				return false;
+			}
+		}
+		else if (key == "cost") {
+			if (value == "census") {
+				option.matching_cost = sgm_kernels::MatchingCost::Census;
+			}
+			else if (value == "ad-census") {
+				option.matching_cost = sgm_kernels::MatchingCost::AdCensus;
+			}
+			else if (value == "gradient-census") {
+				option.matching_cost = sgm_kernels::MatchingCost::GradientCensus;
+			}
+			else if (value == "mi") {
+				option.matching_cost = sgm_kernels::MatchingCost::MutualInformation;
+			}
+			else {
+				return false;
+			}
+		}
+		else if (ParseIntList(value, values) && values.size() == 1) {
+			if (key == "min-disparity") {
+				option.min_disparity = values[0];
+			}
+			else if (key == "reps") {
+				option.reps = std::max(1, values[0]);
+			}
+			else if (key == "threads") {
+				option.num_threads = values[0];
+			}
+			else if (key == "simd") {
+				option.is_use_simd = values[0] != 0;
+			}
+			else if (key == "low-memory") {
+				option.is_low_memory = values[0] != 0;
+			}
+			else if (key == "median") {
+				option.median_window = values[0];
+			}
+			else if (key == "mgm") {
+				option.is_mgm = values[0] != 0;
+			}
+			else if (key == "decimated-lr") {
+				option.is_decimated_lr = values[0] != 0;
+			}
+			else if (key == "p2") {
+				option.p2_init = values[0];
+			}
+			else if (key == "seed") {
+				option.seed = static_cast<uint32_t>(values[0]);
+			}
+			else if (key == "temporal") {
+				option.is_temporal = values[0] != 0;
+			}
+			else {
+				return false;
+			}
+		}
+		else {
+			return false;
+		}
+	}
+	for (auto& num_points : option.points) {
+		if (num_points < 0) {
+			return false;
+		}
+	}
+	return option.width > 0 && option.height > 0 && option.region_width <= option.width && option.region_height <= option.height;
+}
+
+// The flag values of the enum options, for the CSV columns.
+static const char* StorageName(const sgm_kernels::CostStorage& storage)
+{
+	switch (storage) {
+	case sgm_kernels::CostStorage::Uint16:
+		return "u16";
+	case sgm_kernels::CostStorage::Packed6:
+		return "packed6";
+	default:
+		return "u8";
+	}
+}
+
+static const char* CensusName(const sgm_kernels::CensusType& census)
+{
+	switch (census) {
+	case sgm_kernels::CensusType::Census7x9:
+		return "7x9";
+	case sgm_kernels::CensusType::CenterSymmetric7x9:
+		return "cs7x9";
+	default:
+		return "5x5";
+	}
+}
+
+static const char* CostName(const sgm_kernels::MatchingCost& cost)
+{
+	switch (cost) {
+	case sgm_kernels::MatchingCost::AdCensus:
+		return "ad-census";
+	case sgm_kernels::MatchingCost::GradientCensus:
+		return "gradient-census";
+	case sgm_kernels::MatchingCost::MutualInformation:
+		return "mi";
+	default:
+		return "census";
+	}
+}
+
+// Rectified pair with known disparities: a slanted background plane and fronto-parallel boxes in front of
+// it, textured with smoothed noise. The right image is the left one forward-warped by the true disparities,
+// nearer surfaces winning; right pixels nothing maps to get fresh texture.
+static void MakeStereoPair(const int32_t& width, const int32_t& height, const int32_t& min_disparity, const int32_t& max_disparity,
+	const uint32_t& seed, std::vector<uint8_t>& left, std::vector<uint8_t>& right, std::vector<float>& disp_truth)
+{
+	std::mt19937 rng(seed);
+	const size_t img_size = static_cast<size_t>(width) * height;
+
+	std::vector<int32_t> noise(img_size), blurred(img_size);
+	for (auto& value : noise) {
+		value = static_cast<int32_t>(rng() & 0xFF);
+	}
+	// 3x3 box filter, so neighbouring pixels correlate like in a real image.
+	for (int32_t i = 0; i < height; i++) {
+		for (int32_t j = 0; j < width; j++) {
+			int32_t sum = 0, count = 0;
+			for (int32_t r = std::max(0, i - 1); r <= std::min(height - 1, i + 1); r++) {
+				for (int32_t c = std::max(0, j - 1); c <= std::min(width - 1, j + 1); c++) {
+					sum += noise[r * width + c];
+					count++;
+				}
+			}
+			blurred[i * width + j] = sum / count;
+		}
+	}
+	left.resize(img_size);
+	for (size_t i = 0; i < img_size; i++) {
+		left[i] = static_cast<uint8_t>(blurred[i]);
+	}
+
+	// Keep clear of the range ends, where no sub-pixel fit is possible.
+	const int32_t disp_range = max_disparity - min_disparity;
+	const int32_t lo = min_disparity + 1;
+	const int32_t hi = std::max(lo, max_disparity - 2);
+	std::vector<int32_t> disp(img_size);
+	for (int32_t i = 0; i < height; i++) {
+		for (int32_t j = 0; j < width; j++) {
+			disp[i * width + j] = lo + (hi - lo) * (i + j) / (2 * (width + height));
+		}
+	}
+	std::uniform_int_distribution<int32_t> box_disp(lo + (hi - lo) / 2, hi);
+	for (int32_t b = 0; b < 6; b++) {
+		const int32_t box_w = std::max(1, width / 8 + static_cast<int32_t>(rng() % std::max(1, width / 8)));
+		const int32_t box_h = std::max(1, height / 8 + static_cast<int32_t>(rng() % std::max(1, height / 8)));
+		const int32_t top = static_cast<int32_t>(rng() % std::max(1, height - box_h));
+		const int32_t left_col = static_cast<int32_t>(rng() % std::max(1, width - box_w));
+		const int32_t d = (disp_range > 3) ? box_disp(rng) : lo;
+		for (int32_t i = top; i < std::min(height, top + box_h); i++) {
+			for (int32_t j = left_col; j < std::min(width, left_col + box_w); j++) {
+				disp[i * width + j] = std::max(disp[i * width + j], d);
+			}
+		}
+	}
+
+	right.resize(img_size);
+	disp_truth.resize(img_size);
+	std::vector<int32_t> depth(width);
+	for (int32_t i = 0; i < height; i++) {
+		std::fill(depth.begin(), depth.end(), INT32_MIN);
+		for (int32_t j = 0; j < width; j++) {
+			right[i * width + j] = static_cast<uint8_t>(rng() & 0xFF);
+		}
+		for (int32_t j = 0; j < width; j++) {
+			const int32_t d = disp[i * width + j];
+			const int32_t col_right = j - d;
+			disp_truth[i * width + j] = static_cast<float>(d);
+			if (col_right >= 0 && col_right < width && d > depth[col_right]) {
+				depth[col_right] = d;
+				right[i * width + col_right] = left[i * width + j];
+			}
+		}
+	}
+}
+
+// Lets every configuration report its own peak where the OS allows resetting it (Linux).
+static void ResetPeakRss()
+{
+#if defined(__linux__)
+	FILE* file = fopen("/proc/self/clear_refs", "w");
+	if (file != nullptr) {
+		fputs("5", file);
+		fclose(file);
+	}
+#endif
+}
+
+static double PeakRssMb()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return counters.PeakWorkingSetSize / 1048576.0;
+	}
+	return 0.0;
+#elif defined(__linux__) || defined(__APPLE__)
+#if defined(__linux__)
+	// VmHWM follows clear_refs, ru_maxrss does not.
+	FILE* file = fopen("/proc/self/status", "r");
+	if (file != nullptr) {
+		char line[256];
+		long kb = -1;
+		while (fgets(line, sizeof(line), file) != nullptr) {
+			if (sscanf(line, "VmHWM: %ld kB", &kb) == 1) {
+				break;
+			}
+		}
+		fclose(file);
+		if (kb >= 0) {
+			return kb / 1024.0;
+		}
+	}
+#endif
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#if defined(__APPLE__)
+	return usage.ru_maxrss / 1048576.0;
+#else
+	return usage.ru_maxrss / 1024.0;
+#endif
+#else
+	return 0.0;
+#endif
+}
+
+int main(int argc, char** argv)
+{
+	BenchOption bench;
+	if (!ParseArguments(argc, argv, bench)) {
+		fprintf(stderr, "usage: %s [--size=WxH] [--disparities=64,128,256] [--min-disparity=0] [--paths=4,8] [--mgm=0] "
+			"[--post=none,lr,full] [--reps=5] [--threads=1] [--simd=1] [--low-memory=0] [--median=3] [--decimated-lr=0] "
+			"[--storage=u8|u16|packed6] [--census=5x5|7x9|cs7x9] [--cost=census|ad-census|gradient-census|mi] [--p2=150] [--seed=1] [--region=WxH] [--points=0] [--temporal=0]\n", argv[0]);
+		return 2;
+	}
+
+	const int32_t width = bench.width;
+	const int32_t height = bench.height;
+	const bool is_region = bench.region_width > 0;
+	const SemiGlobalMatching::Region region = is_region ?
+		SemiGlobalMatching::Region((width - bench.region_width) / 2, (height - bench.region_height) / 2, bench.region_width, bench.region_height) :
+		SemiGlobalMatching::Region(0, 0, width, height);
+	// One column per option, so rows of different runs can be told apart and compared.
+	printf("width,height,min_disparity,disparities,paths,mgm,post,threads,simd,low_memory,median,decimated_lr,storage,census,cost,"
+		"p2,seed,region,points,temporal,reps,total_ms,mpd_per_s,"
+		"cost_ms,aggregation_ms,wta_ms,lr_check_ms,speckle_ms,fill_ms,median_ms,allocated_mb,peak_rss_mb,valid,accuracy_1px\n");
+
+	for (auto& disp_range : bench.disparities) {
+		if (disp_range <= 0) {
+			fprintf(stderr, "invalid disparity count %d\n", disp_range);
+			return 2;
+		}
+		const int32_t min_disparity = bench.min_disparity;
+		const int32_t max_disparity = min_disparity + disp_range;
+		std::vector<uint8_t> img_left, img_right;
+		std::vector<float> disp_truth;
+		MakeStereoPair(width, height, min_disparity, max_disparity, bench.seed, img_left, img_right, disp_truth);
+		std::vector<float> region_disparity(static_cast<size_t>(region.width) * region.height);
+
+		for (auto& num_paths : bench.paths) {
+			for (auto& post : bench.posts) {
+				for (auto& num_points : bench.points) {
+					SemiGlobalMatching::SGMOption option;
+					option.num_paths = static_cast<uint8_t>(num_paths);
+					option.min_disparity = min_disparity;
+					option.max_disparity = max_disparity;
+					option.is_check_lr = post != "none";
+					option.is_check_unique = post != "none";
+					option.is_remove_speckles = post == "full";
+					option.is_fill_holes = post == "full";
+					option.is_use_simd = bench.is_use_simd;
+					option.num_threads = bench.num_threads;
+					option.is_low_memory = bench.is_low_memory;
+					option.median_window = bench.median_window;
+					option.is_decimated_lr = bench.is_decimated_lr;
+					option.is_mgm = bench.is_mgm;
+					option.cost_storage = bench.cost_storage;
+					option.census_type = bench.census_type;
+					option.matching_cost = bench.matching_cost;
+					option.p2_init = bench.p2_init;
+					option.is_temporal = bench.is_temporal;
+
+					// The same points for every configuration of one count.
+					std::vector<SemiGlobalMatching::Point> points(num_points);
+					std::mt19937 rng(bench.seed);
+					for (auto& point : points) {
+						point.x = region.x + static_cast<int32_t>(rng() % region.width);
+						point.y = region.y + static_cast<int32_t>(rng() % region.height);
+					}
+					std::vector<float> point_disparity(num_points);
+					std::vector<float>& disparity = (num_points > 0) ? point_disparity : region_disparity;
+
+					ResetPeakRss();
+					std::vector<SemiGlobalMatching::MatchStats> runs;
+					size_t allocated = 0;
+					{
+						SemiGlobalMatching sgm;
+						auto match = [&]() {
+							if (num_points > 0) {
+								return sgm.MatchPoints(img_left.data(), img_right.data(), points.data(), num_points, disparity.data());
+							}
+							return is_region ? sgm.MatchRegion(img_left.data(), img_right.data(), region, disparity.data()) :
+								sgm.Match(img_left.data(), img_right.data(), disparity.data());
+						};
+						if (!sgm.Initialize(width, height, option) || !match()) {
+							fprintf(stderr, "matching failed for %d disparities, %d paths\n", disp_range, num_paths);
+							return 1;
+						}
+						for (int32_t r = 0; r < bench.reps; r++) {
+							match();
+							runs.push_back(sgm.Stats());
+						}
+						allocated = sgm.Stats().total_bytes;
+					}
+					const double peak_rss = PeakRssMb();
+
+					std::sort(runs.begin(), runs.end(), [](const SemiGlobalMatching::MatchStats& a, const SemiGlobalMatching::MatchStats& b) {
+						return a.total_ms < b.total_ms;
+					});
+					const auto& median = runs[runs.size() / 2];
+
+					size_t valid = 0, correct = 0;
+					for (size_t i = 0; i < disparity.size(); i++) {
+						const size_t pixel = (num_points > 0) ? static_cast<size_t>(points[i].y) * width + points[i].x :
+							static_cast<size_t>(region.y + i / region.width) * width + region.x + i % region.width;
+						if (disparity[i] != INVALID_FLOAT) {
+							valid++;
+							correct += (fabs(disparity[i] - disp_truth[pixel]) <= 1.0f) ? 1 : 0;
+						}
+					}
+					const double mpd = static_cast<double>(disparity.size()) * disp_range / 1e6;
+
+					printf("%d,%d,%d,%d,%d,%d,%s,%d,%d,%d,%d,%d,%s,%s,%s,%d,%u,%dx%d,%d,%d,%d,%.3f,%.2f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.2f,%.2f,%.4f,%.4f\n",
+						width, height, min_disparity, disp_range, num_paths, bench.is_mgm ? 1 : 0, post.c_str(), bench.num_threads,
+						bench.is_use_simd ? 1 : 0, bench.is_low_memory ? 1 : 0, bench.median_window, bench.is_decimated_lr ? 1 : 0,
+						StorageName(bench.cost_storage), CensusName(bench.census_type), CostName(bench.matching_cost), bench.p2_init,
+						bench.seed, region.width, region.height, num_points, bench.is_temporal ? 1 : 0, bench.reps, median.total_ms, mpd / (median.total_ms / 1000.0),
+						median.cost_ms, median.aggregation_ms, median.wta_ms, median.lr_check_ms, median.speckle_ms,
+						median.fill_ms, median.median_ms, allocated / 1048576.0, peak_rss,
+						static_cast<double>(valid) / disparity.size(), static_cast<double>(correct) / disparity.size());
+					fflush(stdout);
+				}
+			}
+		}
+	}
+	return 0;
+}
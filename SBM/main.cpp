@@ -1,4 +1,5 @@
 #include "SemiGlobalMatching.h"
+#include "DisparityFile.h"
 #include <opencv2/opencv.hpp>
 
 
@@ -49,6 +50,8 @@ int main(int argv, char** argc)
 
 	sgm_option.is_fill_holes = true;
 
+	sgm_option.confidence = sgm_kernels::ConfidenceMeasure::LeftRightDifference;
+
 
 	SemiGlobalMatching sgm;
 
@@ -56,8 +59,15 @@ int main(int argv, char** argc)
 	sgm.Initialize(width, height, sgm_option);
 
 
-	float* disparity = new float[uint32_t(width * height)]();
-	sgm.Match(bytes_left, bytes_right, disparity);
+	// Float disparities, their confidence and the aggregated costs of the middle row go to res2.sgmd, matched
+	// straight into the mapping.
+	DisparityFile result;
+	if (!result.Create("res2.sgmd", width, height, sgm_option.min_disparity, sgm_option.max_disparity, true, height / 2, 1)) {
+		return -1;
+	}
+	float* disparity = result.MutableDisparity();
+	sgm.Match(bytes_left, bytes_right, disparity, result.MutableConfidence());
+	sgm.CostSlice(height / 2, 1, result.MutableCostSlice());
 
 
 	cv::Mat disp_mat = cv::Mat(height, width, CV_8UC1);